@@ -21,6 +21,18 @@ struct optimizer {
 
 	Tensor<float> accum;
 
+	//Hang on to the first set of deltas. If we're accumulating over several
+	//steps, accum has to survive the per-step arena being reset, so it gets
+	//copied onto the regular heap.
+	void start_accum(Tensor<float>&& deltas) {
+		if (num_accums == 1) {
+			accum = std::move(deltas);
+		} else {
+			tensor_arena_pause p;
+			accum = Tensor<float>(&deltas);
+		}
+	}
+
 	//Not all optimizers need to implement this, but all layers should 
 	//call it if it makes sense
 	public:
@@ -59,15 +71,16 @@ struct optimizer {
 	//(see compiletime_rank_optimizer below). I guess it's possible for optimizers 
 	//to do something fancy but the intention is to always use the default
     virtual void update(RTSpan<float>& params, RTSpan<float> const& grad) {
-		assert(std::equal(params.dims,params.dims+params.rank,grad.dims));
+		assert(std::equal(params.dims.begin(),params.dims.begin()+params.rank,grad.dims.begin()));
 
+        TENSOR_ALLOC_TAG("optimizer");
         auto deltas = get_deltas(grad);
 
 		//If no deltas, quit early
 		if (!deltas) return;
 		
 		if (current_time == 0) {
-			accum = std::move(deltas);
+			start_accum(std::move(deltas));
 		} else {
 			auto accum_spn = &accum;
         	tensorplus(accum_spn, &deltas, accum_spn); //Can't use compile-time rank here
@@ -104,8 +117,9 @@ struct optimizer {
 template <int rank>
 struct compiletime_rank_optimizer : optimizer {
     void update(RTSpan<float>& params, RTSpan<float> const& grad) override {
-		assert(std::equal(params.dims,params.dims+params.rank,grad.dims));
+		assert(std::equal(params.dims.begin(),params.dims.begin()+params.rank,grad.dims.begin()));
 
+        TENSOR_ALLOC_TAG("optimizer");
         auto deltas = get_deltas(grad);
 
 		auto params_spn = params.as_tspan<rank>();
@@ -114,7 +128,7 @@ struct compiletime_rank_optimizer : optimizer {
 		if (!deltas) return;
 		
 		if (current_time == 0) {
-			accum = std::move(deltas);
+			start_accum(std::move(deltas));
 		} else {
 			auto accum_spn = accum.template as_tspan<rank>();
         	tensorplus(accum_spn, deltas.template as_tspan<rank>(), accum_spn); //Can't use compile-time rank here
@@ -165,20 +179,29 @@ struct layer {
 
     //feed-forward
     Tensor<float> ff_alloc(RTSpan<float> x, bool save = false) {
-		Tensor<float> ret(this->ff_result_sz(x.rank, x.dims));
+		auto ret_dims = this->ff_result_sz(x.rank, x.dims.data());
+		Tensor<float> ret;
+		{
+			TENSOR_ALLOC_TAG("output");
+			ret = Tensor<float>(ret_dims.data(), ret_dims.size());
+		}
 		this->ff(x, &ret, save);
 		return ret;
 	}
 
     virtual void ff(RTSpan<float> x, RTSpan<float> y, bool save = false) = 0;
-	virtual std::vector<int> ff_result_sz(int x_rank, int const *x_dims) const = 0;
+	virtual tensor_vector<int> ff_result_sz(int x_rank, int const *x_dims) const = 0;
 
     //backprop
     Tensor<float> bp_alloc(
 		RTSpan<float> x, RTSpan<float> y, RTSpan<float> dy,
         bool use_saved = false
 	) {
-		Tensor<float> ret(x.dims, x.rank);
+		Tensor<float> ret;
+		{
+			TENSOR_ALLOC_TAG("dx");
+			ret = Tensor<float>(x.dims.data(), x.rank);
+		}
 		this->bp(x, y, dy, &ret, use_saved);
 		return ret;
 	}
@@ -0,0 +1,408 @@
+//Microbenchmarks for the kernels the MNIST model spends its time in. Run
+//it with `make bench`, or by hand:
+//
+//    bench/bench [--json FILE] [--reps N] [--min-time SECONDS] [FILTER...]
+//
+//Every benchmark is warmed up first, then timed for --reps repetitions.
+//Each repetition runs the kernel enough times to take at least --min-time,
+//so small kernels aren't just measuring the clock. We report ns/op (the
+//median over repetitions, plus min/p10/p90/max and the mean), and GFLOP/s
+//and GB/s worked out from the median. Bytes are the minimum traffic: every
+//input read once and every output written once.
+//
+//A human-readable table goes to stderr and the JSON goes to stdout (or to
+//FILE), so runs can be diffed across releases. FILTERs are substrings;
+//only benchmarks whose name contains one of them get run.
+//
+//A few checks compare pairs of results (e.g. the sparse fc backprop must
+//not be slower than the dense one it replaces at MNIST density). A failed
+//check is reported in the JSON and makes the exit status 1.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../activation_fns.h"
+#include "../layers.h"
+#include "../optimizers.h"
+#include "../simd.h"
+#include "../sparse.h"
+#include "../tensor.h"
+#include "../thread_pool.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+#ifndef BENCH_REPS
+#define BENCH_REPS 25
+#endif
+
+//Seconds of warmup per benchmark
+#ifndef BENCH_WARMUP_TIME
+#define BENCH_WARMUP_TIME 0.05
+#endif
+
+//Minimum seconds per repetition
+#ifndef BENCH_MIN_TIME
+#define BENCH_MIN_TIME 0.01
+#endif
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_result {
+	std::string name;
+	std::string shape;
+	double flops; //Per op
+	double bytes; //Per op
+	long iters;   //Per repetition
+	std::vector<double> ns; //ns/op of each repetition, sorted
+};
+
+struct bench_config {
+	int reps = BENCH_REPS;
+	double min_time = BENCH_MIN_TIME;
+	std::vector<std::string> filters;
+	std::string json_path;
+};
+
+//Linear interpolation between the closest ranks. v has to be sorted
+double percentile(std::vector<double> const& v, double p) {
+	if (v.empty()) return 0;
+	double pos = p * (v.size() - 1);
+	size_t lo = (size_t) pos;
+	size_t hi = std::min(lo + 1, v.size() - 1);
+	return v[lo] + (pos - lo) * (v[hi] - v[lo]);
+}
+
+double seconds_since(bench_clock::time_point start) {
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+struct bench_check {
+	std::string fast, slow, shape;
+	bool ok;
+};
+
+struct bench_suite {
+	bench_config cfg;
+	std::vector<bench_result> results;
+	std::vector<bench_check> checks;
+
+	bench_result const* find(std::string const& name, std::string const& shape) const {
+		for (auto const& r : results) {
+			if (r.name == name && r.shape == shape) return &r;
+		}
+		return nullptr;
+	}
+
+	//fast's median can't be above slow's. Skipped if either wasn't run
+	void expect_not_slower(std::string const& fast, std::string const& slow, std::string const& shape) {
+		bench_result const *f = find(fast, shape), *sl = find(slow, shape);
+		if (!f || !sl) return;
+		double tf = percentile(f->ns, 0.5), ts = percentile(sl->ns, 0.5);
+		bool ok = tf <= ts;
+		fprintf(stderr, "check %s <= %s (%s): %.1f vs %.1f ns/op %s\n", fast.c_str(), slow.c_str(),
+			shape.c_str(), tf, ts, ok ? "ok" : "FAILED");
+		checks.push_back({fast, slow, shape, ok});
+	}
+
+	bool all_ok() const {
+		for (auto const& c : checks) if (!c.ok) return false;
+		return true;
+	}
+
+	bool selected(std::string const& name) const {
+		if (cfg.filters.empty()) return true;
+		for (auto const& f : cfg.filters) {
+			if (name.find(f) != std::string::npos) return true;
+		}
+		return false;
+	}
+
+	void run(std::string const& name, std::string const& shape, double flops, double bytes, std::function<void()> F) {
+		if (!selected(name)) return;
+
+		//Warm up, and find out roughly how long one call takes
+		long warm = 0;
+		auto start = bench_clock::now();
+		double elapsed;
+		do {
+			F();
+			warm++;
+			elapsed = seconds_since(start);
+		} while (elapsed < BENCH_WARMUP_TIME);
+		double per_call = elapsed / warm;
+
+		bench_result r;
+		r.name = name;
+		r.shape = shape;
+		r.flops = flops;
+		r.bytes = bytes;
+		r.iters = std::max(1L, (long) (cfg.min_time / per_call));
+		for (int rep = 0; rep < cfg.reps; rep++) {
+			auto tic = bench_clock::now();
+			for (long i = 0; i < r.iters; i++) F();
+			r.ns.push_back(seconds_since(tic) * 1e9 / r.iters);
+		}
+		std::sort(r.ns.begin(), r.ns.end());
+
+		double med = percentile(r.ns, 0.5);
+		fprintf(stderr, "%-28s %-16s %12.1f ns/op  [p10 %10.1f  p90 %10.1f]  %8.2f GFLOP/s  %8.2f GB/s\n",
+			name.c_str(), shape.c_str(), med, percentile(r.ns, 0.1), percentile(r.ns, 0.9),
+			flops / med, bytes / med);
+		results.push_back(std::move(r));
+	}
+
+	void write_json(std::ostream& o) const {
+		std::string host = "localhost";
+#if defined(__unix__) || defined(__APPLE__)
+		char buf[256] = {};
+		if (gethostname(buf, sizeof(buf) - 1) == 0 && buf[0]) host = buf;
+#endif
+		o << "{\n";
+		o << "  \"host\": \"" << host << "\",\n";
+		o << "  \"simd\": \"" << simd_level_name(detect_simd_level()) << "\",\n";
+		o << "  \"threads\": " << tensor_num_threads() << ",\n";
+		o << "  \"reps\": " << cfg.reps << ",\n";
+		o << "  \"results\": [";
+		for (size_t i = 0; i < results.size(); i++) {
+			bench_result const& r = results[i];
+			double med = percentile(r.ns, 0.5);
+			double mean = 0;
+			for (double t : r.ns) mean += t;
+			mean /= r.ns.size();
+
+			//ns per op, so flops/ns is GFLOP/s and bytes/ns is GB/s
+			o << (i ? ",\n" : "\n");
+			o << "    {\"name\": \"" << r.name << "\", \"shape\": \"" << r.shape << "\""
+			  << ", \"iters_per_rep\": " << r.iters
+			  << ", \"ns_per_op\": " << med
+			  << ", \"min\": " << r.ns.front()
+			  << ", \"p10\": " << percentile(r.ns, 0.1)
+			  << ", \"p50\": " << med
+			  << ", \"p90\": " << percentile(r.ns, 0.9)
+			  << ", \"max\": " << r.ns.back()
+			  << ", \"mean\": " << mean
+			  << ", \"gflops\": " << r.flops / med
+			  << ", \"gbps\": " << r.bytes / med << "}";
+		}
+		o << "\n  ],\n  \"checks\": [";
+		for (size_t i = 0; i < checks.size(); i++) {
+			bench_check const& c = checks[i];
+			o << (i ? ",\n" : "\n");
+			o << "    {\"fast\": \"" << c.fast << "\", \"slow\": \"" << c.slow << "\", \"shape\": \""
+			  << c.shape << "\", \"ok\": " << (c.ok ? "true" : "false") << "}";
+		}
+		o << "\n  ]\n}\n";
+	}
+};
+
+Tensor<float> random_tensor(std::initializer_list<int> dims, float lo = -1, float hi = 1) {
+	std::vector<int> d(dims);
+	return Tensor<float>(d.data(), d.size(), uniform_randgen<float>(lo, hi));
+}
+
+//Like an MNIST batch: about a fifth of the pixels are lit
+Tensor<float> mnist_like(int batch, int n_in = 784) {
+	Tensor<float> ret = random_tensor({batch, n_in}, 0, 1);
+	for (auto& f : ret.storage) f = (f < 0.8f) ? 0.0f : f;
+	return ret;
+}
+
+std::string shape_str(std::initializer_list<int> dims) {
+	std::string ret;
+	for (int d : dims) ret += (ret.empty() ? "" : "x") + std::to_string(d);
+	return ret;
+}
+
+//[M x K] * [K x N], accumulating, like everything else calls it
+void bench_tensormul(bench_suite& s, int M, int K, int N) {
+	Tensor<float> A = random_tensor({M, K});
+	Tensor<float> B = random_tensor({K, N});
+	Tensor<float> C = random_tensor({M, N});
+	auto a = A.as_tspan<2>(), b = B.as_tspan<2>(), c = C.as_tspan<2>();
+	double bytes = 4.0 * ((double) M*K + (double) K*N + 2.0*M*N);
+	s.run("tensormul", shape_str({M, K, N}), 2.0 * M * N * K, bytes, [=] {
+		tensormul(a, b, c);
+	});
+}
+
+void bench_eltwise(bench_suite& s, int rows, int cols) {
+	Tensor<float> X = random_tensor({rows, cols});
+	Tensor<float> Y = random_tensor({rows, cols});
+	Tensor<float> Z = random_tensor({rows, cols});
+	Tensor<float> bias = random_tensor({cols});
+	auto x = X.as_tspan<2>(), y = Y.as_tspan<2>(), z = Z.as_tspan<2>();
+	auto bb = bias.as_tspan<1>();
+	double n = (double) rows * cols;
+
+	s.run("tensoreltwise_add", shape_str({rows, cols}), n, 12 * n, [=] {
+		tensoreltwise(x, y, z, std::plus<float>{});
+	});
+	//The fc bias add: a row broadcast with the activation fused in
+	s.run("tensoreltwise_bias_act", shape_str({rows, cols}), 2 * n, 8 * n + 4 * cols, [=] {
+		tensoreltwise(z, bb, z, [](float zz, float b) {
+			float v = zz + b;
+			return (v > 0) ? v : 0.0f;
+		});
+	});
+}
+
+void bench_adam(bench_suite& s, int rows, int cols) {
+	auto adam = std::make_shared<Adam<2>>(0.001);
+	int dims[2] = {rows, cols};
+	adam->advise_size(dims, 2);
+	Tensor<float> G = random_tensor({rows, cols});
+	RTSpan<float> g = &G;
+	double n = (double) rows * cols;
+	//m and v are read and written, grad read, deltas written. About 12
+	//flops per element for the two moments and the update
+	s.run("adam_get_deltas", shape_str({rows, cols}), 12 * n, 24 * n, [=] {
+		Tensor<float> d = adam->get_deltas(g);
+	});
+}
+
+void bench_softmax(bench_suite& s, int batch, int width) {
+	auto sm = std::make_shared<softmax>();
+	Tensor<float> X = random_tensor({batch, width});
+	Tensor<float> Y = random_tensor({batch, width});
+	Tensor<float> dY = random_tensor({batch, width});
+	Tensor<float> dX = random_tensor({batch, width});
+	RTSpan<float> x = &X, y = &Y, dy = &dY, dx = &dX;
+	sm->ff(x, y);
+	double n = (double) batch * width;
+
+	s.run("softmax_ff", shape_str({batch, width}), 4 * n, 8 * n, [=] {
+		sm->ff(x, y);
+	});
+	s.run("softmax_bp", shape_str({batch, width}), 3 * n * width, 16 * n, [=] {
+		sm->bp(x, y, dy, dx);
+	});
+}
+
+//ff is [B x in] * [in x out]^T plus the bias and activation. bp is the two
+//products for dW and dx plus the Adam updates
+void bench_fc(bench_suite& s, int batch, int n_in, int n_out, bool sparse_input) {
+	auto layer = std::make_shared<fc>(n_out, n_in, new oddln(), new Adam<2>(0.001), new Adam<1>(0.001));
+	Tensor<float> X = sparse_input ? mnist_like(batch) : random_tensor({batch, n_in});
+	Tensor<float> Y = random_tensor({batch, n_out});
+	Tensor<float> dY = random_tensor({batch, n_out}, -0.01, 0.01);
+	Tensor<float> dX = random_tensor({batch, n_in});
+	RTSpan<float> x = &X, y = &Y, dy = &dY, dx = &dX;
+	layer->ff(x, y);
+
+	std::string shape = shape_str({batch, n_in, n_out});
+	std::string suffix = sparse_input ? "_mnist" : "";
+	double mnk = (double) batch * n_in * n_out;
+	double w = (double) n_in * n_out;
+	double io = (double) batch * (n_in + n_out);
+
+	s.run("fc_ff" + suffix, shape, 2 * mnk, 4 * (w + io), [=] {
+		layer->ff(x, y);
+	});
+	s.run("fc_bp" + suffix, shape, 4 * mnk, 4 * (3 * w + 2 * io), [=] {
+		layer->bp(x, y, dy, dx);
+	});
+}
+
+//Just the dW product out of fc::bp_impl: CSR x^T * z2 and the flip into
+//W's layout, against the dense z2^T * x. GFLOP/s counts the dense flops
+//for both, so the sparse one reads as an effective rate
+void bench_fc_dw(bench_suite& s, int batch, int n_in, int n_out) {
+	Tensor<float> X = mnist_like(batch, n_in);
+	Tensor<float> Z = random_tensor({batch, n_out});
+	auto x = X.as_tspan<2>(), z = Z.as_tspan<2>();
+	auto xs = std::make_shared<csr_matrix>();
+	xs->assign(x.data, batch, n_in, x.strides[0], x.strides[1], (long) batch * n_in);
+
+	std::string shape = shape_str({batch, n_in, n_out});
+	double mnk = (double) batch * n_in * n_out;
+	double bytes = 4 * ((double) batch * (n_in + n_out) + (double) n_in * n_out);
+
+	s.run("fc_dW_mnist", shape, 2 * mnk, bytes, [=] {
+		int dims_t[2] = {n_in, n_out};
+		Tensor<float> dW_t(dims_t, 2);
+		csr_gemm_tn(*xs, n_out, 1.0f, z.data, z.strides[0], z.strides[1],
+			0.0f, dW_t.storage.data(), n_out, 1);
+		Tensor<float> dW(dW_t.as_tspan<2>().transpose());
+	});
+	s.run("fc_dW", shape, 2 * mnk, bytes, [=] {
+		int dims[2] = {n_out, n_in};
+		Tensor<float> dW(dims, 2);
+		tensorgemm(true, false, 1.0f, z, x, 0.0f, dW.as_tspan<2>());
+	});
+	s.expect_not_slower("fc_dW_mnist", "fc_dW", shape);
+}
+
+int main(int argc, char **argv) {
+	bench_suite s;
+	for (int i = 1; i < argc; i++) {
+		std::string a = argv[i];
+		if (a == "--json" && i + 1 < argc) {
+			s.cfg.json_path = argv[++i];
+		} else if (a == "--reps" && i + 1 < argc) {
+			s.cfg.reps = std::max(1, atoi(argv[++i]));
+		} else if (a == "--min-time" && i + 1 < argc) {
+			s.cfg.min_time = atof(argv[++i]);
+		} else if (a == "-h" || a == "--help") {
+			fprintf(stderr, "Usage: %s [--json FILE] [--reps N] [--min-time SECONDS] [FILTER...]\n", argv[0]);
+			return 0;
+		} else {
+			s.cfg.filters.push_back(a);
+		}
+	}
+
+	//The MNIST model's forward products, then the transposed ones from bp
+	//(dW is [out x B] * [B x in], dx is [B x out] * [out x in]), then some
+	//square ones to compare against block_matrix_mult/README
+	int const mul_shapes[][3] = {
+		{32, 784, 128}, {32, 128, 64}, {32, 64, 10},
+		{128, 32, 784}, {64, 32, 128}, {10, 32, 64},
+		{32, 128, 784}, {32, 64, 128}, {32, 10, 64},
+		{256, 256, 256}, {512, 512, 512}, {1024, 1024, 1024}
+	};
+	for (auto const& sh : mul_shapes) bench_tensormul(s, sh[0], sh[1], sh[2]);
+
+	bench_eltwise(s, 32, 128);
+	bench_eltwise(s, 32, 784);
+	bench_eltwise(s, 1024, 1024);
+
+	bench_adam(s, 128, 784);
+	bench_adam(s, 64, 128);
+	bench_adam(s, 10, 64);
+
+	bench_softmax(s, 32, 10);
+	bench_softmax(s, 32, 100); //Too wide for the static kernels
+
+	bench_fc(s, 32, 784, 128, true);
+	bench_fc(s, 32, 784, 128, false);
+	bench_fc(s, 32, 128, 64, false);
+	bench_fc(s, 32, 64, 10, false);
+	s.expect_not_slower("fc_bp_mnist", "fc_bp", shape_str({32, 784, 128}));
+
+	bench_fc_dw(s, 32, 784, 128);
+	bench_fc_dw(s, 64, 784, 128);
+
+	if (s.cfg.json_path.empty()) {
+		s.write_json(std::cout);
+	} else {
+		std::ofstream out(s.cfg.json_path);
+		if (!out) {
+			fprintf(stderr, "Could not open %s\n", s.cfg.json_path.c_str());
+			return 1;
+		}
+		s.write_json(out);
+		fprintf(stderr, "Wrote %s\n", s.cfg.json_path.c_str());
+	}
+	return s.all_ok() ? 0 : 1;
+}
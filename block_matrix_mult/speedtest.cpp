@@ -12,21 +12,7 @@
 
 template <typename T>
 TSpan<2, T> submat(TSpan<2,T> mat, int x0, int y0, int xsz, int ysz) {
-	//Assert in bounds
-	int *new_dims = new int[2];
-	int *new_strides = new int[2];
-	new_dims[0] = ysz; new_dims[1] = xsz;
-	new_strides[0] = mat.strides[0];
-	new_strides[1] = mat.strides[1];
-
-	T const* new_data = mat.data + y0*mat.strides[0] + x0*mat.strides[1];
-
-	return TSpan<2,T>(
-		new_data, 
-		new_dims, 
-		new_strides, 
-		new RCTSpanData(new_dims, new_strides)
-	);
+	return mat.submat(x0, y0, xsz, ysz);
 }
 
 //This isn't fully general, it's just meant to be a litmus test. We want 
@@ -89,6 +75,42 @@ void block_matmul(TSpan<2,float> lhs, TSpan<2,float> rhs, TSpan<2,float> res) {
 
 using namespace std;
 
+//2*n^3 flops per n x n matrix multiply
+void print_gflops(long ms, int n) {
+	double flops = 2.0 * n * n * n * NUM_ITERS;
+	cout << "\t" << flops / (ms * 1e6) << " GFLOP/s" << endl;
+}
+
+//The old scalar path: one row at a time through the rank-1 tensormul
+void naive_matmul(TSpan<2,float> lhs, TSpan<2,float> rhs, TSpan<2,float> res) {
+	for (int i = 0; i < lhs.dims[0]; i++) {
+		tensormul(lhs[i], rhs, res[i]);
+	}
+}
+
+//Note that tensormul accumulates, so after time_fn both results hold 
+//NUM_ITERS copies of the product. Expect some float drift.
+float max_abs_diff(TSpan<2,float> a, TSpan<2,float> b) {
+	float ret = 0;
+	for (int i = 0; i < a.dims[0]; i++) {
+		for (int j = 0; j < a.dims[1]; j++) {
+			ret = max(ret, fabs(a[i][j] - b[i][j]));
+		}
+	}
+	return ret;
+}
+
+template <int bsz>
+void time_block(TSpan<2,float> t1_spn, TSpan<2,float> t2_spn, TSpan<2,float> res_golden_spn) {
+	vector<int> dims = {512, 512};
+	auto res = Tensor<float>(dims);
+	auto res_spn = res.as_tspan<2>();
+	cout << "512x512 block matrix mults (bsz = " << bsz << "): ";
+	long ms = time_fn(NUM_ITERS, [=]{block_matmul<bsz>(t1_spn, t2_spn, res_spn);});
+	print_gflops(ms, 512);
+	cout << "\tMax abs diff: " << max_abs_diff(res_spn, res_golden_spn) << endl;
+}
+
 int main() {
 	vector<int> dims = {512, 512};
 	auto t1 = make_random_tensor<float>({512,512});
@@ -99,42 +121,30 @@ int main() {
 	auto t2_spn = t2.as_tspan<2>();
 	auto res_golden_spn = res_golden.as_tspan<2>();
 
-	cout << "512x512 raw tensormuls: ";
-	time_fn(NUM_ITERS, [=]{tensormul(t1_spn, t2_spn, res_golden_spn);});
+	long ms;
+
+	cout << "512x512 naive (row-by-row) tensormuls: ";
+	ms = time_fn(NUM_ITERS, [=]{naive_matmul(t1_spn, t2_spn, res_golden_spn);});
+	print_gflops(ms, 512);
 
 	auto res = Tensor<float>(dims);
 	auto res_spn = res.as_tspan<2>();
-	cout << "512x512 block matrix mults (bsz = 512): ";
-	time_fn(NUM_ITERS, [=]{block_matmul<512>(t1_spn, t2_spn, res_spn);});
-	cout << "\tEqual? " << (res_spn == res_golden_spn) << endl;
+	cout << "512x512 packed GEMM tensormuls: ";
+	ms = time_fn(NUM_ITERS, [=]{tensormul(t1_spn, t2_spn, res_spn);});
+	print_gflops(ms, 512);
+	cout << "\tMax abs diff: " << max_abs_diff(res_spn, res_golden_spn) << endl;
 
+	auto t1_T = t1_spn.transpose();
 	res = Tensor<float>(dims);
 	res_spn = res.as_tspan<2>();
-	cout << "512x512 block matrix mults (bsz = 256): ";
-	time_fn(NUM_ITERS, [=]{block_matmul<256>(t1_spn, t2_spn, res_spn);});
-	cout << "\tEqual? " << (res_spn == res_golden_spn) << endl;
-	
-	res = Tensor<float>(dims);
-	res_spn = res.as_tspan<2>();
-	cout << "512x512 block matrix mults (bsz = 128): ";
-	time_fn(NUM_ITERS, [=]{block_matmul<128>(t1_spn, t2_spn, res_spn);});
-	cout << "\tEqual? " << (res_spn == res_golden_spn) << endl;
-	
-	res = Tensor<float>(dims);
-	res_spn = res.as_tspan<2>();
-	cout << "512x512 block matrix mults (bsz = 64): ";
-	time_fn(NUM_ITERS, [=]{block_matmul<64>(t1_spn, t2_spn, res_spn);});
-	cout << "\tEqual? " << (res_spn == res_golden_spn) << endl;
-	
-	res = Tensor<float>(dims);
-	res_spn = res.as_tspan<2>();
-	cout << "512x512 block matrix mults (bsz = 32): ";
-	time_fn(NUM_ITERS, [=]{block_matmul<32>(t1_spn, t2_spn, res_spn);});
-	cout << "\tEqual? " << (res_spn == res_golden_spn) << endl;
-	
-	res = Tensor<float>(dims);
-	res_spn = res.as_tspan<2>();
-	cout << "512x512 block matrix mults (bsz = 16): ";
-	time_fn(NUM_ITERS, [=]{block_matmul<16>(t1_spn, t2_spn, res_spn);});
-	cout << "\tEqual? " << (res_spn == res_golden_spn) << endl;
-}
\ No newline at end of file
+	cout << "512x512 packed GEMM tensormuls (transposed LHS): ";
+	ms = time_fn(NUM_ITERS, [=]{tensormul(t1_T, t2_spn, res_spn);});
+	print_gflops(ms, 512);
+
+	time_block<512>(t1_spn, t2_spn, res_golden_spn);
+	time_block<256>(t1_spn, t2_spn, res_golden_spn);
+	time_block<128>(t1_spn, t2_spn, res_golden_spn);
+	time_block<64>(t1_spn, t2_spn, res_golden_spn);
+	time_block<32>(t1_spn, t2_spn, res_golden_spn);
+	time_block<16>(t1_spn, t2_spn, res_golden_spn);
+}
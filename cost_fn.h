@@ -12,22 +12,15 @@
 struct sqerr : cost_fn {
     //feed-forward
     float cc(RTSpan<float> const& x, RTSpan<float> const& actual) override {
-        float sum = 0.0;
-
         assert(x.dims[0] == actual.dims[0]);
         assert(x.dims[1] == actual.dims[1]);
 
-		//Intentionally using (much slower) runtime rank code. Makes
-		//sqerr more general. If we really care about the speed we can
-		//make a sqerr_matrix struct and use that instead
-        for (int i = 0; i < x.length(); i++) {
-            for (int j = 0; j < x[i].length(); j++) {
-                float diff = *x[i][j] - *actual[i][j];
-                sum += diff*diff;
-            }
-        }
-
-        return sum;
+		//Intentionally using runtime rank code. Makes sqerr more general.
+		//One fused pass over both, nothing allocated
+        return tensorreduce_binary(x, actual, [](float xx, float aa) {
+            float diff = xx - aa;
+            return diff*diff;
+        });
     }
 
     //get gradient
@@ -36,16 +29,11 @@ struct sqerr : cost_fn {
         assert(x.dims[1] == actual.dims[1]);
         assert(x.length() > 0);
 
-		//Intentionally using (much slower) runtime rank code. Makes
-		//sqerr more general. If we really care about the speed we can
-		//make a sqerr_matrix struct and use that instead
-        Tensor<float> ret(x.dims, x.rank);
-
-        for (int i = 0; i < x.length(); i++) {
-            for (int j = 0; j < x[i].length(); j++) {
-                *ret[i][j] = 2.0*(*x[i][j] - *actual[i][j]);
-            }
-        }
+		//Runtime rank, but it goes through the flat eltwise paths
+        Tensor<float> ret(x.dims.data(), x.rank);
+        tensoreltwise(x, actual, &ret, [](float xx, float aa) {
+            return 2.0f*(xx - aa);
+        });
 
         return ret;
     }
@@ -57,19 +45,15 @@ struct nll : cost_fn {
         assert(x.dims[1] == actual.dims[1]);
 
 		float cost = 0.0f;
+
+		//Index of correct answer in each row (actual is one-hot)
+		Tensor<int> ind_storage(x.dims.data(), 1);
+		tensorreduce(reduce_op::argmax, actual, 1, &ind_storage);
+		auto ind = ind_storage.as_tspan<1>();
 		
 		for (int i = 0; i < x.dims[0]; i++) {
-			int ind_actual = -1;
-			//Search for index of correct answer
-			for (int j = 0; j < x.dims[1]; j++) {
-				if (*actual[i][j] != 0.0f) {
-					assert(ind_actual == -1);
-					ind_actual = j;
-					#ifdef NDEBUG 
-					break;
-					#endif
-				}
-			}
+			int ind_actual = ind[i];
+			assert(*actual[i][ind_actual] != 0.0f);
 			
             assert(*x[i][ind_actual] > -EPS/2);
 			cost -= log(*x[i][ind_actual] + EPS); //TODO? Remove this eps?
@@ -81,7 +65,7 @@ struct nll : cost_fn {
     Tensor<float> gg(RTSpan<float> const& x, RTSpan<float> const& actual) override {
         assert(x.dims[0] == actual.dims[0]);
         assert(x.dims[1] == actual.dims[1]);
-        Tensor<float> ret(x.dims, x.rank);
+        Tensor<float> ret(x.dims.data(), x.rank);
         
         for (int i = 0; i < x.dims[0]; i++) {
             bool hot = false;
@@ -0,0 +1,767 @@
+#ifndef GEMM_H
+#define GEMM_H 1
+
+//Packed, register-blocked matrix multiply. This is the engine underneath
+//tensormul<2,2>. It's the usual Goto/BLIS loop nest:
+//
+//  for jc in steps of NC         (B panel sized to stay in L3)
+//    for pc in steps of KC       (pack kc x nc panel of B)
+//      for ic in steps of MC     (pack mc x kc block of A, sized for L2)
+//        for jr in steps of NR   (one NR-wide sliver of packed B, L1)
+//          for ir in steps of MR (micro-kernel: MR x NR tile of C in registers)
+//
+//Everything here works on raw pointers plus (row stride, column stride), so
+//transposed views and submatrices just get packed like anything else. The
+//packed buffers are contiguous and 64-byte aligned, so the micro-kernel
+//only ever sees unit-stride data.
+//
+//Like the rest of tensormul, gemm_accumulate computes C += A*B (i.e. it
+//accumulates into whatever is already in C). gemm() at the bottom is the
+//BLAS-style version with alpha, beta and transpose flags.
+//
+//Big enough problems are split across the shared thread pool (see
+//thread_pool.h) one MC x (some multiple of NR) tile of C per task.
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <type_traits>
+
+#include "half.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+#ifdef SIMD_HAVE_X86
+#define GEMM_HAVE_X86 1
+#endif
+
+//Micro-kernel tile size. 6x16 floats = 12 ymm accumulators, which leaves
+//enough registers for the broadcasts and the B loads
+#define GEMM_MR 6
+#define GEMM_NR 16
+
+//Cache blocking sizes. Can be overridden on the command line (-DGEMM_KC=...)
+//MC must be a multiple of MR and NC a multiple of NR
+#ifndef GEMM_MC
+#define GEMM_MC 96
+#endif
+#ifndef GEMM_KC
+#define GEMM_KC 256
+#endif
+#ifndef GEMM_NC
+#define GEMM_NC 4096
+#endif
+
+//Below this many multiply-adds it isn't worth packing anything
+#ifndef GEMM_SMALL
+#define GEMM_SMALL (16*16*16)
+#endif
+
+//Below this many multiply-adds we stay on one thread
+#ifndef GEMM_PARALLEL_MIN
+#define GEMM_PARALLEL_MIN (64*64*64)
+#endif
+
+//Products where m, n and k are all at least this big go through
+//Strassen-Winograd (see gemm_strassen). It's off (0) unless you ask for
+//it, since it doesn't round the same way as the regular GEMM. 1024 is a
+//good value on our machines. This is only the default;
+//gemm_strassen_min() or TENSORCOPTER_STRASSEN_MIN in the environment can
+//change it at runtime.
+#ifndef GEMM_STRASSEN_MIN
+#define GEMM_STRASSEN_MIN 0
+#endif
+
+static_assert(GEMM_MC % GEMM_MR == 0, "GEMM_MC must be a multiple of GEMM_MR");
+static_assert(GEMM_NC % GEMM_NR == 0, "GEMM_NC must be a multiple of GEMM_NR");
+
+//The cache blocking one product actually runs with. The macros above are
+//the defaults; a lookup hook (installed by the autotuner in gemm_tune.h)
+//can pick different ones for each float product shape.
+struct gemm_blocking {
+	int mc = GEMM_MC;
+	int kc = GEMM_KC;
+	int nc = GEMM_NC;
+
+	bool valid() const {
+		return mc > 0 && kc > 0 && nc > 0 && mc % GEMM_MR == 0 && nc % GEMM_NR == 0;
+	}
+};
+
+using gemm_blocking_fn = gemm_blocking (*)(int m, int n, int k);
+
+inline gemm_blocking_fn& gemm_blocking_hook() {
+	static gemm_blocking_fn hook = nullptr;
+	return hook;
+}
+
+//Grow-only, 64-byte aligned scratch space for the packed panels. One per
+//thread so we never allocate in steady state.
+template <typename T>
+struct gemm_pack_buffers {
+	T *a = nullptr;
+	T *b = nullptr;
+	size_t a_cap = 0;
+	size_t b_cap = 0;
+
+	static T* grow(T *old, size_t& cap, size_t n) {
+		if (n <= cap) return old;
+		if (old) ::operator delete(old, std::align_val_t(64));
+		cap = n;
+		return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(64)));
+	}
+
+	T *w = nullptr; //gemm_strassen's workspace
+	size_t w_cap = 0;
+
+	T* get_a(size_t n) { return a = grow(a, a_cap, n); }
+	T* get_b(size_t n) { return b = grow(b, b_cap, n); }
+	T* get_w(size_t n) { return w = grow(w, w_cap, n); }
+
+	~gemm_pack_buffers() {
+		if (a) ::operator delete(a, std::align_val_t(64));
+		if (b) ::operator delete(b, std::align_val_t(64));
+		if (w) ::operator delete(w, std::align_val_t(64));
+	}
+};
+
+template <typename T>
+gemm_pack_buffers<T>& gemm_buffers() {
+	thread_local gemm_pack_buffers<T> bufs;
+	return bufs;
+}
+
+//Pack an mc x kc block of alpha*A into MR-row micro-panels. Within a
+//micro-panel the layout is column-major (MR consecutive values per k), which
+//is the order the micro-kernel consumes them in. Ragged edges are
+//zero-padded.
+//
+//There's one loop per layout, since which way A is stored decides which
+//reads are contiguous:
+//  - rs_a == 1 (a transposed row-major matrix): the MR values for each k
+//    are already next to each other, so it's a straight copy
+//  - cs_a == 1 (plain row-major): walk MR rows side by side
+//  - anything else: strided gather
+//
+//A can be a narrower type than the packed panel (e.g. bf16 into float), in
+//which case it gets widened here.
+template <typename S, typename T>
+void gemm_pack_a(
+	int mc, int kc,
+	S const *A, int rs_a, int cs_a,
+	T *dst, T alpha = T(1)
+) {
+	for (int ir = 0; ir < mc; ir += GEMM_MR) {
+		int mr = std::min(GEMM_MR, mc - ir);
+		S const *a = A + ir*rs_a;
+
+		if (rs_a == 1) {
+			for (int p = 0; p < kc; p++) {
+				S const *col = a + p*cs_a;
+				int i;
+				for (i = 0; i < mr; i++) dst[i] = alpha * T(col[i]);
+				for (; i < GEMM_MR; i++) dst[i] = T();
+				dst += GEMM_MR;
+			}
+		} else if (cs_a == 1) {
+			S const *rows[GEMM_MR];
+			for (int i = 0; i < mr; i++) rows[i] = a + i*rs_a;
+			for (int p = 0; p < kc; p++) {
+				int i;
+				for (i = 0; i < mr; i++) dst[i] = alpha * T(rows[i][p]);
+				for (; i < GEMM_MR; i++) dst[i] = T();
+				dst += GEMM_MR;
+			}
+		} else {
+			for (int p = 0; p < kc; p++) {
+				int i;
+				for (i = 0; i < mr; i++) dst[i] = alpha * T(a[i*rs_a + p*cs_a]);
+				for (; i < GEMM_MR; i++) dst[i] = T();
+				dst += GEMM_MR;
+			}
+		}
+	}
+}
+
+//Pack a kc x nc panel of B into NR-column micro-panels (row-major within
+//each micro-panel). Ragged edges are zero-padded. Same idea as gemm_pack_a:
+//  - cs_b == 1 (plain row-major): each row of a micro-panel is a copy
+//  - rs_b == 1 (a transposed row-major matrix, e.g. W^T): read each column
+//    top to bottom, which is contiguous, and scatter it into the panel
+//  - anything else: strided gather
+template <typename S, typename T>
+void gemm_pack_b(
+	int kc, int nc,
+	S const *B, int rs_b, int cs_b,
+	T *dst
+) {
+	for (int jr = 0; jr < nc; jr += GEMM_NR) {
+		int nr = std::min(GEMM_NR, nc - jr);
+		S const *b = B + jr*cs_b;
+
+		if (rs_b == 1 && cs_b != 1) {
+			for (int j = 0; j < nr; j++) {
+				S const *col = b + j*cs_b;
+				for (int p = 0; p < kc; p++) dst[p*GEMM_NR + j] = T(col[p]);
+			}
+			for (int p = 0; p < kc; p++) {
+				for (int j = nr; j < GEMM_NR; j++) dst[p*GEMM_NR + j] = T();
+			}
+			dst += kc*GEMM_NR;
+			continue;
+		}
+
+		for (int p = 0; p < kc; p++) {
+			int j;
+			if (cs_b == 1 && nr == GEMM_NR) {
+				convert_n(b + p*rs_b, dst, GEMM_NR);
+			} else {
+				for (j = 0; j < nr; j++) dst[j] = T(b[p*rs_b + j*cs_b]);
+				for (; j < GEMM_NR; j++) dst[j] = T();
+			}
+			dst += GEMM_NR;
+		}
+	}
+}
+
+//Portable micro-kernel: c[i*ldc + j] += sum_p a[p][i] * b[p][j] for a full
+//MR x NR tile. Written so the compiler can keep acc in registers.
+template <typename T>
+void gemm_ukr_generic(int kc, T const *a, T const *b, T *c, int ldc) {
+	T acc[GEMM_MR][GEMM_NR] = {};
+	for (int p = 0; p < kc; p++) {
+		for (int i = 0; i < GEMM_MR; i++) {
+			T ai = a[i];
+			for (int j = 0; j < GEMM_NR; j++) {
+				acc[i][j] += ai * b[j];
+			}
+		}
+		a += GEMM_MR;
+		b += GEMM_NR;
+	}
+
+	for (int i = 0; i < GEMM_MR; i++) {
+		for (int j = 0; j < GEMM_NR; j++) {
+			c[i*ldc + j] += acc[i][j];
+		}
+	}
+}
+
+#ifdef GEMM_HAVE_X86
+//6x16 FMA micro-kernel. Each k step broadcasts 6 values of A and does 12
+//FMAs against two 8-wide vectors of B.
+__attribute__((target("avx2,fma")))
+static void sgemm_ukr_avx2(int kc, float const *a, float const *b, float *c, int ldc) {
+	__m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+	__m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+	__m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+	__m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+	__m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+	__m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+
+	for (int p = 0; p < kc; p++) {
+		__m256 b0 = _mm256_load_ps(b);
+		__m256 b1 = _mm256_load_ps(b + 8);
+		__m256 ai;
+
+		ai = _mm256_broadcast_ss(a + 0);
+		c00 = _mm256_fmadd_ps(ai, b0, c00); c01 = _mm256_fmadd_ps(ai, b1, c01);
+		ai = _mm256_broadcast_ss(a + 1);
+		c10 = _mm256_fmadd_ps(ai, b0, c10); c11 = _mm256_fmadd_ps(ai, b1, c11);
+		ai = _mm256_broadcast_ss(a + 2);
+		c20 = _mm256_fmadd_ps(ai, b0, c20); c21 = _mm256_fmadd_ps(ai, b1, c21);
+		ai = _mm256_broadcast_ss(a + 3);
+		c30 = _mm256_fmadd_ps(ai, b0, c30); c31 = _mm256_fmadd_ps(ai, b1, c31);
+		ai = _mm256_broadcast_ss(a + 4);
+		c40 = _mm256_fmadd_ps(ai, b0, c40); c41 = _mm256_fmadd_ps(ai, b1, c41);
+		ai = _mm256_broadcast_ss(a + 5);
+		c50 = _mm256_fmadd_ps(ai, b0, c50); c51 = _mm256_fmadd_ps(ai, b1, c51);
+
+		a += GEMM_MR;
+		b += GEMM_NR;
+	}
+
+	#define GEMM_STORE_ROW(i, lo, hi) \
+		_mm256_storeu_ps(c + (i)*ldc,     _mm256_add_ps(_mm256_loadu_ps(c + (i)*ldc),     lo)); \
+		_mm256_storeu_ps(c + (i)*ldc + 8, _mm256_add_ps(_mm256_loadu_ps(c + (i)*ldc + 8), hi))
+	GEMM_STORE_ROW(0, c00, c01);
+	GEMM_STORE_ROW(1, c10, c11);
+	GEMM_STORE_ROW(2, c20, c21);
+	GEMM_STORE_ROW(3, c30, c31);
+	GEMM_STORE_ROW(4, c40, c41);
+	GEMM_STORE_ROW(5, c50, c51);
+	#undef GEMM_STORE_ROW
+}
+#endif
+
+template <typename T>
+using gemm_ukr_t = void (*)(int, T const*, T const*, T*, int);
+
+template <typename T>
+gemm_ukr_t<T> gemm_pick_ukr() {
+	return gemm_ukr_generic<T>;
+}
+
+template <>
+inline gemm_ukr_t<float> gemm_pick_ukr<float>() {
+#ifdef GEMM_HAVE_X86
+	if (simd().level >= simd_level::avx2) return sgemm_ukr_avx2;
+#endif
+	return gemm_ukr_generic<float>;
+}
+
+//Runs the micro-kernel over one packed mc x kc block of A against one
+//packed kc x nc panel of B, accumulating into C. Full tiles with unit column
+//stride go straight to C; edge tiles and strided C go through a small
+//temporary.
+template <typename T>
+void gemm_macro_kernel(
+	int mc, int nc, int kc,
+	T const *a_pack, T const *b_pack,
+	T *C, int rs_c, int cs_c,
+	gemm_ukr_t<T> ukr
+) {
+	alignas(64) T tmp[GEMM_MR * GEMM_NR];
+
+	for (int jr = 0; jr < nc; jr += GEMM_NR) {
+		int nr = std::min(GEMM_NR, nc - jr);
+		T const *b = b_pack + jr*kc;
+
+		for (int ir = 0; ir < mc; ir += GEMM_MR) {
+			int mr = std::min(GEMM_MR, mc - ir);
+			T const *a = a_pack + ir*kc;
+			T *c = C + ir*rs_c + jr*cs_c;
+
+			if (mr == GEMM_MR && nr == GEMM_NR && cs_c == 1) {
+				ukr(kc, a, b, c, rs_c);
+			} else {
+				std::fill(tmp, tmp + GEMM_MR*GEMM_NR, T());
+				ukr(kc, a, b, tmp, GEMM_NR);
+				for (int i = 0; i < mr; i++) {
+					for (int j = 0; j < nr; j++) {
+						c[i*rs_c + j*cs_c] += tmp[i*GEMM_NR + j];
+					}
+				}
+			}
+		}
+	}
+}
+
+//C(m x n) += alpha * A(m x k) * B(k x n), all with arbitrary strides. alpha
+//gets folded in while packing A, so it's free. A and B can be a narrower
+//type S than C (e.g. bf16 inputs, float C); they're widened to T while
+//packing, so all the arithmetic is in T. blk overrides the cache blocking
+//(otherwise it comes from gemm_blocking_hook() for floats, or the
+//defaults).
+template <typename S, typename T>
+void gemm_accumulate(
+	int m, int n, int k,
+	S const *A, int rs_a, int cs_a,
+	S const *B, int rs_b, int cs_b,
+	T *C, int rs_c, int cs_c,
+	T alpha = T(1),
+	gemm_blocking const *blk = nullptr
+) {
+	if (m <= 0 || n <= 0 || k <= 0) return;
+
+	gemm_blocking bs;
+	if (blk) bs = *blk;
+	else if (std::is_same<T, float>::value && gemm_blocking_hook()) bs = gemm_blocking_hook()(m, n, k);
+	assert(bs.valid());
+	int const MC = bs.mc, KC = bs.kc, NC = bs.nc;
+
+	gemm_ukr_t<T> ukr = gemm_pick_ukr<T>();
+	auto& bufs = gemm_buffers<T>();
+
+	int nc_max = std::min(NC, (n + GEMM_NR - 1) / GEMM_NR * GEMM_NR);
+	int mc_max = std::min(MC, (m + GEMM_MR - 1) / GEMM_MR * GEMM_MR);
+	int kc_max = std::min(KC, k);
+	T *b_pack = bufs.get_b(static_cast<size_t>(kc_max) * nc_max);
+	T *a_pack = bufs.get_a(static_cast<size_t>(kc_max) * mc_max);
+
+	//Small problems aren't worth waking the pool up for
+	int nthreads = tensor_num_threads();
+	bool serial = (nthreads == 1) || (static_cast<double>(m) * n * k < GEMM_PARALLEL_MIN);
+
+	for (int jc = 0; jc < n; jc += NC) {
+		int nc = std::min(NC, n - jc);
+
+		for (int pc = 0; pc < k; pc += KC) {
+			int kc = std::min(KC, k - pc);
+			gemm_pack_b(kc, nc, B + pc*rs_b + jc*cs_b, rs_b, cs_b, b_pack);
+
+			if (serial) {
+				for (int ic = 0; ic < m; ic += MC) {
+					int mc = std::min(MC, m - ic);
+					gemm_pack_a(mc, kc, A + ic*rs_a + pc*cs_a, rs_a, cs_a, a_pack, alpha);
+
+					gemm_macro_kernel(
+						mc, nc, kc, a_pack, b_pack,
+						C + ic*rs_c + jc*cs_c, rs_c, cs_c,
+						ukr
+					);
+				}
+				continue;
+			}
+
+			//Parallel: split the output into (MC rows) x (some NR slivers)
+			//tiles. Every tile writes its own piece of C, and everyone
+			//reads the one packed B panel. If there aren't enough row
+			//blocks to go around (e.g. a small batch), cut the columns up
+			//too.
+			int m_tiles = (m + MC - 1) / MC;
+			int slivers = (nc + GEMM_NR - 1) / GEMM_NR;
+			int n_tiles = std::min(slivers, std::max(1, (2*nthreads + m_tiles - 1) / m_tiles));
+			int per_tile = (slivers + n_tiles - 1) / n_tiles;
+			n_tiles = (slivers + per_tile - 1) / per_tile;
+
+			parallel_for(0, m_tiles * n_tiles, [&](int t) {
+				int ic = (t / n_tiles) * MC;
+				int jr = (t % n_tiles) * per_tile * GEMM_NR;
+				int mc = std::min(MC, m - ic);
+				int nr = std::min(per_tile * GEMM_NR, nc - jr);
+
+				//Each thread packs A into its own buffer
+				T *my_a = gemm_buffers<T>().get_a(static_cast<size_t>(kc_max) * mc_max);
+				gemm_pack_a(mc, kc, A + ic*rs_a + pc*cs_a, rs_a, cs_a, my_a, alpha);
+
+				gemm_macro_kernel(
+					mc, nr, kc, my_a, b_pack + jr*kc,
+					C + ic*rs_c + (jc + jr)*cs_c, rs_c, cs_c,
+					ukr
+				);
+			});
+		}
+	}
+}
+
+//C += alpha*A*B for products too small to be worth packing (see
+//GEMM_SMALL). Goes one row of B at a time, so when B and C are row-major the
+//inner loop is a unit-stride axpy.
+template <typename T>
+void gemm_small(
+	int m, int n, int k,
+	T const *A, int rs_a, int cs_a,
+	T const *B, int rs_b, int cs_b,
+	T *C, int rs_c, int cs_c,
+	T alpha = T(1)
+) {
+	for (int i = 0; i < m; i++) {
+		T *c = C + (long) i*rs_c;
+		for (int p = 0; p < k; p++) {
+			T a = alpha * A[(long) i*rs_a + (long) p*cs_a];
+			T const *b = B + (long) p*rs_b;
+			if constexpr (std::is_same<T, float>::value) {
+				if (cs_b == 1 && cs_c == 1 && n > 1) {
+					simd().axpy(a, b, c, n);
+					continue;
+				}
+			}
+			for (int j = 0; j < n; j++) c[(long) j*cs_c] += a * b[(long) j*cs_b];
+		}
+	}
+}
+
+//Batched C[i] += A[i]*B[i] for i in [0, batch). bs_* is the stride between
+//batch entries; bs_b = 0 means every entry shares the same B.
+//
+//  - Shared B, and A and C batches that sit back to back in memory: that's
+//    really one (batch*m) x k times k x n product, so do it as one GEMM.
+//  - Otherwise one product per entry (packed or gemm_small depending on
+//    size), spread across the thread pool if there's enough work. Any
+//    parallelism inside gemm_accumulate turns itself off on the workers.
+template <typename T>
+void gemm_batched(
+	int batch, int m, int n, int k,
+	T const *A, long bs_a, int rs_a, int cs_a,
+	T const *B, long bs_b, int rs_b, int cs_b,
+	T *C, long bs_c, int rs_c, int cs_c
+) {
+	if (batch <= 0 || m <= 0 || n <= 0 || k <= 0) return;
+
+	double each = static_cast<double>(m) * n * k;
+	if (bs_b == 0 && bs_a == (long) m*rs_a && bs_c == (long) m*rs_c && batch*each > GEMM_SMALL) {
+		gemm_accumulate(batch*m, n, k, A, rs_a, cs_a, B, rs_b, cs_b, C, rs_c, cs_c);
+		return;
+	}
+
+	auto one = [&](int i) {
+		T const *a = A + i*bs_a;
+		T const *b = B + i*bs_b;
+		T *c = C + i*bs_c;
+		if (each <= GEMM_SMALL) gemm_small(m, n, k, a, rs_a, cs_a, b, rs_b, cs_b, c, rs_c, cs_c);
+		else gemm_accumulate(m, n, k, a, rs_a, cs_a, b, rs_b, cs_b, c, rs_c, cs_c);
+	};
+
+	if (batch > 1 && batch*each >= GEMM_PARALLEL_MIN) {
+		parallel_for(0, batch, one);
+	} else {
+		for (int i = 0; i < batch; i++) one(i);
+	}
+}
+
+/////////////////////
+//STRASSEN-WINOGRAD//
+/////////////////////
+//One level of Strassen-Winograd does a product with 7 half-size products
+//instead of 8, plus a handful of half-size additions (which are only
+//O(n^2) and stream through memory). Every level saves about 1/8 of the
+//flops, which adds up once the products get big. We recurse while m, n
+//and k are all at least gemm_strassen_min(), then hand the pieces to
+//gemm_accumulate. Odd sizes get peeled: the even part recurses and the
+//leftover row, column and rank-1 update go straight to gemm_accumulate.
+//
+//Every level needs three half-size temporaries (one for the A side, one
+//for the B side, one product). They all come out of one per-thread
+//workspace that's sized for the whole recursion before we start, so
+//nothing is allocated on the way down.
+//
+//The error bound is a bit worse than the classic algorithm's and grows
+//with the number of levels (about 1e-3 max abs difference at 4096 with
+//two levels, see block_matrix_mult/README). That's why it's opt-in, and
+//why the crossover should stay high.
+
+//The crossover, 0 for off. Not thread-safe to change while a product is
+//running
+inline int& gemm_strassen_min() {
+	static int ret = [] {
+		if (char const *env = std::getenv("TENSORCOPTER_STRASSEN_MIN")) return std::atoi(env);
+		return GEMM_STRASSEN_MIN;
+	}();
+	return ret;
+}
+
+template <typename T>
+bool gemm_use_strassen(int m, int n, int k) {
+	int lim = gemm_strassen_min();
+	return lim > 0 && std::is_floating_point<T>::value
+		&& std::min(m, std::min(n, k)) >= lim;
+}
+
+//Elements of workspace gemm_strassen needs for an m x n x k product
+inline size_t gemm_strassen_workspace(int m, int n, int k) {
+	size_t ret = 0;
+	while (gemm_use_strassen<float>(m, n, k)) {
+		m /= 2;
+		n /= 2;
+		k /= 2;
+		ret += (size_t) m*k + (size_t) k*n + (size_t) m*n;
+	}
+	return ret;
+}
+
+//Z = X + Y (or X - Y), all m x n. Z may alias X or Y.
+template <typename T>
+void gemm_add(
+	int m, int n, bool sub,
+	T const *X, int rs_x, int cs_x,
+	T const *Y, int rs_y, int cs_y,
+	T *Z, int rs_z, int cs_z
+) {
+	for (int i = 0; i < m; i++) {
+		T const *x = X + (long) i*rs_x;
+		T const *y = Y + (long) i*rs_y;
+		T *z = Z + (long) i*rs_z;
+		if constexpr (std::is_same<T, float>::value) {
+			if (cs_x == 1 && cs_y == 1 && cs_z == 1) {
+				if (sub) simd_map(x, y, z, n, std::minus<float>{});
+				else simd_map(x, y, z, n, std::plus<float>{});
+				continue;
+			}
+		}
+		for (int j = 0; j < n; j++) {
+			T a = x[(long) j*cs_x], b = y[(long) j*cs_y];
+			z[(long) j*cs_z] = sub ? a - b : a + b;
+		}
+	}
+}
+
+//C += alpha*A*B. ws has room for gemm_strassen_workspace(m, n, k)
+template <typename T>
+void gemm_strassen_rec(
+	int m, int n, int k, T alpha,
+	T const *A, int rs_a, int cs_a,
+	T const *B, int rs_b, int cs_b,
+	T *C, int rs_c, int cs_c,
+	T *ws
+) {
+	if (!gemm_use_strassen<T>(m, n, k)) {
+		gemm_accumulate(m, n, k, A, rs_a, cs_a, B, rs_b, cs_b, C, rs_c, cs_c, alpha);
+		return;
+	}
+
+	int m2 = m/2, n2 = n/2, k2 = k/2;
+	int me = 2*m2, ne = 2*n2, ke = 2*k2;
+
+	//Peel the odd edges off
+	if (ke < k) {
+		gemm_accumulate(me, ne, 1, A + (long) ke*cs_a, rs_a, cs_a, B + (long) ke*rs_b, rs_b, cs_b, C, rs_c, cs_c, alpha);
+	}
+	if (me < m) {
+		gemm_accumulate(1, n, k, A + (long) me*rs_a, rs_a, cs_a, B, rs_b, cs_b, C + (long) me*rs_c, rs_c, cs_c, alpha);
+	}
+	if (ne < n) {
+		gemm_accumulate(me, 1, k, A, rs_a, cs_a, B + (long) ne*cs_b, rs_b, cs_b, C + (long) ne*cs_c, rs_c, cs_c, alpha);
+	}
+
+	T const *A11 = A, *A12 = A + (long) k2*cs_a;
+	T const *A21 = A + (long) m2*rs_a, *A22 = A21 + (long) k2*cs_a;
+	T const *B11 = B, *B12 = B + (long) n2*cs_b;
+	T const *B21 = B + (long) k2*rs_b, *B22 = B21 + (long) n2*cs_b;
+	T *C11 = C, *C12 = C + (long) n2*cs_c;
+	T *C21 = C + (long) m2*rs_c, *C22 = C21 + (long) n2*cs_c;
+
+	//S: m2 x k2, Tb: k2 x n2, P: m2 x n2, all dense
+	T *S = ws;
+	T *Tb = S + (size_t) m2*k2;
+	T *P = Tb + (size_t) k2*n2;
+	T *next = P + (size_t) m2*n2;
+
+	auto sub = [&](int r, int c, T const *X, int rx, int cx, T const *Y, int ry, int cy, T *Z, int rz) {
+		gemm_add(r, c, true, X, rx, cx, Y, ry, cy, Z, rz, 1);
+	};
+	auto add_p = [&](T *Cq) { //Cq += P
+		gemm_add(m2, n2, false, Cq, rs_c, cs_c, P, n2, 1, Cq, rs_c, cs_c);
+	};
+	auto mul = [&](T a, T const *X, int rx, int cx, T const *Y, int ry, int cy, T *Z, int rz, int cz) {
+		gemm_strassen_rec(m2, n2, k2, a, X, rx, cx, Y, ry, cy, Z, rz, cz, next);
+	};
+	auto zero_p = [&] { std::fill(P, P + (size_t) m2*n2, T()); };
+
+	//With S1 = A21 + A22, S2 = S1 - A11, S3 = A11 - A21, S4 = A12 - S2
+	//and  T1 = B12 - B11, T2 = B22 - T1, T3 = B22 - B12, T4 = T2 - B21:
+	//
+	//  C11 += M1 + M2              M1 = A11*B11   M5 = S1*T1
+	//  C12 += M1 + M6 + M5 + M3    M2 = A12*B21   M6 = S2*T2
+	//  C21 += M1 + M6 + M7 - M4    M3 = S4*B22    M7 = S3*T3
+	//  C22 += M1 + M6 + M7 + M5    M4 = A22*T4
+	//
+	//M2, M3 and M4 only go to one quadrant, so they accumulate straight
+	//into C. The rest go through P.
+
+	//M5
+	gemm_add(m2, k2, false, A21, rs_a, cs_a, A22, rs_a, cs_a, S, k2, 1);
+	sub(k2, n2, B12, rs_b, cs_b, B11, rs_b, cs_b, Tb, n2);
+	zero_p();
+	mul(alpha, S, k2, 1, Tb, n2, 1, P, n2, 1);
+	add_p(C12);
+	add_p(C22);
+
+	//M1, then M1 + M6
+	sub(m2, k2, S, k2, 1, A11, rs_a, cs_a, S, k2);
+	sub(k2, n2, B22, rs_b, cs_b, Tb, n2, 1, Tb, n2);
+	zero_p();
+	mul(alpha, A11, rs_a, cs_a, B11, rs_b, cs_b, P, n2, 1);
+	add_p(C11);
+	mul(alpha, S, k2, 1, Tb, n2, 1, P, n2, 1);
+	add_p(C12);
+	add_p(C21);
+	add_p(C22);
+
+	//M3 and M4
+	sub(m2, k2, A12, rs_a, cs_a, S, k2, 1, S, k2);
+	mul(alpha, S, k2, 1, B22, rs_b, cs_b, C12, rs_c, cs_c);
+	sub(k2, n2, Tb, n2, 1, B21, rs_b, cs_b, Tb, n2);
+	mul(-alpha, A22, rs_a, cs_a, Tb, n2, 1, C21, rs_c, cs_c);
+
+	//M7
+	sub(m2, k2, A11, rs_a, cs_a, A21, rs_a, cs_a, S, k2);
+	sub(k2, n2, B22, rs_b, cs_b, B12, rs_b, cs_b, Tb, n2);
+	zero_p();
+	mul(alpha, S, k2, 1, Tb, n2, 1, P, n2, 1);
+	add_p(C21);
+	add_p(C22);
+
+	//M2
+	mul(alpha, A12, rs_a, cs_a, B21, rs_b, cs_b, C11, rs_c, cs_c);
+}
+
+//C(m x n) += alpha * A(m x k) * B(k x n) by Strassen-Winograd down to
+//gemm_strassen_min(), then the packed GEMM
+template <typename T>
+void gemm_strassen(
+	int m, int n, int k,
+	T const *A, int rs_a, int cs_a,
+	T const *B, int rs_b, int cs_b,
+	T *C, int rs_c, int cs_c,
+	T alpha = T(1)
+) {
+	T *ws = gemm_buffers<T>().get_w(gemm_strassen_workspace(m, n, k));
+	gemm_strassen_rec(m, n, k, alpha, A, rs_a, cs_a, B, rs_b, cs_b, C, rs_c, cs_c, ws);
+}
+
+//C = beta*C. beta = 0 overwrites C without reading it (so garbage or NaNs
+//in C don't leak through), like BLAS does.
+template <typename T>
+void gemm_scale_c(int m, int n, T beta, T *C, int rs_c, int cs_c) {
+	if (beta == T(1)) return;
+	for (int i = 0; i < m; i++) {
+		T *c = C + (long) i*rs_c;
+		if constexpr (std::is_same<T, float>::value) {
+			if (cs_c == 1 && beta != T(0)) {
+				simd().scale(beta, c, c, n);
+				continue;
+			}
+		}
+		for (int j = 0; j < n; j++) {
+			c[(long) j*cs_c] = (beta == T(0)) ? T() : beta * c[(long) j*cs_c];
+		}
+	}
+}
+
+//C(m x n) = alpha * A(m x k) * B(k x n) + beta * C, arbitrary strides. A
+//transposed operand is just a view with its strides swapped; the packing
+//routines have a case for each layout so they still read memory in order.
+//Uses Strassen-Winograd for big products only if GEMM_STRASSEN_MIN /
+//gemm_strassen_min() has switched it on.
+template <typename T>
+void gemm(
+	int m, int n, int k,
+	T alpha,
+	T const *A, int rs_a, int cs_a,
+	T const *B, int rs_b, int cs_b,
+	T beta,
+	T *C, int rs_c, int cs_c
+) {
+	if (m <= 0 || n <= 0) return;
+	gemm_scale_c(m, n, beta, C, rs_c, cs_c);
+	if (k <= 0 || alpha == T(0)) return;
+
+	if (static_cast<double>(m) * n * k <= GEMM_SMALL) {
+		gemm_small(m, n, k, A, rs_a, cs_a, B, rs_b, cs_b, C, rs_c, cs_c, alpha);
+	} else if (gemm_use_strassen<T>(m, n, k)) {
+		gemm_strassen(m, n, k, A, rs_a, cs_a, B, rs_b, cs_b, C, rs_c, cs_c, alpha);
+	} else {
+		gemm_accumulate(m, n, k, A, rs_a, cs_a, B, rs_b, cs_b, C, rs_c, cs_c, alpha);
+	}
+}
+
+//BLAS-style front end for row-major matrices:
+//
+//    C = alpha * op(A) * op(B) + beta * C
+//
+//where op(X) is X or X^T depending on the flag. m, n and k are the sizes of
+//op(A) (m x k), op(B) (k x n) and C (m x n); lda/ldb/ldc are the row
+//strides of the matrices as stored.
+template <typename T>
+void gemm(
+	bool transA, bool transB,
+	int m, int n, int k,
+	T alpha,
+	T const *A, int lda,
+	T const *B, int ldb,
+	T beta,
+	T *C, int ldc
+) {
+	gemm(
+		m, n, k, alpha,
+		A, transA ? 1 : lda, transA ? lda : 1,
+		B, transB ? 1 : ldb, transB ? ldb : 1,
+		beta, C, ldc, 1
+	);
+}
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef GEMM_TUNE_H
+#define GEMM_TUNE_H 1
+
+//Runtime autotuner for the GEMM cache blocking. GEMM_MC/KC/NC in gemm.h
+//are one guess for one machine, and the best values move around with the
+//cache sizes, the core count and the shape of the product (see
+//block_matrix_mult/README). Once this is switched on, the first float
+//product in each shape class gets benchmarked with a handful of
+//candidate blockings and the fastest one is used from then on.
+//
+//Shape classes are (m, n, k) each rounded up to a power of two (16 to
+//8192), plus the thread count. Tuning does coordinate descent from the
+//defaults: KC first (it sets the A and B panel heights), then MC, then
+//NC, timing a product of the class's size (capped at GEMM_TUNE_MAX_DIM
+//per dimension, so tuning the biggest classes takes about a second on one
+//core and the small ones a few tens of milliseconds).
+//
+//Looking a class up doesn't take any locks: the table is an immutable
+//snapshot that gets swapped out whenever a class is added. Only tuning
+//(and loading) takes the mutex. Products running inside a thread pool
+//worker are serial, so they're looked up as the one-thread class, and if
+//that hasn't been tuned yet they just use the defaults rather than stall
+//the rest of the parallel_for for a tuning run.
+//
+//Winners are saved to a per-host cache file and loaded on later runs, so
+//every machine ends up with its own table without a recompile. The file
+//is plain text, one class per line:
+//
+//    log2(m) log2(n) log2(k) threads mc kc nc
+//
+//Switching it on:
+//  - TENSORCOPTER_AUTOTUNE in the environment, or
+//  - gemm_autotune_enable(path) from code.
+//The cache file is path if given, otherwise TENSORCOPTER_TUNE_CACHE,
+//otherwise ~/.cache/tensorcopter_gemm_<hostname>.txt.
+//
+//There's only the one float micro-kernel at our tile shape, so there's
+//nothing to choose between there; it's the blocking that gets tuned.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gemm.h"
+#include "thread_pool.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#include <unistd.h>
+#define GEMM_TUNE_HAVE_POSIX 1
+#endif
+
+//Largest dimension used when benchmarking a class
+#ifndef GEMM_TUNE_MAX_DIM
+#define GEMM_TUNE_MAX_DIM 1024
+#endif
+
+//Each timing keeps repeating the product until it's taken at least this
+//long (seconds), so small classes still get a stable number
+#ifndef GEMM_TUNE_MIN_TIME
+#define GEMM_TUNE_MIN_TIME 0.002
+#endif
+
+//A candidate has to beat the current best by this fraction to replace it,
+//so timing noise doesn't walk us away from the defaults
+#ifndef GEMM_TUNE_MARGIN
+#define GEMM_TUNE_MARGIN 0.03
+#endif
+
+inline int gemm_tune_log2(int x) {
+	int ret = 4;
+	while ((1 << ret) < x && ret < 13) ret++;
+	return ret;
+}
+
+inline std::string gemm_tune_hostname() {
+#ifdef GEMM_TUNE_HAVE_POSIX
+	char buf[256] = {};
+	if (gethostname(buf, sizeof(buf) - 1) == 0 && buf[0]) return buf;
+#endif
+	return "localhost";
+}
+
+inline std::string gemm_tune_default_path() {
+	if (char const *env = std::getenv("TENSORCOPTER_TUNE_CACHE")) return env;
+	std::string file = "tensorcopter_gemm_" + gemm_tune_hostname() + ".txt";
+	char const *home = std::getenv("HOME");
+	if (!home) return file;
+	std::string dir = std::string(home) + "/.cache";
+#ifdef GEMM_TUNE_HAVE_POSIX
+	mkdir(dir.c_str(), 0755); //Fine if it's already there
+#endif
+	return dir + "/" + file;
+}
+
+struct gemm_tuner {
+	using key = std::array<int, 4>; //log2 m, n, k, threads
+	using table_t = std::map<key, gemm_blocking>;
+
+	std::mutex mtx; //Held by whoever is changing the table, never by readers
+	std::shared_ptr<table_t const> table = std::make_shared<table_t const>();
+	std::string path;
+
+	static key key_for(int m, int n, int k, int threads) {
+		return {gemm_tune_log2(m), gemm_tune_log2(n), gemm_tune_log2(k), threads};
+	}
+
+	std::shared_ptr<table_t const> current() const {
+		return std::atomic_load(&table);
+	}
+
+	void publish(table_t t) {
+		std::atomic_store(&table, std::shared_ptr<table_t const>(std::make_shared<table_t>(std::move(t))));
+	}
+
+	//Reads path into the table. Lines that don't parse (or describe an
+	//invalid blocking) are skipped. Returns false if there was no file.
+	bool load() {
+		std::ifstream in(path);
+		if (!in) return false;
+		table_t t = *current();
+		std::string line;
+		while (std::getline(in, line)) {
+			if (line.empty() || line[0] == '#') continue;
+			std::istringstream ss(line);
+			key kk;
+			gemm_blocking b;
+			if (!(ss >> kk[0] >> kk[1] >> kk[2] >> kk[3] >> b.mc >> b.kc >> b.nc)) continue;
+			if (b.valid()) t[kk] = b;
+		}
+		publish(std::move(t));
+		return true;
+	}
+
+	//Rewrites the whole file. Goes through a temporary and a rename so
+	//another process reading it never sees half a table.
+	void save() const {
+		if (path.empty()) return;
+		std::string tmp = path + ".tmp" + std::to_string(
+#ifdef GEMM_TUNE_HAVE_POSIX
+			getpid()
+#else
+			0
+#endif
+		);
+		{
+			std::ofstream out(tmp);
+			if (!out) return; //Can't write it. We still have the table in memory
+			out << "# GEMM blocking for " << gemm_tune_hostname() << "\n";
+			out << "# log2(m) log2(n) log2(k) threads mc kc nc\n";
+			for (auto const& e : *current()) {
+				key const& kk = e.first;
+				out << kk[0] << " " << kk[1] << " " << kk[2] << " " << kk[3] << " "
+				    << e.second.mc << " " << e.second.kc << " " << e.second.nc << "\n";
+			}
+		}
+		std::rename(tmp.c_str(), path.c_str());
+	}
+
+	//Seconds per product of this size with blocking b
+	static double time_blocking(int m, int n, int k, float const *A, float const *B, float *C, gemm_blocking const& b) {
+		using clock = std::chrono::steady_clock;
+		gemm_accumulate(m, n, k, A, k, 1, B, n, 1, C, n, 1, 1.0f, &b); //Warm up
+		double best = 1e30;
+		for (int trial = 0; trial < 3; trial++) {
+			int reps = 0;
+			auto start = clock::now();
+			double elapsed;
+			do {
+				gemm_accumulate(m, n, k, A, k, 1, B, n, 1, C, n, 1, 1.0f, &b);
+				reps++;
+				elapsed = std::chrono::duration<double>(clock::now() - start).count();
+			} while (elapsed < GEMM_TUNE_MIN_TIME);
+			best = std::min(best, elapsed / reps);
+		}
+		return best;
+	}
+
+	//Benchmarks the class kk belongs to and returns the winner
+	static gemm_blocking tune(key const& kk) {
+		int m = std::min(1 << kk[0], GEMM_TUNE_MAX_DIM);
+		int n = std::min(1 << kk[1], GEMM_TUNE_MAX_DIM);
+		int k = std::min(1 << kk[2], GEMM_TUNE_MAX_DIM);
+		std::vector<float> A((size_t) m*k, 0.5f), B((size_t) k*n, 0.25f), C((size_t) m*n, 0.0f);
+
+		gemm_blocking best;
+		double best_t = time_blocking(m, n, k, A.data(), B.data(), C.data(), best);
+
+		//Candidates bigger than the problem all behave the same, so only
+		//the first of those gets timed
+		auto sweep = [&](int gemm_blocking::*field, std::vector<int> const& cands, int dim) {
+			int start = best.*field;
+			std::vector<int> seen = {std::min(start, dim)};
+			for (int c : cands) {
+				int eff = std::min(c, dim);
+				if (std::find(seen.begin(), seen.end(), eff) != seen.end()) continue;
+				seen.push_back(eff);
+				gemm_blocking b = best;
+				b.*field = c;
+				double t = time_blocking(m, n, k, A.data(), B.data(), C.data(), b);
+				if (t < best_t * (1 - GEMM_TUNE_MARGIN)) {
+					best_t = t;
+					best = b;
+				}
+			}
+		};
+		sweep(&gemm_blocking::kc, {128, 192, 256, 384, 512}, k);
+		sweep(&gemm_blocking::mc, {48, 72, 96, 144, 192, 288}, (m + GEMM_MR - 1) / GEMM_MR * GEMM_MR);
+		sweep(&gemm_blocking::nc, {1024, 2048, 4096, 8192}, (n + GEMM_NR - 1) / GEMM_NR * GEMM_NR);
+		return best;
+	}
+
+	gemm_blocking lookup(int m, int n, int k) {
+		bool nested = thread_pool::in_worker();
+		key kk = key_for(m, n, k, nested ? 1 : tensor_num_threads());
+		auto snap = current();
+		auto it = snap->find(kk);
+		if (it != snap->end()) return it->second;
+		if (nested) return gemm_blocking();
+
+		std::lock_guard<std::mutex> lk(mtx);
+		snap = current(); //Someone else may have tuned it while we waited
+		it = snap->find(kk);
+		if (it != snap->end()) return it->second;
+
+		gemm_blocking b = tune(kk);
+		table_t t = *snap;
+		t[kk] = b;
+		publish(std::move(t));
+		save();
+		return b;
+	}
+};
+
+inline gemm_tuner& gemm_tuner_instance() {
+	static gemm_tuner ret;
+	return ret;
+}
+
+inline gemm_blocking gemm_tuned_blocking(int m, int n, int k) {
+	return gemm_tuner_instance().lookup(m, n, k);
+}
+
+//Loads the cache (path, or the default if empty) and starts using it. Not
+//thread-safe: call it before anything else is multiplying.
+inline void gemm_autotune_enable(std::string const& path = "") {
+	gemm_tuner& t = gemm_tuner_instance();
+	{
+		std::lock_guard<std::mutex> lk(t.mtx);
+		t.path = path.empty() ? gemm_tune_default_path() : path;
+		t.publish(gemm_tuner::table_t());
+		t.load();
+	}
+	gemm_blocking_hook() = gemm_tuned_blocking;
+}
+
+inline void gemm_autotune_disable() {
+	gemm_blocking_hook() = nullptr;
+}
+
+//TENSORCOPTER_AUTOTUNE switches it on for any program that includes this
+inline bool const gemm_autotune_from_env = [] {
+	if (std::getenv("TENSORCOPTER_AUTOTUNE")) gemm_autotune_enable();
+	return true;
+}();
+
+#endif
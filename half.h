@@ -0,0 +1,207 @@
+#ifndef HALF_H
+#define HALF_H 1
+
+//16-bit floating point storage types:
+//
+//  - bf16: bfloat16. Same exponent range as float, 8 bits of mantissa. It's
+//    literally the top half of a float, so converting is a shift.
+//  - fp16: IEEE half precision. 5-bit exponent (max ~65504), 11 bits of
+//    mantissa.
+//
+//These are storage types, not arithmetic types. They convert implicitly to
+//and from float, so Tensor<bf16> works with anything that only needs
+//"T x = ...; float y = x * 2;", but all math actually happens in float and
+//gets rounded (to nearest even) on the way back. The idea is to keep
+//weights and activations at half the size in memory and widen them when
+//they're loaded, e.g. tensormul(bf16, bf16 -> float) in tensor.h packs the
+//16-bit inputs into float panels and runs the regular fp32 GEMM on them.
+//
+//convert_n() is the bulk conversion; the float <-> 16-bit cases have SIMD
+//versions (AVX2 for bf16, F16C for fp16).
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+
+#include "simd.h"
+
+inline uint32_t half_float_bits(float f) {
+	uint32_t x;
+	std::memcpy(&x, &f, sizeof(x));
+	return x;
+}
+
+inline float half_bits_float(uint32_t x) {
+	float f;
+	std::memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+inline uint16_t bf16_from_float(float f) {
+	uint32_t x = half_float_bits(f);
+	if ((x & 0x7fffffff) > 0x7f800000) return static_cast<uint16_t>((x >> 16) | 0x40); //Keep NaNs quiet
+	x += 0x7fff + ((x >> 16) & 1); //Round to nearest even
+	return static_cast<uint16_t>(x >> 16);
+}
+
+inline float bf16_to_float(uint16_t h) {
+	return half_bits_float(uint32_t(h) << 16);
+}
+
+inline uint16_t fp16_from_float(float f) {
+	uint32_t x = half_float_bits(f);
+	uint16_t sign = static_cast<uint16_t>((x >> 16) & 0x8000);
+	x &= 0x7fffffff;
+
+	if (x > 0x7f800000) return sign | 0x7e00;  //NaN
+	if (x >= 0x477ff000) return sign | 0x7c00; //Rounds to (or is) infinity
+
+	if (x < 0x38800000) {
+		//Subnormal or zero. Adding 0.5 lines the value up so the bottom of
+		//the float's mantissa is exactly the half's subnormal mantissa, and
+		//lets the FPU do the rounding.
+		float v = half_bits_float(x) + 0.5f;
+		return sign | static_cast<uint16_t>(half_float_bits(v) - 0x3f000000);
+	}
+
+	//Normal: rebias the exponent (127 -> 15) and round off 13 mantissa bits
+	x += (uint32_t(15 - 127) << 23) + 0xfff + ((x >> 13) & 1);
+	return sign | static_cast<uint16_t>(x >> 13);
+}
+
+inline float fp16_to_float(uint16_t h) {
+	uint32_t sign = uint32_t(h & 0x8000) << 16;
+	uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff;
+
+	if (e == 0) {
+		float v = m * (1.0f / 16777216.0f); //m * 2^-24, exact
+		return sign ? -v : v;
+	}
+	if (e == 31) return half_bits_float(sign | 0x7f800000 | (m << 13));
+	return half_bits_float(sign | ((e + 112) << 23) | (m << 13));
+}
+
+#define HALF_TYPE(name)                                                     \
+struct name {                                                               \
+	uint16_t bits = 0;                                                      \
+                                                                            \
+	name() = default;                                                       \
+	name(float f) : bits(name##_from_float(f)) {}                           \
+	operator float() const { return name##_to_float(bits); }                \
+                                                                            \
+	static name from_bits(uint16_t b) { name ret; ret.bits = b; return ret; } \
+                                                                            \
+	name& operator+=(float f) { return *this = float(*this) + f; }          \
+	name& operator-=(float f) { return *this = float(*this) - f; }          \
+	name& operator*=(float f) { return *this = float(*this) * f; }          \
+	name& operator/=(float f) { return *this = float(*this) / f; }          \
+};                                                                          \
+static_assert(sizeof(name) == 2, #name " must be 16 bits");                 \
+                                                                            \
+inline std::ostream& operator<<(std::ostream& o, name h) { return o << float(h); }
+
+HALF_TYPE(bf16)
+HALF_TYPE(fp16)
+
+#undef HALF_TYPE
+
+template <typename T>
+struct is_half : std::integral_constant<bool,
+	std::is_same<T, bf16>::value || std::is_same<T, fp16>::value> {};
+
+////////////////////
+//BULK CONVERSIONS//
+////////////////////
+
+#ifdef SIMD_HAVE_X86
+__attribute__((target("avx2")))
+inline void bf16_to_float_avx2(bf16 const *src, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i h = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+		__m256i x = _mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16);
+		_mm256_storeu_ps(dst + i, _mm256_castsi256_ps(x));
+	}
+	for (; i < n; i++) dst[i] = src[i];
+}
+
+__attribute__((target("avx2")))
+inline void bf16_from_float_avx2(float const *src, bf16 *dst, size_t n) {
+	__m256i const bias = _mm256_set1_epi32(0x7fff);
+	__m256i const one = _mm256_set1_epi32(1);
+	__m256i const qnan = _mm256_set1_epi32(0x7fc00000);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 f = _mm256_loadu_ps(src + i);
+		__m256i x = _mm256_castps_si256(f);
+		__m256i lsb = _mm256_and_si256(_mm256_srli_epi32(x, 16), one);
+		__m256i r = _mm256_add_epi32(x, _mm256_add_epi32(bias, lsb));
+		__m256 nan = _mm256_cmp_ps(f, f, _CMP_UNORD_Q);
+		r = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(r),
+			_mm256_castsi256_ps(_mm256_or_si256(x, qnan)), nan));
+		r = _mm256_srli_epi32(r, 16);
+
+		//Narrow 8 x 32 to 8 x 16. packus works within 128-bit lanes, so
+		//gather the two useful quarters back together afterwards
+		__m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0x08);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_castsi256_si128(p));
+	}
+	for (; i < n; i++) dst[i] = src[i];
+}
+
+__attribute__((target("avx2,f16c")))
+inline void fp16_to_float_f16c(fp16 const *src, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i h = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+		_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+	}
+	for (; i < n; i++) dst[i] = src[i];
+}
+
+__attribute__((target("avx2,f16c")))
+inline void fp16_from_float_f16c(float const *src, fp16 *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+	}
+	for (; i < n; i++) dst[i] = src[i];
+}
+
+inline bool half_have_f16c() {
+	static bool const ret = [] {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("f16c") != 0;
+	}();
+	return ret;
+}
+#endif
+
+//dst[i] = src[i] for n elements, converting as we go
+template <typename S, typename D>
+void convert_n(S const *src, D *dst, size_t n) {
+	if constexpr (std::is_same<S, D>::value) {
+		std::copy(src, src + n, dst);
+		return;
+	}
+#ifdef SIMD_HAVE_X86
+	if constexpr (is_half<S>::value && std::is_same<D, float>::value) {
+		if (simd().level >= simd_level::avx2) {
+			if constexpr (std::is_same<S, bf16>::value) return bf16_to_float_avx2(src, dst, n);
+			else if (half_have_f16c()) return fp16_to_float_f16c(src, dst, n);
+		}
+	} else if constexpr (std::is_same<S, float>::value && is_half<D>::value) {
+		if (simd().level >= simd_level::avx2) {
+			if constexpr (std::is_same<D, bf16>::value) return bf16_from_float_avx2(src, dst, n);
+			else if (half_have_f16c()) return fp16_from_float_f16c(src, dst, n);
+		}
+	}
+#endif
+	for (size_t i = 0; i < n; i++) dst[i] = static_cast<D>(src[i]);
+}
+
+#endif
@@ -12,6 +12,10 @@
 
 #include "base_types.h"
 #include "tensor.h"
+#include "mapped_tensor.h"
+#include "static_tensor.h"
+#include "quant.h"
+#include "sparse.h"
 #include "debug.h"
 
 
@@ -22,8 +26,8 @@ struct perturbator : ctr_layer<rank,rank> {
 
 	perturbator(float t) : t(t) {}
 
-    virtual std::vector<int> ff_result_sz(int x_rank, int const *x_dims) const override {
-        std::vector<int> ret(x_rank);
+    virtual tensor_vector<int> ff_result_sz(int x_rank, int const *x_dims) const override {
+        tensor_vector<int> ret(x_rank);
         std::copy(x_dims, x_dims + x_rank, ret.data());
         return ret;
     }
@@ -55,6 +59,9 @@ struct fc : ctr_layer<2,2> {
 	TSpan<2, float> W;
     Tensor<float> bias_storage;
 	TSpan<1, float> bias;
+	//Set by map_params, in which case W and bias point in here instead
+	MappedTensor<float> W_mapped;
+	MappedTensor<float> bias_mapped;
 
     std::unique_ptr<activation_fn> act_fn;
     std::unique_ptr<optimizer> weight_optimizer;
@@ -104,13 +111,13 @@ struct fc : ctr_layer<2,2> {
             fc(n_out, n_in, act_fn, weight_optimizer, bias_optimizer, gen_name())
         {}
 
-    std::vector<int> ff_result_sz(int x_rank, int const *x_dims) const override {
+    tensor_vector<int> ff_result_sz(int x_rank, int const *x_dims) const override {
         if (x_rank != 2)
             throw std::runtime_error("fc canont accept input of rank " + std::to_string(x_rank));
         if (x_dims[1] != W.dims[1])
             throw std::runtime_error("fc with weight dimension " + std::to_string(x_rank) 
                         + " cannot accept input of dimension " + std::to_string(x_rank));
-        return std::vector<int>({x_dims[0], W.dims[0]});
+        return tensor_vector<int>({x_dims[0], W.dims[0]});
     }
 
     //feed-forward
@@ -118,25 +125,27 @@ struct fc : ctr_layer<2,2> {
     // W: (num outputs) x (num inputs)
     // x: (batch size) x (num inputs)
     // ret: (batch size) x (num outputs)
+    //Mostly-zero inputs (like MNIST pixels) go through the CSR path in
+    //sparse.h instead of the dense GEMM.
     void ctr_ff(TSpan<2,float> x, TSpan<2,float> y, bool save=false) override {
         assert(x.dims[1] == W.dims[1]);
 
-        auto W_T = W.transpose();
-
 		assert(y.dims[0] == x.dims[0]);
 		assert(y.dims[1] == W.dims[0]);
 
-        tensormul(x, W_T, y);
-		
-        //std::cout << "tensormul result: " << y << std::endl;
-        assert(y.length() == x.length());
-        assert(y.dims[1] == bias.dims[0]);
+		x_csr_src = nullptr;
+		if (csr_matrix const *xs = to_sparse(x)) {
+			if (save) x_csr_src = x.data; //So ctr_bp can reuse it
+			return ff_impl(xs, x, y);
+		}
+		ff_impl(nullptr, x, y);
+    }
 
-        for (int i = 0; i < y.length(); i++) { //batch size
-            for (int j = 0; j < y[i].length(); j++) { //number of outputs
-                y[i][j] = (*act_fn)(y[i][j] + bias[j]);
-            }
-        }
+    //Same thing, with the input already in CSR form
+    void ctr_ff(csr_matrix const& x, TSpan<2,float> y) {
+		assert(x.cols == W.dims[1]);
+		assert(y.dims[0] == x.rows);
+		ff_impl(&x, TSpan<2,float>(), y);
     }
 
     //backprop
@@ -159,11 +168,76 @@ struct fc : ctr_layer<2,2> {
 	) override {
         assert(x.dims[1] == W.dims[1]);
         assert(dy.dims[0] == x.dims[0]);
-        assert(dy.dims[1] == W.dims[0]);
-        assert(bias.dims[0] == dy.dims[1]);
 		assert(dx.dims[0] == x.dims[0]);
 		assert(dx.dims[1] == x.dims[1]);
 
+		bool saved = use_saved && x_csr_src == x.data
+			&& x_csr.rows == x.dims[0] && x_csr.cols == x.dims[1];
+		bp_impl(saved ? &x_csr : to_sparse(x), x, z, dy, dx);
+    }
+
+    //Same thing, with the input already in CSR form
+    void ctr_bp(
+		csr_matrix const& x, 
+		TSpan<2, float> z, 
+		TSpan<2, float> dy,
+		TSpan<2, float> dx
+	) {
+        assert(x.cols == W.dims[1]);
+        assert(dy.dims[0] == x.rows);
+		assert(dx.dims[0] == x.rows);
+		assert(dx.dims[1] == x.cols);
+		bp_impl(&x, TSpan<2,float>(), z, dy, dx);
+    }
+
+	//CSR copy of the last input, if it was sparse enough to be worth it
+	//(see sparse.h). x_csr_src is the input it came from when ctr_ff was
+	//called with save = true, otherwise null.
+	csr_matrix x_csr;
+	float const *x_csr_src = nullptr;
+
+	csr_matrix const* to_sparse(TSpan<2,float> x) {
+		long max_nnz = static_cast<long>(SPARSE_MAX_DENSITY * x.dims[0] * x.dims[1]);
+		if (!x_csr.assign(x.data, x.dims[0], x.dims[1], x.strides[0], x.strides[1], max_nnz)) {
+			x_csr.rows = 0; //Don't leave half a matrix lying around for ctr_bp
+			return nullptr;
+		}
+		return &x_csr;
+	}
+
+	//If xs isn't null it's the input and x is ignored
+	void ff_impl(csr_matrix const *xs, TSpan<2,float> x, TSpan<2,float> y) {
+		TENSOR_ALLOC_TAG(name);
+		if (xs) {
+			// y = xs * W^T
+			csr_gemm(*xs, W.dims[0], 1.0f, W.data, W.strides[1], W.strides[0],
+				0.0f, const_cast<float*>(y.data), y.strides[0], y.strides[1]);
+		} else {
+			tensorgemm(false, true, 1.0f, x, W, 0.0f, y); // y = x * W^T
+		}
+		
+        //std::cout << "tensormul result: " << y << std::endl;
+        assert(y.dims[1] == bias.dims[0]);
+
+        //bias gets broadcast down the batch
+        activation_fn& act = *act_fn;
+        tensoreltwise(y, bias, y, [&](float yy, float b) {
+            return act(yy + b);
+        });
+	}
+
+	//If xs isn't null it's the input and x is ignored
+	void bp_impl(
+		csr_matrix const *xs,
+		TSpan<2, float> x, 
+		TSpan<2, float> z, 
+		TSpan<2, float> dy,
+		TSpan<2, float> dx
+	) {
+		TENSOR_ALLOC_TAG(name);
+        assert(dy.dims[1] == W.dims[0]);
+        assert(bias.dims[0] == dy.dims[1]);
+
 		//Technically need to remake iterators every time,
 		//because (in theory) W and bias could be re-allocated
 		//(of course, this never actually happens; we allocate 
@@ -178,38 +252,44 @@ struct fc : ctr_layer<2,2> {
 		//outputs.
         //Tensor<float> z_storage = ctr_ff(x, use_saved, false);
 		//auto z = z_storage.as_tspan<2>();
-        assert(std::equal(z.dims, z.dims+2, dy.dims));
+        assert(z.dims == dy.dims);
         Tensor<float> z2_storage(dy); // (num batches) x (num outputs)
 		auto z2 = z2_storage.as_tspan<2>();
 
-        for (int i = 0; i < z2.dims[0]; i++) {
-            for (int j = 0; j < z2.dims[1]; j++) {
-                z2[i][j] *= (*act_fn)[z[i][j]]; //Silly operator[] for derivative
-            }
-        }
+        activation_fn& act = *act_fn;
+        tensoreltwise(z2, z, z2, [&](float g, float zz) {
+            return g * act[zz]; //Silly operator[] for derivative
+        });
 
-        auto z2_T = z2.transpose(); // (num outputs) x (num batches)
-        
-        Tensor<float> dErr_dW_storage = tensormul(z2_T, x); // (num outputs) x (num inputs)
+        // (num outputs) x (num inputs)
+        Tensor<float> dErr_dW_storage;
+		if (xs) {
+			//Build (z2^T * x)^T = x^T * z2 a row per input, then flip it.
+			//Writing straight into W's layout instead would knock
+			//csr_gemm off its SIMD row kernel onto a scalar scatter, which
+			//costs far more than the (tiled) transpose does
+			int dims_t[2] = {W.dims[1], W.dims[0]};
+			Tensor<float> dErr_dW_t(dims_t, 2);
+			csr_gemm_tn(*xs, W.dims[0], 1.0f, z2.data, z2.strides[0], z2.strides[1],
+				0.0f, dErr_dW_t.storage.data(), W.dims[0], 1);
+			dErr_dW_storage = Tensor<float>(dErr_dW_t.as_tspan<2>().transpose());
+		} else {
+			dErr_dW_storage = Tensor<float>(W.dims.data(), 2);
+			tensorgemm(true, false, 1.0f, z2, x, 0.0f, dErr_dW_storage.as_tspan<2>()); // z2^T * x
+		}
 		auto dErr_dW = dErr_dW_storage.as_tspan<2>();
 
-        tensormul(z2, W, dx); // (num batches) x (num inputs)
-    	assert(std::equal(dErr_dW.dims, dErr_dW.dims+2, W.dims));
-        assert(std::equal(dx.dims.data(), dx.dims.data()+2, x.dims));
+        tensorgemm(false, false, 1.0f, z2, W, 1.0f, dx); // (num batches) x (num inputs)
+    	assert(dErr_dW.dims == W.dims);
         //dErr_dbias = dy
 
         weight_optimizer->update_tspan(W, dErr_dW);
 
 		//Sum-reduce along batches (i.e. squeeze into a single row)
 		//to obtain the gradients for the bias vector.
-		Tensor<float> bias_grad_storage(bias.dims, 1);
+		Tensor<float> bias_grad_storage(bias.dims.data(), 1);
 		auto bias_grad = bias_grad_storage.as_tspan<1>();
-		for (int i = 0; i < bias_grad.length(); i++) {
-			bias_grad[i] = z2[0][i];
-			for (int j = 1; j < z2.dims[0]; j++) {
-				bias_grad[i] += z2[j][i];
-			}
-		}
+		tensorreduce(reduce_op::sum, z2, 0, bias_grad);
 
         bias_optimizer->update_tspan(bias, bias_grad);
     }
@@ -222,6 +302,32 @@ struct fc : ctr_layer<2,2> {
 	// 	return num_inputs == W.dims[1]; 
 	// }
 
+	//Writes W and then bias to path (see mapped_tensor.h)
+	void save_params(std::string const& path) const {
+		tensor_save(path, RTSpan<float>(W));
+		tensor_save(path, RTSpan<float>(bias), true);
+	}
+
+	//Uses the W and bias that save_params wrote to path straight out of
+	//the page cache instead of our own copies. With mapped_mode::read_only
+	//this layer is inference-only (the optimizers would write to the 
+	//mapping); copy_on_write can keep training.
+	void map_params(std::string const& path, mapped_mode mode) {
+		MappedTensor<float> w(path, mode);
+		MappedTensor<float> b(path, mode, w.next_offset());
+		if (w.rank != 2 || b.rank != 1 || w.dims[0] != W.dims[0] 
+			|| w.dims[1] != W.dims[1] || b.dims[0] != bias.dims[0]) {
+			throw std::runtime_error("Parameters in " + path + " don't fit " + name);
+		}
+
+		W = w.as_tspan<2>();
+		bias = b.as_tspan<1>();
+		W_mapped = std::move(w);
+		bias_mapped = std::move(b);
+		W_storage = Tensor<float>();
+		bias_storage = Tensor<float>();
+	}
+
     void dump(std::ostream& o) const override {
         o << "{\"" << name << "\": {\n";
 		//Making MSpans (instead of RTSpans) makes much faster code
@@ -238,45 +344,129 @@ struct fc : ctr_layer<2,2> {
 	}
 };
 
+//Inference-only int8 version of an fc (see quant.h). x_lo and x_hi are the
+//range of inputs the layer saw during calibration. Hangs on to the
+//original fc for its bias, activation and sizes.
+struct quantized_fc : ctr_layer<2,2> {
+	std::unique_ptr<fc> src;
+	quant_weights Wq;
+	quant_params xp;
+	std::vector<float> out_scale;  //x scale * weight scale, per output
+	std::vector<int32_t> zp_corr;  //zero point * row sum, per output
+
+	quantized_fc(std::unique_ptr<fc> f, float x_lo, float x_hi)
+		: src(std::move(f)),
+		  Wq(src->W.data, src->W.dims[0], src->W.dims[1], src->W.strides[0], src->W.strides[1]),
+		  xp(quant_calibrate(x_lo, x_hi)),
+		  out_scale(Wq.n), zp_corr(Wq.n)
+	{
+		for (int o = 0; o < Wq.n; o++) {
+			out_scale[o] = xp.scale * Wq.scale[o];
+			zp_corr[o] = xp.zero_point * Wq.row_sum[o];
+		}
+	}
+
+    tensor_vector<int> ff_result_sz(int x_rank, int const *x_dims) const override {
+		return src->ff_result_sz(x_rank, x_dims);
+	}
+
+    void ctr_ff(TSpan<2,float> x, TSpan<2,float> y, bool=false) override {
+        assert(x.dims[1] == Wq.k);
+		assert(y.dims[0] == x.dims[0]);
+		assert(y.dims[1] == Wq.n);
+
+		//The kernel wants each input row contiguous
+		Tensor<float> x_copy;
+		if (x.strides[1] != 1) {
+			x_copy = Tensor<float>(x);
+			x = x_copy.as_tspan<2>();
+		}
+
+		activation_fn& act = *src->act_fn;
+		float const *bias = src->bias.data;
+		int bs = src->bias.strides[0];
+		float *yp = const_cast<float*>(y.data);
+		int ys0 = y.strides[0], ys1 = y.strides[1];
+
+		//Dequantize, add bias and activate as each output comes out
+		quant_fc(x.data, x.dims[0], x.strides[0], xp, Wq, [&](int b, int o, int32_t acc) {
+			float v = out_scale[o] * float(acc - zp_corr[o]) + bias[o*bs];
+			yp[(long) b*ys0 + (long) o*ys1] = act(v);
+		});
+	}
+
+    void ctr_bp(
+		TSpan<2, float>, TSpan<2, float>, TSpan<2, float>, TSpan<2, float>, bool = false
+	) override {
+		throw std::runtime_error("quantized_fc is inference-only; backprop through the original fc");
+	}
+};
+
+//Post-training quantization: runs a calibration batch (e.g. a few hundred
+//training examples) through the layers in order, and swaps every fc for a
+//quantized_fc set up for the range of inputs it saw
+inline void quantize_layers(std::vector<std::unique_ptr<layer>>& layers, RTSpan<float> calib) {
+	Tensor<float> cur(calib);
+	for (auto& l : layers) {
+		Tensor<float> next = l->ff_alloc(&cur);
+		if (fc *f = dynamic_cast<fc*>(l.get())) {
+			auto range = std::minmax_element(cur.storage.begin(), cur.storage.end());
+			l.release();
+			l = std::make_unique<quantized_fc>(std::unique_ptr<fc>(f), *range.first, *range.second);
+		}
+		cur = std::move(next);
+	}
+}
+
 struct softmax : layer {
 
-    virtual std::vector<int> ff_result_sz(int x_rank, int const *x_dims) const override {
+    virtual tensor_vector<int> ff_result_sz(int x_rank, int const *x_dims) const override {
         if (x_rank != 2) {
             throw std::runtime_error("softmax cannot accept inputs of rank " + std::to_string(x_rank));
         }
-        std::vector<int> ret(x_rank);
+        tensor_vector<int> ret(x_rank);
         std::copy(x_dims, x_dims + x_rank, ret.data());
         return ret;
     }
 
     //feed-forward
     void ff(RTSpan<float> x, RTSpan<float> y, bool=false) override {
-        assert(std::equal(x.dims, x.dims + x.rank, y.dims, y.dims + y.rank));
+        assert(std::equal(x.dims.begin(), x.dims.begin() + x.rank, y.dims.begin(), y.dims.begin() + y.rank));
+		TENSOR_ALLOC_TAG("softmax");
         //TODO: use ctr_layer instead
 		auto x_it = x.as_tspan<2>();
         auto y_it = y.as_tspan<2>();
 
-		for (int i = 0; i < x_it.dims[0]; i++) {
-			float max = x_it[i][0];
-			for (int j = 1; j < x_it.dims[1]; j++) {
-				if (x_it[i][j] > max) {
-					max = x_it[i][j];
+		//Narrow rows (like a 10-class output) get a fully unrolled kernel
+		//for their exact width; see static_tensor.h
+		if (x_it.strides[1] == 1 && y_it.strides[1] == 1) {
+			bool done = static_dispatch<STATIC_MAX_WIDTH>(x_it.dims[1], [&](auto w) {
+				constexpr int N = decltype(w)::value;
+				for (int i = 0; i < x_it.dims[0]; i++) {
+					static_softmax_row(StaticSpan<float, N>(x_it[i].data), StaticSpan<float, N>(y_it[i].data));
 				}
-			}
-			
-            float sum = 0.0f;
-			for (int j = 0; j < x_it.dims[1]; j++) {
-				y_it[i][j] = exp(x_it[i][j] - max);
-                assert(!std::isinf(y_it[i][j]));
-                assert(!std::isnan(y_it[i][j]));
-				sum += y_it[i][j];
-			}
-            assert(sum > 1e-8);
-			for (int j = 0; j < x_it.dims[1]; j++) {
-				y_it[i][j] /= sum;
-                assert(y_it[i][j] >= 0);
-			}
+			});
+			if (done) return;
 		}
+
+		//Subtract off the max of each row to keep exp from blowing up.
+		//The per-row max and sum are [B x 1] and get broadcast across 
+		//the row.
+		Tensor<float> row_max = tensorreduce(reduce_op::max, x_it, 1, true);
+		MSpan<float> max_b = row_max.as_tspan<2>();
+
+		tensoreltwise(x_it, max_b, y_it, [](float xx, float m) {
+			return exp(xx - m);
+		});
+
+		Tensor<float> row_sum = tensorreduce(reduce_op::sum, y_it, 1, true);
+		MSpan<float> sum_b = row_sum.as_tspan<2>();
+		for (int i = 0; i < sum_b.dims[0]; i++) {
+			assert(!std::isinf(sum_b[i][0]) && !std::isnan(sum_b[i][0]));
+			assert(sum_b[i][0] > 1e-8);
+		}
+
+		tensoreltwise(y_it, sum_b, y_it, std::divides<float>{});
 	}
 
     //backprop
@@ -296,9 +486,9 @@ struct softmax : layer {
         bool=false
     ) override {
         assert(x.dims[1] == dy.dims[1]);
+		TENSOR_ALLOC_TAG("softmax");
 
 		//TODO: change softmax to use ctr_layer
-		auto x_it = x.as_tspan<2>();
 		auto y_it = y.as_tspan<2>();
 		auto dy_it = dy.as_tspan<2>();
 		auto dx_it = dx.as_tspan<2>();
@@ -306,47 +496,51 @@ struct softmax : layer {
 		assert(dx.dims[0] == x.dims[0]);
 		assert(dx.dims[1] == x.dims[1]);
 
+		if (y_it.strides[1] == 1 && dy_it.strides[1] == 1 && dx_it.strides[1] == 1) {
+			bool done = static_dispatch<STATIC_MAX_WIDTH>(y_it.dims[1], [&](auto w) {
+				constexpr int N = decltype(w)::value;
+				for (int i = 0; i < y_it.dims[0]; i++) {
+					static_softmax_bp_row(StaticSpan<float, N>(y_it[i].data), 
+						StaticSpan<float, N>(dy_it[i].data), StaticSpan<float, N>(dx_it[i].data));
+				}
+			});
+			if (done) return;
+		}
+
 		//if we notice that dy is one hot
 		//	do the speical case instead
 		
 		//This line deleted when we got rid of layers saving their own 
 		//outputs.
         //auto y = ff(x);
-        // (num inputs) x (num outputs)
-        int jacobian_dims[2] = {x.dims[1], y_it.dims[1]};
-
-        // For each example in batch
-        for (int i = 0; i < x_it.dims[0]; i++) {
-			// Make Jacobian of size (num inputs) x (num outputs) for each item in batches
-			// Essentially, this means (num_batches) x (num_inputs) x (num_outputs)
-			// Tensormul by dy which is (num_batches) x (num_outputs)
-			// Broadcast over first dimension
-			/*
-			for (i in num_batches) {
-				tensormul(Jacobian[i], dy[i])
-			}
-			*/
-			// Output of above is (num_batches) x (num_inputs)
-			// Multiply each Jacobian by its corresponding row in dy 
-			// Jacobian * dy.transpose() ==> (num inputs) x (batch_size) ==> reduce that
-            // (num inputs) x (num outputs)
-            
-            Tensor<float> jacobian(jacobian_dims, 2);
-			auto jac_it = jacobian.as_tspan<2>();
+        // (num batches) x (num inputs) x (num outputs)
+        int jacobian_dims[3] = {x.dims[0], x.dims[1], y_it.dims[1]};
+        Tensor<float> jacobian(jacobian_dims, 3);
+        auto jac_it = jacobian.as_tspan<3>();
 
+        // Make a Jacobian for each item in the batch
+        for (int i = 0; i < jac_it.dims[0]; i++) {
 			//J = -y[i]^T * y[i] + \mathrm{diag}(y[i])
-			
-			for (int j = 0; j < jac_it.dims[0]; j++) {
-				for (int k = 0; k < jac_it.dims[1]; k++) {
-					jac_it[j][k] = -y_it[i][j] * y_it[i][k];
-					if (j == k) jac_it[j][k] += y_it[i][j];
+			for (int j = 0; j < jac_it.dims[1]; j++) {
+				for (int k = 0; k < jac_it.dims[2]; k++) {
+					jac_it[i][j][k] = -y_it[i][j] * y_it[i][k];
+					if (j == k) jac_it[i][j][k] += y_it[i][j];
 				}
 			}
-
-            // dx[i] = dErr/(dy[i]) = tensormul(derivative, dy[i]);
-			// Thank god we did this the right way in the first place
-            tensormul(jac_it, dy_it[i], dx_it[i]);
         }
+
+        // dx[i] = dErr/(dy[i]) = tensormul(Jacobian[i], dy[i]), all at once.
+        // Treat each row of dy and dx as a column vector (N x 1) so it's a
+        // batched matrix multiply
+        int dy_dims[3] = {dy_it.dims[0], dy_it.dims[1], 1};
+        int dy_strides[3] = {dy_it.strides[0], dy_it.strides[1], 1};
+        int dx_dims[3] = {dx_it.dims[0], dx_it.dims[1], 1};
+        int dx_strides[3] = {dx_it.strides[0], dx_it.strides[1], 1};
+        tensorbmm(
+            jac_it,
+            TSpan<3, float>(dy_it.data, dy_dims, dy_strides),
+            TSpan<3, float>(dx_it.data, dx_dims, dx_strides)
+        );
     }
 };
 
@@ -377,10 +571,18 @@ struct RNN {
 		RTSpan<float> const& x,
 		bool use_saved = false, bool save = false
 	) override {
-        h = 0
+        //xh is [batch size x (input SE dim + state dim)], allocated once.
+        //Only x[t] gets copied in each step; impl writes its output into
+        //out, and its state part is copied into xh's h slice for the next
+        //step (see tensorslices / tensorconcat in tensor.h)
+        auto xh_parts = tensorslices(xh, 1, {input_dim, state_dim}); // x slot, h slot
+        auto out_parts = tensorslices(out, 1, {output_dim, state_dim}); // y, new h
+        xh_parts[1] = 0
         foreach t = 0 to x.size() {
-            output = impl->ff(concat(x[t], h));
-            y[t], h = split(output)
+            x[t].deep_copy_to(xh_parts[0]);
+            impl->ff(xh, out);
+            y[t] = out_parts[0];
+            out_parts[1].deep_copy_to(xh_parts[1]);
         }
         return y;
 	}
@@ -0,0 +1,410 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H 1
+
+//Stride analysis for the elementwise ops. Almost everything we allocate is
+//dense row-major, so walking it one TSpan row at a time is mostly overhead.
+//Before doing an elementwise op we look at all the operands together and
+//merge any pair of adjacent dimensions that is "mergeable" for every one of
+//them, i.e.
+//
+//    strides[i] == strides[i+1] * dims[i+1]
+//
+//A dense tensor collapses all the way down to a single flat loop. A real
+//view (transpose(), submat(), ...) collapses as far as it can and then gets
+//walked with raw pointers, which is still a lot cheaper than building a
+//sub-view for every row.
+
+#include <algorithm>
+#include <cstdlib>
+#include <type_traits>
+
+#include "half.h"
+#include "simd.h"
+
+//Largest rank the flat paths handle. Anything bigger just uses the old
+//recursive code.
+#ifndef TENSOR_MAX_RANK
+#define TENSOR_MAX_RANK 8
+#endif
+
+//Number of elements if (dims, strides) describe one dense row-major block,
+//otherwise -1. Size-1 dimensions are ignored since their stride never
+//actually gets used.
+inline long contiguous_size(int rank, int const *dims, int const *strides) {
+	long expected = 1;
+	for (int i = rank - 1; i >= 0; i--) {
+		if (dims[i] != 1 && strides[i] != expected) return -1;
+		expected *= dims[i];
+	}
+	return expected;
+}
+
+//Collapsed shape shared by N operands that all have the same dims
+template <int N>
+struct flat_layout {
+	int rank;
+	int dims[TENSOR_MAX_RANK];
+	int strides[N][TENSOR_MAX_RANK];
+
+	//True if this is a single loop and every operand is unit-stride
+	bool is_flat() const {
+		if (rank != 1) return false;
+		for (int k = 0; k < N; k++) if (strides[k][0] != 1) return false;
+		return true;
+	}
+};
+
+//Returns false if rank is too big to handle (caller should fall back to
+//the recursive code). Size-1 dimensions get dropped entirely.
+template <int N>
+bool collapse_layout(
+	int rank, int const *dims, int const *const *strides,
+	flat_layout<N>& out
+) {
+	if (rank > TENSOR_MAX_RANK) return false;
+
+	out.rank = 0;
+	for (int i = 0; i < rank; i++) {
+		if (dims[i] == 1) continue;
+
+		int r = out.rank;
+		bool mergeable = (r > 0);
+		for (int k = 0; k < N && mergeable; k++) {
+			mergeable = (out.strides[k][r-1] == strides[k][i] * dims[i]);
+		}
+
+		if (mergeable) {
+			out.dims[r-1] *= dims[i];
+			for (int k = 0; k < N; k++) out.strides[k][r-1] = strides[k][i];
+		} else {
+			out.dims[r] = dims[i];
+			for (int k = 0; k < N; k++) out.strides[k][r] = strides[k][i];
+			out.rank++;
+		}
+	}
+
+	//Rank-0 (everything was size 1) is still one element
+	if (out.rank == 0) {
+		out.rank = 1;
+		out.dims[0] = 1;
+		for (int k = 0; k < N; k++) out.strides[k][0] = 1;
+	}
+	return true;
+}
+
+////////////////////////////
+//RAW-POINTER LOOP DRIVERS//
+////////////////////////////
+//d is the dimension we're currently iterating over. The innermost loop goes
+//to the SIMD kernels whenever it's unit-stride float. Inputs may have
+//stride-0 (broadcast) dimensions; dst never should.
+
+template <typename T, typename fn>
+void flat_unary(flat_layout<2> const& L, int d, T const *src, T *dst, fn& F) {
+	int n = L.dims[d];
+	int ss = L.strides[0][d], ds = L.strides[1][d];
+	if (d < L.rank - 1) {
+		for (int i = 0; i < n; i++) flat_unary(L, d + 1, src + i*ss, dst + i*ds, F);
+		return;
+	}
+
+	if (ss == 0) {
+		//Broadcast source: it's the same value all the way along
+		T v = F(*src);
+		for (int i = 0; i < n; i++) dst[i*ds] = v;
+		return;
+	}
+
+	if constexpr (std::is_same<T, float>::value) {
+		if (ss == 1 && ds == 1) {
+			simd_map(src, dst, n, F);
+			return;
+		}
+	}
+	for (int i = 0; i < n; i++) dst[i*ds] = F(src[i*ss]);
+}
+
+//Innermost loop of flat_binary when one operand is broadcast along it
+//(stride 0). The invariant value gets loaded once and captured, so the
+//loop only streams the other operand.
+template <typename T, typename fn>
+void flat_binary_hoisted(int n, T const *x, int xs, T v, bool v_on_left, T *dst, int ds, fn& F) {
+	if (v_on_left) {
+		auto G = [&F, v](T b) { return F(v, b); };
+		if constexpr (std::is_same<T, float>::value) {
+			if (xs == 1 && ds == 1) return simd_map(x, dst, n, G);
+		}
+		for (int i = 0; i < n; i++) dst[i*ds] = G(x[i*xs]);
+	} else {
+		auto G = [&F, v](T a) { return F(a, v); };
+		if constexpr (std::is_same<T, float>::value) {
+			if (xs == 1 && ds == 1) return simd_map(x, dst, n, G);
+		}
+		for (int i = 0; i < n; i++) dst[i*ds] = G(x[i*xs]);
+	}
+}
+
+template <typename T, typename fn>
+void flat_binary(flat_layout<3> const& L, int d, T const *lhs, T const *rhs, T *dst, fn& F) {
+	int n = L.dims[d];
+	int ls = L.strides[0][d], rs = L.strides[1][d], ds = L.strides[2][d];
+	if (d < L.rank - 1) {
+		for (int i = 0; i < n; i++) flat_binary(L, d + 1, lhs + i*ls, rhs + i*rs, dst + i*ds, F);
+		return;
+	}
+
+	if (rs == 0 && ls != 0) return flat_binary_hoisted(n, lhs, ls, *rhs, false, dst, ds, F);
+	if (ls == 0 && rs != 0) return flat_binary_hoisted(n, rhs, rs, *lhs, true, dst, ds, F);
+
+	if constexpr (std::is_same<T, float>::value) {
+		if (ls == 1 && rs == 1 && ds == 1) {
+			simd_map(lhs, rhs, dst, n, F);
+			return;
+		}
+	}
+	for (int i = 0; i < n; i++) dst[i*ds] = F(lhs[i*ls], rhs[i*rs]);
+}
+
+template <typename T>
+void flat_copy(flat_layout<2> const& L, int d, T const *src, T *dst) {
+	int n = L.dims[d];
+	int ss = L.strides[0][d], ds = L.strides[1][d];
+	if (d < L.rank - 1) {
+		for (int i = 0; i < n; i++) flat_copy(L, d + 1, src + i*ss, dst + i*ds);
+	} else if (ss == 1 && ds == 1) {
+		std::copy(src, src + n, dst);
+	} else {
+		for (int i = 0; i < n; i++) dst[i*ds] = src[i*ss];
+	}
+}
+
+//flat_copy between different element types (e.g. float <-> bf16). The
+//innermost unit-stride loop goes to the bulk conversions in half.h.
+template <typename S, typename D>
+void flat_convert(flat_layout<2> const& L, int d, S const *src, D *dst) {
+	int n = L.dims[d];
+	int ss = L.strides[0][d], ds = L.strides[1][d];
+	if (d < L.rank - 1) {
+		for (int i = 0; i < n; i++) flat_convert(L, d + 1, src + (long) i*ss, dst + (long) i*ds);
+	} else if (ss == 1 && ds == 1) {
+		convert_n(src, dst, n);
+	} else {
+		for (int i = 0; i < n; i++) dst[(long) i*ds] = static_cast<D>(src[(long) i*ss]);
+	}
+}
+
+//Below this many rows and columns, layout_transpose stops splitting and
+//just copies. 32x32 floats is 4KB per side, so the source and destination
+//blocks both sit in L1.
+#ifndef LAYOUT_TILE
+#define LAYOUT_TILE 32
+#endif
+
+#ifdef SIMD_HAVE_X86
+//8x8 float transpose: row r of d (rows ds apart) gets column r of the 8 rows
+//of s (ss apart). Both sides unit-stride within a row.
+__attribute__((target("avx2")))
+inline void layout_transpose8_avx2(float const *s, long ss, float *d, long ds) {
+	__m256 r0 = _mm256_loadu_ps(s),        r1 = _mm256_loadu_ps(s + ss);
+	__m256 r2 = _mm256_loadu_ps(s + 2*ss), r3 = _mm256_loadu_ps(s + 3*ss);
+	__m256 r4 = _mm256_loadu_ps(s + 4*ss), r5 = _mm256_loadu_ps(s + 5*ss);
+	__m256 r6 = _mm256_loadu_ps(s + 6*ss), r7 = _mm256_loadu_ps(s + 7*ss);
+
+	__m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+	__m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+	__m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+	__m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+
+	r0 = _mm256_shuffle_ps(t0, t2, 0x44); r1 = _mm256_shuffle_ps(t0, t2, 0xee);
+	r2 = _mm256_shuffle_ps(t1, t3, 0x44); r3 = _mm256_shuffle_ps(t1, t3, 0xee);
+	r4 = _mm256_shuffle_ps(t4, t6, 0x44); r5 = _mm256_shuffle_ps(t4, t6, 0xee);
+	r6 = _mm256_shuffle_ps(t5, t7, 0x44); r7 = _mm256_shuffle_ps(t5, t7, 0xee);
+
+	_mm256_storeu_ps(d,        _mm256_permute2f128_ps(r0, r4, 0x20));
+	_mm256_storeu_ps(d + ds,   _mm256_permute2f128_ps(r1, r5, 0x20));
+	_mm256_storeu_ps(d + 2*ds, _mm256_permute2f128_ps(r2, r6, 0x20));
+	_mm256_storeu_ps(d + 3*ds, _mm256_permute2f128_ps(r3, r7, 0x20));
+	_mm256_storeu_ps(d + 4*ds, _mm256_permute2f128_ps(r0, r4, 0x31));
+	_mm256_storeu_ps(d + 5*ds, _mm256_permute2f128_ps(r1, r5, 0x31));
+	_mm256_storeu_ps(d + 6*ds, _mm256_permute2f128_ps(r2, r6, 0x31));
+	_mm256_storeu_ps(d + 7*ds, _mm256_permute2f128_ps(r3, r7, 0x31));
+}
+#endif
+
+//dst[i*ds0 + j*ds1] = src[i*ss0 + j*ss1] for a rows x cols block, where
+//src is meant to be contiguous down i and dst along j (so one side or the
+//other has to be read or written against the grain). Cache-oblivious: keep
+//halving the longer side until the block fits in L1, so every level of
+//cache gets blocks it can hold without us having to know how big it is.
+//Float blocks with unit strides on both sides go 8x8 at a time through
+//registers.
+template <typename T>
+void layout_transpose(int rows, int cols, T const *src, long ss0, long ss1, T *dst, long ds0, long ds1) {
+	if (rows > LAYOUT_TILE || cols > LAYOUT_TILE) {
+		//Split on a multiple of 8 so the 8x8 blocks stay whole
+		if (rows >= cols) {
+			int h = (rows / 2 + 7) & ~7;
+			layout_transpose(h, cols, src, ss0, ss1, dst, ds0, ds1);
+			layout_transpose(rows - h, cols, src + h*ss0, ss0, ss1, dst + h*ds0, ds0, ds1);
+		} else {
+			int h = (cols / 2 + 7) & ~7;
+			layout_transpose(rows, h, src, ss0, ss1, dst, ds0, ds1);
+			layout_transpose(rows, cols - h, src + h*ss1, ss0, ss1, dst + h*ds1, ds0, ds1);
+		}
+		return;
+	}
+
+	int i8 = 0, j8 = 0;
+#ifdef SIMD_HAVE_X86
+	if constexpr (std::is_same<T, float>::value) {
+		if (ss0 == 1 && ds1 == 1 && simd().level >= simd_level::avx2) {
+			i8 = rows / 8 * 8;
+			j8 = cols / 8 * 8;
+			for (int j = 0; j < j8; j += 8) {
+				for (int i = 0; i < i8; i += 8) {
+					layout_transpose8_avx2(src + j*ss1 + i, ss1, dst + i*ds0 + j, ds0);
+				}
+			}
+		}
+	}
+#endif
+	//Whatever the 8x8 blocks didn't cover
+	for (int j = 0; j < cols; j++) {
+		T const *s = src + j*ss1;
+		T *t = dst + j*ds1;
+		for (int i = (j < j8) ? i8 : 0; i < rows; i++) t[i*ds0] = s[i*ss0];
+	}
+}
+
+//Walks every dimension except p and the last one, and hands each (p, last)
+//plane to layout_transpose
+template <typename T>
+void flat_gather_planes(flat_layout<2> const& L, int d, int p, T const *src, T *dst) {
+	int last = L.rank - 1;
+	if (d == p) d++;
+	if (d < last) {
+		int n = L.dims[d];
+		int ss = L.strides[0][d], ds = L.strides[1][d];
+		for (int i = 0; i < n; i++) flat_gather_planes(L, d + 1, p, src + (long) i*ss, dst + (long) i*ds);
+		return;
+	}
+	layout_transpose(
+		L.dims[p], L.dims[last],
+		src, L.strides[0][p], L.strides[0][last],
+		dst, L.strides[1][p], L.strides[1][last]
+	);
+}
+
+//Like flat_copy, but for when the destination is dense and the source might
+//be anything, e.g. a transpose() or permute() of a dense tensor. If the
+//source's last dimension isn't its most contiguous one, a row-at-a-time
+//copy would touch a new cache line for every element it reads. Instead we
+//pair the source's most contiguous dimension with the destination's last
+//one and transpose block by block, looping over all the other dimensions
+//outside that.
+template <typename T>
+void flat_gather(flat_layout<2> const& L, T const *src, T *dst) {
+	int last = L.rank - 1;
+	int p = last;
+	for (int i = 0; i < L.rank; i++) {
+		if (std::abs(L.strides[0][i]) < std::abs(L.strides[0][p])) p = i;
+	}
+
+	if (p == last || L.strides[0][last] == 1) {
+		flat_copy(L, 0, src, dst);
+	} else {
+		flat_gather_planes(L, 0, p, src, dst);
+	}
+}
+
+//Convenience wrappers. Return false if the caller has to fall back to the
+//recursive path.
+
+template <typename T, typename fn>
+bool layout_unary(
+	int rank, int const *dims,
+	T const *src, int const *src_strides,
+	T *dst, int const *dst_strides,
+	fn& F
+) {
+	int const *strides[2] = {src_strides, dst_strides};
+	flat_layout<2> L;
+	if (!collapse_layout(rank, dims, strides, L)) return false;
+	flat_unary(L, 0, src, dst, F);
+	return true;
+}
+
+template <typename T, typename fn>
+bool layout_binary(
+	int rank, int const *dims,
+	T const *lhs, int const *lhs_strides,
+	T const *rhs, int const *rhs_strides,
+	T *dst, int const *dst_strides,
+	fn& F
+) {
+	int const *strides[3] = {lhs_strides, rhs_strides, dst_strides};
+	flat_layout<3> L;
+	if (!collapse_layout(rank, dims, strides, L)) return false;
+	flat_binary(L, 0, lhs, rhs, dst, F);
+	return true;
+}
+
+template <typename T>
+bool layout_copy(
+	int rank, int const *dims,
+	T const *src, int const *src_strides,
+	T *dst, int const *dst_strides
+) {
+	int const *strides[2] = {src_strides, dst_strides};
+	flat_layout<2> L;
+	if (!collapse_layout(rank, dims, strides, L)) return false;
+	flat_copy(L, 0, src, dst);
+	return true;
+}
+
+//Copy a view into dense row-major dst. A dense source is one straight copy;
+//everything else goes through flat_gather.
+template <typename T>
+bool layout_gather(int rank, int const *dims, T const *src, int const *src_strides, T *dst) {
+	long n = contiguous_size(rank, dims, src_strides);
+	if (n >= 0) {
+		std::copy(src, src + n, dst);
+		return true;
+	}
+
+	if (rank > TENSOR_MAX_RANK) return false;
+	int dense[TENSOR_MAX_RANK];
+	int prod = 1;
+	for (int i = rank - 1; i >= 0; i--) {
+		dense[i] = prod;
+		prod *= dims[i];
+	}
+
+	int const *strides[2] = {src_strides, dense};
+	flat_layout<2> L;
+	collapse_layout(rank, dims, strides, L);
+	flat_gather(L, src, dst);
+	return true;
+}
+
+//Concatenation of dense blocks: dst is outer rows, and each row is part 0's
+//row (lens[0] elements), then part 1's, and so on. One pass over dst, front
+//to back. A null src means that part is already in place and gets skipped.
+template <typename T>
+void layout_concat(long outer, int nparts, T const *const *srcs, long const *lens, T *dst) {
+	long row = 0;
+	for (int p = 0; p < nparts; p++) row += lens[p];
+
+	for (long o = 0; o < outer; o++) {
+		T *d = dst + o*row;
+		for (int p = 0; p < nparts; p++) {
+			if (srcs[p]) {
+				T const *s = srcs[p] + o*lens[p];
+				std::copy(s, s + lens[p], d);
+			}
+			d += lens[p];
+		}
+	}
+}
+
+#endif
@@ -25,6 +25,11 @@
 #include "mnist/load_mnist.h"
 #include "optimizers.h"
 
+//With -DTENSOR_ALLOC_STATS, print the allocation report for every Nth batch
+#ifndef TENSOR_ALLOC_REPORT_EVERY
+#define TENSOR_ALLOC_REPORT_EVERY 100
+#endif
+
 int volatile stop = 0;
 
 void sigint_handler(int s) {
@@ -157,8 +162,8 @@ public:
 
     Model() {}
 
-    std::vector<int> ff_result_sz(int x_rank, int const *x_dims) const override {
-        std::vector<int> cur_dims(x_rank);
+    tensor_vector<int> ff_result_sz(int x_rank, int const *x_dims) const override {
+        tensor_vector<int> cur_dims(x_rank);
         std::copy(x_dims, x_dims + x_rank, cur_dims.data());
         for (auto const& layer : layers) {
             cur_dims = layer->ff_result_sz(cur_dims.size(), cur_dims.data());
@@ -205,6 +210,7 @@ public:
 
     //feed-forward
     void ff(RTSpan<float> x, RTSpan<float> y, bool save=false) override {
+        TENSOR_ALLOC_TAG("ff");
         ff_impl(x, y, save, layer_outputs);
     }
 
@@ -216,16 +222,19 @@ public:
 		RTSpan<float> dx, //output is written here
         bool use_saved=false
 	) override {
-        assert(std::equal(x.dims, x.dims + x.rank, dx.dims));
+        assert(std::equal(x.dims.begin(), x.dims.begin() + x.rank, dx.dims.begin()));
+		TENSOR_ALLOC_TAG("bp");
 
 		std::vector<Tensor<float>> newly_computed; //Not always used
 
-		std::vector<RTSpan<float>> fenceposts;
+		tensor_vector<RTSpan<float>> fenceposts;
+		fenceposts.reserve(layers.size() + 1);
 
 		//fenceposts = {x, layer_outputs[1 .. n-1] , y}
 		fenceposts.push_back(x);
         if (!use_saved) {
-            Tensor<float> temp(ff_result_sz(x.rank, x.dims));
+            auto temp_dims = ff_result_sz(x.rank, x.dims.data());
+            Tensor<float> temp(temp_dims.data(), temp_dims.size());
 			ff_impl(x, &temp, true, newly_computed);
 			for (unsigned i = 0; i < newly_computed.size(); i++) {
 				fenceposts.push_back(&newly_computed[i]);
@@ -265,6 +274,12 @@ public:
     //     layers.push_back(make_shared<fc>(r, c, act));
     // }
 
+    //Swaps the fc layers for int8 ones (see quantize_layers in layers.h).
+    //Inference only after this
+    void quantize(RTSpan<float> calib) {
+        quantize_layers(layers, calib);
+    }
+
     void add_layer(std::unique_ptr<layer> pl) {
         layers.push_back(std::move(pl));
     }
@@ -303,6 +318,9 @@ double evaluate_mnist(Model& model, const std::vector<tpair>& examples) {
 	int num_incorrect = 0;
 
     for (const auto& example : examples) {    
+		tensor_thread_arena().reset();
+		tensor_arena_scope example_scope;
+
         Tensor<float> input_mat(example.first, input_mat_dims, 2); //1x784
 		Tensor<float> output_mat = model.ff_alloc(&input_mat);        //1x10
 
@@ -367,12 +385,23 @@ Model train_mnist(std::vector<tpair> examples) {
         for (int b = 0; b < num_batches; b++) {
 			if (stop) break;
 			cout << "Batch number = " << b << "\t";
+
+			//Everything this step allocates comes out of the arena. Reset it
+			//here rather than at the bottom so output is still good after
+			//the loop finishes
+			tensor_arena& arena = tensor_thread_arena();
+			arena.reset();
+			tensor_arena_scope step_scope(arena);
+#ifdef TENSOR_ALLOC_STATS
+			tensor_alloc_begin_step();
+#endif
+
             int this_batch_size = batch_size + (b < (examples.size() % batch_size));
 
             int input_dims[2] = {this_batch_size, input_dim};
             int output_dims[2] = {this_batch_size, output_dim};
-            std::vector<float> input_data(this_batch_size * input_dim);
-            std::vector<float> expected_output_data(this_batch_size * output_dim);
+            tensor_vector<float> input_data(this_batch_size * input_dim);
+            tensor_vector<float> expected_output_data(this_batch_size * output_dim);
 
             for (int i = 0; i < this_batch_size; i++) {
                 assert(batch_start_idx + i < examples.size());
@@ -401,6 +430,13 @@ Model train_mnist(std::vector<tpair> examples) {
 
             model.bp_alloc(&batch_inputs, &output, &gradient, true);
 
+#ifdef TENSOR_ALLOC_STATS
+			//Batch inputs and the cost gradient come out "(untagged)"
+			if (b % TENSOR_ALLOC_REPORT_EVERY == 0) {
+				tensor_alloc_report(cerr, "Allocations, epoch " + to_string(epoch) + " batch " + to_string(b));
+			}
+#endif
+
             batch_start_idx += this_batch_size;
         }
     } while (abs(cost - last_cost) > 1e-7 && ++epoch < max_epoch && !stop);
@@ -449,6 +485,16 @@ int main() {
 	vector<tpair> testing_examples = load_mnist_testing("mnist");
 	cout << "Percent accuracy: " << evaluate_mnist(model, testing_examples) << "%" << el;
 
+	//Calibrate on some training examples and try the int8 version
+	int calib_dims[2] = {std::min(256, (int) training_examples.size()), 784};
+	tensor_vector<float> calib_data;
+	for (int i = 0; i < calib_dims[0]; i++) {
+		calib_data.insert(calib_data.end(), training_examples[i].first.begin(), training_examples[i].first.end());
+	}
+	Tensor<float> calib(std::move(calib_data), calib_dims, 2);
+	model.quantize(&calib);
+	cout << "Percent accuracy (int8): " << evaluate_mnist(model, testing_examples) << "%" << el;
+
     debug_out << "]" << el;
 
     debug_out << R"###(
@@ -0,0 +1,301 @@
+#ifndef MAPPED_TENSOR_H
+#define MAPPED_TENSOR_H 1
+
+//Tensors that live in a file and get mmapped instead of read in. A
+//Tensor always owns its storage, so loading a big pretrained model means
+//reading and copying every weight at startup. A MappedTensor just maps the
+//file: pages get faulted in the first time they're touched, and any number
+//of processes mapping the same file read-only share one copy of it in the
+//page cache.
+//
+//File format: one or more regions, each starting on a
+//MAPPED_TENSOR_ALIGN boundary:
+//
+//    mapped_tensor_header | padding | data
+//
+//The data starts MAPPED_TENSOR_ALIGN bytes into the region, so it's page
+//aligned (and therefore fine for the aligned SIMD loads too). Everything
+//is in native byte order. tensor_save() writes a region (appending if
+//you ask it to) and returns its offset; MappedTensor(path, mode, offset)
+//maps one. next_offset() is where the following region starts, so a file
+//with several tensors can be walked front to back.
+//
+//Two ways to map:
+//  - mapped_mode::read_only: MAP_SHARED, PROT_READ. For inference. The
+//    pages are the page cache's pages, so writing through a view of one of
+//    these will segfault.
+//  - mapped_mode::copy_on_write: MAP_PRIVATE, read/write. For fine-tuning.
+//    Pages are shared until you write to them, then that page gets a
+//    private copy. Nothing ever goes back to the file.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "half.h"
+#include "tensor.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_TENSOR_HAVE_MMAP 1
+#endif
+
+//Region alignment in the file. Has to be a multiple of the page size
+#ifndef MAPPED_TENSOR_ALIGN
+#define MAPPED_TENSOR_ALIGN 4096
+#endif
+
+#define MAPPED_TENSOR_VERSION 1
+
+enum class mapped_mode {
+	read_only,
+	copy_on_write
+};
+
+//Element type codes stored in the header
+template <typename T> struct tensor_dtype;
+template <> struct tensor_dtype<float>   { static constexpr uint32_t code = 1; };
+template <> struct tensor_dtype<double>  { static constexpr uint32_t code = 2; };
+template <> struct tensor_dtype<bf16>    { static constexpr uint32_t code = 3; };
+template <> struct tensor_dtype<fp16>    { static constexpr uint32_t code = 4; };
+template <> struct tensor_dtype<int8_t>  { static constexpr uint32_t code = 5; };
+template <> struct tensor_dtype<int32_t> { static constexpr uint32_t code = 6; };
+
+struct mapped_tensor_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t dtype;
+	uint32_t elem_size;
+	uint32_t rank;
+	uint64_t data_offset; //From the start of the region
+	uint64_t count;       //Elements stored after data_offset
+	int32_t dims[TENSOR_MAX_RANK];
+	int32_t strides[TENSOR_MAX_RANK];
+};
+static_assert(sizeof(mapped_tensor_header) <= MAPPED_TENSOR_ALIGN, "Header must fit before the data");
+
+inline char const* mapped_tensor_magic() { return "TCTENSR"; }
+
+#ifdef MAPPED_TENSOR_HAVE_MMAP
+inline void mapped_tensor_write_all(int fd, void const *buf, size_t len, off_t off, std::string const& path) {
+	char const *p = static_cast<char const*>(buf);
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n <= 0) throw std::runtime_error("Could not write tensor to " + path);
+		p += n;
+		len -= n;
+		off += n;
+	}
+}
+#endif
+
+//Writes t (any strides; it gets stored dense) as a new region of path and
+//returns the region's offset. Without append the file is truncated first.
+template <typename T>
+long tensor_save(std::string const& path, RTSpan<T> const t, bool append = false) {
+#ifdef MAPPED_TENSOR_HAVE_MMAP
+	if (t.rank > TENSOR_MAX_RANK) throw std::runtime_error("Rank too big for tensor_save");
+
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC), 0644);
+	if (fd < 0) throw std::runtime_error("Could not open " + path + " for writing");
+
+	off_t end = lseek(fd, 0, SEEK_END);
+	off_t off = (end + MAPPED_TENSOR_ALIGN - 1) / MAPPED_TENSOR_ALIGN * MAPPED_TENSOR_ALIGN;
+
+	mapped_tensor_header hdr;
+	std::memset(&hdr, 0, sizeof(hdr));
+	std::memcpy(hdr.magic, mapped_tensor_magic(), sizeof(hdr.magic));
+	hdr.version = MAPPED_TENSOR_VERSION;
+	hdr.dtype = tensor_dtype<T>::code;
+	hdr.elem_size = sizeof(T);
+	hdr.rank = t.rank;
+	hdr.data_offset = MAPPED_TENSOR_ALIGN;
+	hdr.count = 1;
+	for (int i = t.rank - 1; i >= 0; i--) {
+		hdr.dims[i] = t.dims[i];
+		hdr.strides[i] = static_cast<int32_t>(hdr.count);
+		hdr.count *= t.dims[i];
+	}
+
+	try {
+		mapped_tensor_write_all(fd, &hdr, sizeof(hdr), off, path);
+		size_t bytes = hdr.count * sizeof(T);
+		if (contiguous_size(t.rank, t.dims.data(), t.strides.data()) >= 0) {
+			mapped_tensor_write_all(fd, t.data, bytes, off + hdr.data_offset, path);
+		} else {
+			Tensor<T> dense(t);
+			mapped_tensor_write_all(fd, dense.storage.data(), bytes, off + hdr.data_offset, path);
+		}
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+	return off;
+#else
+	(void) path; (void) t; (void) append;
+	throw std::runtime_error("tensor_save needs POSIX file I/O");
+#endif
+}
+
+template <typename T>
+struct MappedTensor {
+	T *data = nullptr;
+	int rank = 0;
+	std::array<int, TENSOR_MAX_RANK> dims{};
+	std::array<int, TENSOR_MAX_RANK> strides{};
+
+	void *map_base = nullptr;
+	size_t map_len = 0;
+	long region_offset = 0;
+
+	MappedTensor() = default;
+
+	MappedTensor(std::string const& path, mapped_mode mode, long offset = 0) {
+#ifdef MAPPED_TENSOR_HAVE_MMAP
+		if (offset % MAPPED_TENSOR_ALIGN) throw std::runtime_error("Mapped tensor offset must be aligned");
+
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) throw std::runtime_error("Could not open " + path);
+
+		struct stat st;
+		mapped_tensor_header hdr;
+		bool ok = (fstat(fd, &st) == 0)
+			&& (offset + (long) sizeof(hdr) <= st.st_size)
+			&& (pread(fd, &hdr, sizeof(hdr), offset) == (ssize_t) sizeof(hdr));
+		if (!ok) {
+			close(fd);
+			throw std::runtime_error("Could not read tensor header from " + path);
+		}
+
+		try {
+			check_header(hdr, st.st_size - offset, path);
+		} catch (...) {
+			close(fd);
+			throw;
+		}
+
+		int prot = PROT_READ;
+		int flags = MAP_SHARED;
+		if (mode == mapped_mode::copy_on_write) {
+			prot |= PROT_WRITE;
+			flags = MAP_PRIVATE;
+		}
+		map_len = hdr.data_offset + hdr.count * sizeof(T);
+		void *p = mmap(nullptr, map_len, prot, flags, fd, offset);
+		close(fd); //The mapping keeps its own reference to the file
+		if (p == MAP_FAILED) throw std::runtime_error("Could not mmap " + path);
+
+		map_base = p;
+		region_offset = offset;
+		data = reinterpret_cast<T*>(static_cast<char*>(p) + hdr.data_offset);
+		rank = hdr.rank;
+		std::copy(hdr.dims, hdr.dims + rank, dims.begin());
+		std::copy(hdr.strides, hdr.strides + rank, strides.begin());
+#else
+		(void) path; (void) mode; (void) offset;
+		throw std::runtime_error("MappedTensor needs mmap");
+#endif
+	}
+
+	MappedTensor(MappedTensor const&) = delete;
+	MappedTensor& operator=(MappedTensor const&) = delete;
+
+	MappedTensor(MappedTensor&& other) { swap(other); }
+
+	MappedTensor& operator=(MappedTensor&& other) {
+		MappedTensor tmp(std::move(other));
+		swap(tmp);
+		return *this;
+	}
+
+	~MappedTensor() {
+#ifdef MAPPED_TENSOR_HAVE_MMAP
+		if (map_base) munmap(map_base, map_len);
+#endif
+	}
+
+	void swap(MappedTensor& other) {
+		std::swap(data, other.data);
+		std::swap(rank, other.rank);
+		std::swap(dims, other.dims);
+		std::swap(strides, other.strides);
+		std::swap(map_base, other.map_base);
+		std::swap(map_len, other.map_len);
+		std::swap(region_offset, other.region_offset);
+	}
+
+	bool initialized() const {
+		return map_base != nullptr;
+	}
+
+	//Where the next region in the file would start
+	long next_offset() const {
+		return region_offset + (long) (map_len + MAPPED_TENSOR_ALIGN - 1) / MAPPED_TENSOR_ALIGN * MAPPED_TENSOR_ALIGN;
+	}
+
+	//Ask the kernel to start reading the whole thing in now rather than
+	//one page fault at a time
+	void prefetch() const {
+#if defined(MAPPED_TENSOR_HAVE_MMAP) && defined(MADV_WILLNEED)
+		if (map_base) madvise(map_base, map_len, MADV_WILLNEED);
+#endif
+	}
+
+	explicit operator RTSpan<T>() const {
+		assert(initialized());
+		return RTSpan<T>(data, rank, dims.data(), strides.data());
+	}
+
+	template <int span_rank>
+	TSpan<span_rank, T> as_tspan() const {
+		return TSpan<span_rank, T>(static_cast<RTSpan<T>>(*this));
+	}
+
+	//Copies the whole thing into an ordinary Tensor
+	Tensor<T> to_tensor() const {
+		return Tensor<T>(static_cast<RTSpan<T>>(*this));
+	}
+
+	//Throws unless hdr describes a T tensor that fits in avail bytes
+	static void check_header(mapped_tensor_header const& hdr, long avail, std::string const& path) {
+		std::string err;
+		if (std::memcmp(hdr.magic, mapped_tensor_magic(), sizeof(hdr.magic)) != 0) {
+			err = "not a tensor file";
+		} else if (hdr.version != MAPPED_TENSOR_VERSION) {
+			err = "unknown version " + std::to_string(hdr.version);
+		} else if (hdr.dtype != tensor_dtype<T>::code || hdr.elem_size != sizeof(T)) {
+			err = "element type mismatch";
+		} else if (hdr.rank < 1 || hdr.rank > TENSOR_MAX_RANK) {
+			err = "bad rank " + std::to_string(hdr.rank);
+		} else if (hdr.data_offset < sizeof(hdr) || hdr.data_offset % MAPPED_TENSOR_ALIGN) {
+			err = "bad data offset";
+		} else if (avail < 0 || hdr.data_offset > (uint64_t) avail
+		           || hdr.count > ((uint64_t) avail - hdr.data_offset) / sizeof(T)) {
+			//Divide rather than multiply, so a huge count can't wrap around
+			err = "file is truncated";
+		} else {
+			//The last element any index can reach has to be inside the data.
+			//Each term is under 2^62 and last stays under count, so this
+			//can't overflow either
+			uint64_t last = 0;
+			bool empty = false;
+			for (uint32_t i = 0; i < hdr.rank && err.empty(); i++) {
+				if (hdr.dims[i] < 0 || hdr.strides[i] < 0) err = "negative dims or strides";
+				else if (hdr.dims[i] == 0) empty = true;
+				else if ((last += (uint64_t) (hdr.dims[i] - 1) * hdr.strides[i]) >= hdr.count) last = hdr.count;
+			}
+			if (err.empty() && !empty && last >= hdr.count) err = "strides run past the data";
+		}
+		if (!err.empty()) throw std::runtime_error("Bad tensor file " + path + ": " + err);
+	}
+};
+
+#endif
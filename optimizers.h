@@ -24,11 +24,9 @@ struct GD : compiletime_rank_optimizer<rank> {
 	GD(float lr) : lr(lr) {}
 
 	Tensor<float> get_deltas(RTSpan<float> const& grad) override {
-		Tensor<float> ret(grad.dims, grad.rank);
+		Tensor<float> ret(grad.dims.data(), grad.rank);
 
-		tensorunary(grad.as_tspan<rank>(), ret.as_tspan<rank>(),
-			[=](float f) {return -lr*f;}
-		);
+		tensorscale(-lr, grad.as_tspan<rank>(), ret.as_tspan<rank>());
 
 		return ret;
 	}
@@ -70,29 +68,23 @@ struct Adam: compiletime_rank_optimizer<rank> {
 
         //m = beta1 * m + (1 - beta1) * grad_spn;
 		float one_minus_beta1 = 1 - beta1;
-        tensoreltwise(m_spn, grad_spn, m_spn, [=](float lhs, float rhs) {
-           return  beta1 * lhs + one_minus_beta1 * rhs;
-        });
+		tensoreval(beta1 * m_spn + one_minus_beta1 * grad_spn, m_spn);
 
         //v = beta2 * v + (1 - beta2) * (grad_spn * grad_spn);
 		float one_minus_beta2 = 1 - beta2;
-        tensoreltwise(v_spn, grad_spn, v_spn, [=](float lhs, float rhs) {
-           return beta2 * lhs + one_minus_beta2 * rhs * rhs;
-        });
+		tensoreval(beta2 * v_spn + one_minus_beta2 * grad_spn * grad_spn, v_spn);
         
         //m_hat = m / (1 - pow(beta1, t));
         //v_hat = v / (1 - pow(beta2, t));
 		//params = params - eta * m_hat / sqrt(v_hat) + eps;
-		Tensor<float> updates(grad.dims, rank);
+		Tensor<float> updates(grad.dims.data(), rank);
         
 		//updates = eta * m_hat / sqrt(v_hat) + eps;
 		float one_minus_beta1_to_the_t = 1 - beta1_to_the_t;
 		float one_minus_beta2_to_the_t = 1 - beta2_to_the_t;
-        tensoreltwise(m_spn, v_spn, updates.as_tspan<rank>(), [=](float lhs, float rhs) {
-            float m_hat = lhs / one_minus_beta1_to_the_t;
-            float v_hat = rhs / one_minus_beta2_to_the_t;
-            return -eta * m_hat / (sqrt(v_hat) + eps);
-        });
+		auto m_hat = m_spn / one_minus_beta1_to_the_t;
+		auto v_hat = v_spn / one_minus_beta2_to_the_t;
+		tensoreval(-eta * m_hat / (tensorsqrt(v_hat) + eps), updates.as_tspan<rank>());
 
 		return updates;
     }
@@ -0,0 +1,286 @@
+#ifndef QUANT_H
+#define QUANT_H 1
+
+//int8 inference for fully-connected layers. After training, the weights of
+//an fc get quantized per output channel (one scale per row of W), and its
+//inputs get quantized on the fly with one scale and zero point that was
+//picked by running a sample batch through the model (see quantize_layers
+//in layers.h). Then
+//
+//    y[b][o] = sum_i x[b][i] * W[o][i]
+//           ~= x_scale * w_scale[o] * sum_i (xq[b][i] - zp) * wq[o][i]
+//            = x_scale * w_scale[o] * (sum_i xq[b][i]*wq[o][i] - zp*row_sum[o])
+//
+//so the inner loop is an integer dot product of two byte arrays, which is
+//exactly what vpmaddubsw (AVX2) and vpdpbusd (AVX-VNNI) do 32 at a time.
+//The float scale, bias and activation are applied as each output comes out
+//of the integer kernel, so the int32 results never go back to memory.
+//
+//About the ranges: weights are symmetric int8 in [-127, 127], and inputs
+//are unsigned but only 7 bits ([0, 127]). vpmaddubsw adds pairs of
+//products into 16 bits with saturation, and 2*127*127 is the biggest pair
+//that can't saturate. That way every kernel (scalar, AVX2, VNNI) gives
+//bit-identical results.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "gemm.h" //GEMM_PARALLEL_MIN
+#include "simd.h"
+#include "thread_pool.h"
+
+//Rows of quantized data get padded with zeros to a multiple of this
+#define QUANT_KALIGN 64
+
+#define QUANT_X_MAX 127
+#define QUANT_W_MAX 127
+
+//How to turn a float input into a 7-bit unsigned one:
+//q = clamp(round(x / scale + zero_point), 0, QUANT_X_MAX)
+struct quant_params {
+	float scale = 1;
+	int zero_point = 0;
+};
+
+//Picks scale and zero point so [lo, hi] (stretched to include 0, so 0 is
+//exact) covers the whole quantized range
+inline quant_params quant_calibrate(float lo, float hi) {
+	lo = std::min(lo, 0.0f);
+	hi = std::max(hi, 0.0f);
+	quant_params ret;
+	if (hi - lo <= 0) return ret;
+	ret.scale = (hi - lo) / QUANT_X_MAX;
+	ret.zero_point = std::clamp(static_cast<int>(std::lround(-lo / ret.scale)), 0, QUANT_X_MAX);
+	return ret;
+}
+
+//Clamps before rounding (and rounds halves up), so there are no library
+//calls in the loop and the compiler can vectorize it
+inline void quantize_row(float const *x, int k, quant_params p, uint8_t *dst, int kp) {
+	float inv = 1.0f / p.scale;
+	float zp = static_cast<float>(p.zero_point);
+	for (int i = 0; i < k; i++) {
+		float v = std::min(std::max(x[i] * inv + zp, 0.0f), float(QUANT_X_MAX));
+		dst[i] = static_cast<uint8_t>(static_cast<int>(v + 0.5f));
+	}
+	std::fill(dst + k, dst + kp, uint8_t(0));
+}
+
+//W (n x k, any strides) quantized one row (output channel) at a time
+struct quant_weights {
+	int n = 0, k = 0;
+	int kp = 0; //Row stride of w: k rounded up to QUANT_KALIGN
+	std::vector<int8_t> w;
+	std::vector<float> scale;
+	std::vector<int32_t> row_sum; //For taking the input zero point back out
+
+	quant_weights() = default;
+
+	quant_weights(float const *W, int n, int k, int rs, int cs)
+		: n(n), k(k), kp((k + QUANT_KALIGN - 1) / QUANT_KALIGN * QUANT_KALIGN),
+		  w(static_cast<size_t>(n) * kp, 0), scale(n), row_sum(n)
+	{
+		for (int o = 0; o < n; o++) {
+			float mx = 0;
+			for (int i = 0; i < k; i++) mx = std::max(mx, std::fabs(W[(long) o*rs + (long) i*cs]));
+			scale[o] = (mx > 0) ? mx / QUANT_W_MAX : 1.0f;
+
+			int32_t sum = 0;
+			for (int i = 0; i < k; i++) {
+				int q = static_cast<int>(std::nearbyint(W[(long) o*rs + (long) i*cs] / scale[o]));
+				q = std::clamp(q, -QUANT_W_MAX, QUANT_W_MAX);
+				w[(size_t) o*kp + i] = static_cast<int8_t>(q);
+				sum += q;
+			}
+			row_sum[o] = sum;
+		}
+	}
+};
+
+///////////
+//KERNELS//
+///////////
+//out[r*ldo + o] = sum_i x[r*kp + i] * w[o*kp + i] for r in [0, mr) and o in
+//[0, n), where mr is 1 or 2. kp is a multiple of QUANT_KALIGN and all the
+//rows are zero-padded up to it.
+
+inline void quant_dot_rows_scalar(
+	uint8_t const *x, int mr, int8_t const *w, int n, int kp, int32_t *out, int ldo
+) {
+	for (int r = 0; r < mr; r++) {
+		uint8_t const *xr = x + (size_t) r*kp;
+		for (int o = 0; o < n; o++) {
+			int8_t const *row = w + (size_t) o*kp;
+			int32_t acc = 0;
+			for (int i = 0; i < kp; i++) acc += int32_t(xr[i]) * int32_t(row[i]);
+			out[(size_t) r*ldo + o] = acc;
+		}
+	}
+}
+
+#ifdef SIMD_HAVE_X86
+__attribute__((target("avx2")))
+inline int32_t quant_hsum_avx2(__m256i v) {
+	__m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+	return _mm_cvtsi128_si32(s);
+}
+
+//The AVX2 and VNNI kernels only differ in the multiply-accumulate step
+//(QUANT_STEP(acc, x, w)), so the loop is stamped out by this macro. Tiles
+//are 2 input rows x 4 weight rows (1 x 4 for a single input row), so there
+//are enough independent accumulators to hide the latency and every input
+//load gets reused.
+#define QUANT_KERNEL_BODY                                                              \
+	int o = 0;                                                                         \
+	if (mr == 2) {                                                                     \
+		uint8_t const *x1 = x + kp;                                                    \
+		for (; o + 4 <= n; o += 4) {                                                   \
+			int8_t const *r0 = w + (size_t) o*kp, *r1 = r0 + kp, *r2 = r1 + kp, *r3 = r2 + kp; \
+			__m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;           \
+			__m256i b0 = a0, b1 = a0, b2 = a0, b3 = a0;                                \
+			for (int i = 0; i < kp; i += 32) {                                         \
+				__m256i xv = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(x + i)); \
+				__m256i yv = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(x1 + i)); \
+				__m256i wv;                                                            \
+				wv = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(r0 + i));     \
+				QUANT_STEP(a0, xv, wv); QUANT_STEP(b0, yv, wv);                        \
+				wv = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(r1 + i));     \
+				QUANT_STEP(a1, xv, wv); QUANT_STEP(b1, yv, wv);                        \
+				wv = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(r2 + i));     \
+				QUANT_STEP(a2, xv, wv); QUANT_STEP(b2, yv, wv);                        \
+				wv = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(r3 + i));     \
+				QUANT_STEP(a3, xv, wv); QUANT_STEP(b3, yv, wv);                        \
+			}                                                                          \
+			out[o] = quant_hsum_avx2(a0);     out[ldo + o] = quant_hsum_avx2(b0);      \
+			out[o + 1] = quant_hsum_avx2(a1); out[ldo + o + 1] = quant_hsum_avx2(b1);  \
+			out[o + 2] = quant_hsum_avx2(a2); out[ldo + o + 2] = quant_hsum_avx2(b2);  \
+			out[o + 3] = quant_hsum_avx2(a3); out[ldo + o + 3] = quant_hsum_avx2(b3);  \
+		}                                                                              \
+	} else {                                                                           \
+		for (; o + 4 <= n; o += 4) {                                                   \
+			int8_t const *r0 = w + (size_t) o*kp, *r1 = r0 + kp, *r2 = r1 + kp, *r3 = r2 + kp; \
+			__m256i a0 = _mm256_setzero_si256(), a1 = a0, a2 = a0, a3 = a0;           \
+			for (int i = 0; i < kp; i += 32) {                                         \
+				__m256i xv = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(x + i)); \
+				QUANT_STEP(a0, xv, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(r0 + i))); \
+				QUANT_STEP(a1, xv, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(r1 + i))); \
+				QUANT_STEP(a2, xv, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(r2 + i))); \
+				QUANT_STEP(a3, xv, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(r3 + i))); \
+			}                                                                          \
+			out[o] = quant_hsum_avx2(a0);     out[o + 1] = quant_hsum_avx2(a1);        \
+			out[o + 2] = quant_hsum_avx2(a2); out[o + 3] = quant_hsum_avx2(a3);        \
+		}                                                                              \
+	}                                                                                  \
+	/*Leftover weight rows*/                                                          \
+	for (int r = 0; r < mr; r++) {                                                     \
+		uint8_t const *xr = x + (size_t) r*kp;                                         \
+		for (int oo = o; oo < n; oo++) {                                               \
+			int8_t const *r0 = w + (size_t) oo*kp;                                     \
+			__m256i a0 = _mm256_setzero_si256(), a1 = a0;                              \
+			int i = 0;                                                                 \
+			for (; i + 64 <= kp; i += 64) {                                            \
+				__m256i xv = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(xr + i)); \
+				__m256i yv = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(xr + i + 32)); \
+				QUANT_STEP(a0, xv, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(r0 + i))); \
+				QUANT_STEP(a1, yv, _mm256_loadu_si256(reinterpret_cast<__m256i const*>(r0 + i + 32))); \
+			}                                                                          \
+			out[(size_t) r*ldo + oo] = quant_hsum_avx2(_mm256_add_epi32(a0, a1));      \
+		}                                                                              \
+	}
+
+//u8 x s8 -> pairs summed into s16 (vpmaddubsw) -> pairs summed into s32
+//(vpmaddwd against ones)
+__attribute__((target("avx2")))
+inline void quant_dot_rows_avx2(
+	uint8_t const *x, int mr, int8_t const *w, int n, int kp, int32_t *out, int ldo
+) {
+	__m256i const ones = _mm256_set1_epi16(1);
+	#define QUANT_STEP(acc, xv, wv) \
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(xv, wv), ones))
+	QUANT_KERNEL_BODY
+	#undef QUANT_STEP
+}
+
+//vpdpbusd does the multiply, both pairwise sums and the accumulate in one
+//instruction
+__attribute__((target("avx2,avxvnni")))
+inline void quant_dot_rows_vnni(
+	uint8_t const *x, int mr, int8_t const *w, int n, int kp, int32_t *out, int ldo
+) {
+	#define QUANT_STEP(acc, xv, wv) acc = _mm256_dpbusd_avx_epi32(acc, xv, wv)
+	QUANT_KERNEL_BODY
+	#undef QUANT_STEP
+}
+
+#undef QUANT_KERNEL_BODY
+
+inline bool quant_have_vnni() {
+	static bool const ret = [] {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avxvnni") != 0;
+	}();
+	return ret;
+}
+#endif
+
+using quant_dot_rows_t = void (*)(uint8_t const*, int, int8_t const*, int, int, int32_t*, int);
+
+//Follows simd() (so TENSORCOPTER_SIMD / set_simd_level turn it down too)
+inline quant_dot_rows_t quant_pick_kernel() {
+#ifdef SIMD_HAVE_X86
+	if (simd().level >= simd_level::avx2) {
+		return quant_have_vnni() ? quant_dot_rows_vnni : quant_dot_rows_avx2;
+	}
+#endif
+	return quant_dot_rows_scalar;
+}
+
+//Output channels per task, so each one's slice of the weights stays in
+//cache while it's reused across the batch
+#ifndef QUANT_NC
+#define QUANT_NC 64
+#endif
+
+//The whole thing: for each row b of x (m rows of k floats, row stride ldx)
+//and each output o, calls epilogue(b, o, acc) with the int32 dot product of
+//the quantized row and weight row o. The epilogue is where the scales,
+//bias and activation go (it's called exactly once per output, possibly
+//from several threads at once).
+template <typename fn>
+void quant_fc(float const *x, int m, int ldx, quant_params xp, quant_weights const& W, fn epilogue) {
+	if (m <= 0 || W.n <= 0) return;
+	quant_dot_rows_t kernel = quant_pick_kernel();
+
+	//Quantize all the inputs up front, since every output block needs them
+	static thread_local std::vector<uint8_t> xq;
+	if (xq.size() < (size_t) m * W.kp) xq.resize((size_t) m * W.kp);
+	for (int b = 0; b < m; b++) quantize_row(x + (long) b*ldx, W.k, xp, xq.data() + (size_t) b*W.kp, W.kp);
+	uint8_t const *xq_data = xq.data();
+
+	int blocks = (W.n + QUANT_NC - 1) / QUANT_NC;
+	auto task = [&](int t) {
+		int o0 = t * QUANT_NC;
+		int nb = std::min(QUANT_NC, W.n - o0);
+		int32_t acc[2][QUANT_NC];
+		for (int b = 0; b < m; b += 2) {
+			int mr = std::min(2, m - b);
+			kernel(xq_data + (size_t) b*W.kp, mr, W.w.data() + (size_t) o0*W.kp, nb, W.kp, acc[0], QUANT_NC);
+			for (int r = 0; r < mr; r++) {
+				for (int j = 0; j < nb; j++) epilogue(b + r, o0 + j, acc[r][j]);
+			}
+		}
+	};
+
+	if (static_cast<double>(m) * W.n * W.k >= GEMM_PARALLEL_MIN) {
+		parallel_for(0, blocks, task);
+	} else {
+		for (int t = 0; t < blocks; t++) task(t);
+	}
+}
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef REDUCE_H
+#define REDUCE_H 1
+
+//Reductions along one axis (or over everything), on raw pointers plus
+//dims/strides. tensorreduce() in tensor.h is the friendly front end.
+//
+//How we walk memory depends on where the unit stride is:
+//
+//  - Reducing along a unit-stride axis (e.g. max of each row of a row-major
+//    matrix): each output is one contiguous line, so it goes straight to
+//    the horizontal SIMD kernels (simd().sum / simd().max).
+//
+//  - Reducing along a strided axis when some other axis is unit-stride
+//    (e.g. summing the rows of a matrix to get one row): walking each
+//    output's line would jump a whole row per element. Instead we run down
+//    the reduced axis a row at a time and accumulate whole rows with the
+//    vertical SIMD kernels (simd().add / simd().vmax), a block of columns
+//    at a time so the accumulator stays in L1.
+//
+//  - Anything else: plain strided loops.
+//
+//All the non-reduced axes go through collapse_layout first (see layout.h)
+//so dense outer dimensions turn into one loop.
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+
+#include "layout.h"
+#include "simd.h"
+
+enum class reduce_op {
+	sum,
+	max,
+	mean,
+	argmax //First index of the max. Written out as a number
+};
+
+//Columns per block in the vertical path
+#ifndef REDUCE_BLOCK
+#define REDUCE_BLOCK 256
+#endif
+
+template <typename T>
+T reduce_lowest() {
+	if constexpr (std::numeric_limits<T>::has_infinity) return -std::numeric_limits<T>::infinity();
+	else return std::numeric_limits<T>::lowest();
+}
+
+//Reduce n elements starting at x, stride s. For argmax this returns the
+//index.
+template <typename T>
+T reduce_line(reduce_op op, T const *x, int n, int s) {
+	if (op == reduce_op::argmax) {
+		int best = 0;
+		for (int i = 1; i < n; i++) if (x[(long) i*s] > x[(long) best*s]) best = i;
+		return T(best);
+	}
+
+	if constexpr (std::is_same<T, float>::value) {
+		if (s == 1) {
+			if (op == reduce_op::max) return simd().max(x, n);
+			float ret = simd().sum(x, n);
+			return (op == reduce_op::mean) ? ret / n : ret;
+		}
+	}
+
+	T ret = (op == reduce_op::max) ? reduce_lowest<T>() : T();
+	for (int i = 0; i < n; i++) {
+		T v = x[(long) i*s];
+		if (op == reduce_op::max) ret = (v > ret) ? v : ret;
+		else ret += v;
+	}
+	return (op == reduce_op::mean) ? ret / n : ret;
+}
+
+//m unit-stride columns, n rows s apart. dst[j*ds] = reduction of column j.
+template <typename T, typename U>
+void reduce_columns(reduce_op op, T const *x, int m, int n, long s, U *dst, int ds) {
+	T acc[REDUCE_BLOCK];
+	int idx[REDUCE_BLOCK];
+
+	for (int j0 = 0; j0 < m; j0 += REDUCE_BLOCK) {
+		int w = std::min(REDUCE_BLOCK, m - j0);
+		T const *col = x + j0;
+
+		std::copy(col, col + w, acc);
+		if (op == reduce_op::argmax) std::fill(idx, idx + w, 0);
+
+		for (int i = 1; i < n; i++) {
+			T const *row = col + i*s;
+			if (op == reduce_op::argmax) {
+				for (int j = 0; j < w; j++) {
+					if (row[j] > acc[j]) {
+						acc[j] = row[j];
+						idx[j] = i;
+					}
+				}
+				continue;
+			}
+
+			if constexpr (std::is_same<T, float>::value) {
+				if (op == reduce_op::max) simd().vmax(acc, row, acc, w);
+				else simd().add(acc, row, acc, w);
+			} else {
+				for (int j = 0; j < w; j++) {
+					if (op == reduce_op::max) acc[j] = (row[j] > acc[j]) ? row[j] : acc[j];
+					else acc[j] += row[j];
+				}
+			}
+		}
+
+		U *out = dst + (long) j0*ds;
+		for (int j = 0; j < w; j++) {
+			switch (op) {
+			case reduce_op::argmax: out[j*ds] = U(idx[j]); break;
+			case reduce_op::mean:   out[j*ds] = U(acc[j] / n); break;
+			default:                out[j*ds] = U(acc[j]); break;
+			}
+		}
+	}
+}
+
+template <typename T, typename U>
+void reduce_outer(
+	reduce_op op, flat_layout<2> const& L, int d,
+	T const *src, U *dst, int n, int s, bool vertical
+) {
+	int m = L.dims[d];
+	int ss = L.strides[0][d], ds = L.strides[1][d];
+	if (d < L.rank - 1) {
+		for (int i = 0; i < m; i++) reduce_outer(op, L, d + 1, src + (long) i*ss, dst + (long) i*ds, n, s, vertical);
+		return;
+	}
+
+	if (vertical) {
+		reduce_columns(op, src, m, n, s, dst, ds);
+	} else {
+		for (int i = 0; i < m; i++) dst[(long) i*ds] = U(reduce_line(op, src + (long) i*ss, n, s));
+	}
+}
+
+//Reduce src along axis into dst. dst_strides has one entry per src
+//dimension; the one at axis is ignored. Returns false if rank is too big.
+template <typename T, typename U>
+bool reduce_axis(
+	reduce_op op, int rank, int const *dims,
+	T const *src, int const *src_strides, int axis,
+	U *dst, int const *dst_strides
+) {
+	if (rank > TENSOR_MAX_RANK) return false;
+	assert(axis >= 0 && axis < rank);
+	int n = dims[axis];
+	int s = src_strides[axis];
+	assert(n > 0 || op == reduce_op::sum);
+
+	//The other axes, in order
+	int odims[TENSOR_MAX_RANK], osrc[TENSOR_MAX_RANK], odst[TENSOR_MAX_RANK];
+	int orank = 0;
+	for (int i = 0; i < rank; i++) {
+		if (i == axis) continue;
+		odims[orank] = dims[i];
+		osrc[orank] = src_strides[i];
+		odst[orank] = dst_strides[i];
+		orank++;
+	}
+
+	int const *strides[2] = {osrc, odst};
+	flat_layout<2> L;
+	collapse_layout(orank, odims, strides, L);
+
+	if (n == 0) {
+		//Empty sum
+		auto zero = [](U) { return U(); };
+		flat_unary(L, 0, dst, dst, zero);
+		return true;
+	}
+
+	int last = L.rank - 1;
+	bool vertical = (s != 1) && (L.strides[0][last] == 1) && (L.dims[last] > 1);
+	reduce_outer(op, L, 0, src, dst, n, s, vertical);
+	return true;
+}
+
+//Reduce everything down to one value. argmax gives the row-major index.
+template <typename T>
+T reduce_all(reduce_op op, int rank, int const *dims, T const *src, int const *src_strides) {
+	int const *strides[2] = {src_strides, src_strides};
+	flat_layout<2> L;
+	if (!collapse_layout(rank, dims, strides, L)) {
+		throw std::runtime_error("Rank too big for reduce_all");
+	}
+
+	//Walk the collapsed layout a line at a time, combining as we go
+	long count = 1;
+	for (int i = 0; i < L.rank; i++) count *= L.dims[i];
+
+	T acc = (op == reduce_op::sum || op == reduce_op::mean) ? T() : reduce_lowest<T>();
+	long best = 0;
+	long seen = 0;
+
+	int last = L.rank - 1;
+	int n = L.dims[last], s = L.strides[0][last];
+	long lines = count / std::max(n, 1);
+	int pos[TENSOR_MAX_RANK] = {0};
+	for (long line = 0; line < lines; line++) {
+		T const *p = src;
+		for (int d = 0; d < last; d++) p += (long) pos[d] * L.strides[0][d];
+
+		if (op == reduce_op::argmax) {
+			long i = (long) reduce_line(reduce_op::argmax, p, n, s);
+			if (p[i*s] > acc) {
+				acc = p[i*s];
+				best = seen + i;
+			}
+		} else if (op == reduce_op::max) {
+			T v = reduce_line(reduce_op::max, p, n, s);
+			acc = (v > acc) ? v : acc;
+		} else {
+			acc += reduce_line(reduce_op::sum, p, n, s);
+		}
+		seen += n;
+
+		//Next line (odometer over the outer dims)
+		for (int d = last - 1; d >= 0; d--) {
+			if (++pos[d] < L.dims[d]) break;
+			pos[d] = 0;
+		}
+	}
+
+	if (op == reduce_op::argmax) return T(best);
+	if (op == reduce_op::mean) return acc / count;
+	return acc;
+}
+
+//Sum of F(lhs, rhs) over every element, in one pass and without
+//materializing F's results (e.g. squared error). lhs and rhs have the same
+//dims. Unit-stride lines keep 8 partial sums so the loop vectorizes.
+template <typename T, typename fn>
+T reduce_all_binary(
+	int rank, int const *dims,
+	T const *lhs, int const *lhs_strides,
+	T const *rhs, int const *rhs_strides,
+	fn F
+) {
+	int const *strides[2] = {lhs_strides, rhs_strides};
+	flat_layout<2> L;
+	if (!collapse_layout(rank, dims, strides, L)) {
+		throw std::runtime_error("Rank too big for reduce_all_binary");
+	}
+
+	long count = 1;
+	for (int i = 0; i < L.rank; i++) count *= L.dims[i];
+
+	int last = L.rank - 1;
+	int n = L.dims[last], ls = L.strides[0][last], rs = L.strides[1][last];
+	long lines = count / std::max(n, 1);
+	int pos[TENSOR_MAX_RANK] = {0};
+	T acc = T();
+	for (long line = 0; line < lines; line++) {
+		T const *l = lhs, *r = rhs;
+		for (int d = 0; d < last; d++) {
+			l += (long) pos[d] * L.strides[0][d];
+			r += (long) pos[d] * L.strides[1][d];
+		}
+
+		int i = 0;
+		if (ls == 1 && rs == 1) {
+			T part[8] = {};
+			for (; i + 8 <= n; i += 8) {
+				for (int j = 0; j < 8; j++) part[j] += F(l[i + j], r[i + j]);
+			}
+			for (int j = 0; j < 8; j++) acc += part[j];
+		}
+		for (; i < n; i++) acc += F(l[(long) i*ls], r[(long) i*rs]);
+
+		for (int d = last - 1; d >= 0; d--) {
+			if (++pos[d] < L.dims[d]) break;
+			pos[d] = 0;
+		}
+	}
+	return acc;
+}
+
+#endif
@@ -0,0 +1,544 @@
+#ifndef SIMD_H
+#define SIMD_H 1
+
+//Runtime-dispatched SIMD kernels for the elementwise tensor ops. We build
+//with the baseline instruction set (no -march), so the wider kernels are
+//compiled with target attributes and the best one the CPU supports gets
+//picked once, the first time anyone asks for it. That way one binary runs
+//well everywhere.
+//
+//All kernels here work on contiguous float arrays. The strided cases stay
+//in tensor.h.
+
+#include <cmath> //HUGE_VALF
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <functional> //std::plus, std::multiplies
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_HAVE_X86 1
+#endif
+
+enum class simd_level {
+	scalar,
+	sse2,
+	avx2,   //AVX2 + FMA
+	avx512  //AVX-512F
+};
+
+inline char const* simd_level_name(simd_level l) {
+	switch (l) {
+	case simd_level::sse2:   return "sse2";
+	case simd_level::avx2:   return "avx2";
+	case simd_level::avx512: return "avx512";
+	default:                 return "scalar";
+	}
+}
+
+//What the hardware supports (via cpuid)
+inline simd_level detect_simd_level() {
+#ifdef SIMD_HAVE_X86
+	static simd_level const lvl = [] {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f")) return simd_level::avx512;
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return simd_level::avx2;
+		if (__builtin_cpu_supports("sse2")) return simd_level::sse2;
+		return simd_level::scalar;
+	}();
+	return lvl;
+#else
+	return simd_level::scalar;
+#endif
+}
+
+////////////////////
+//SCALAR FALLBACKS//
+////////////////////
+
+inline void simd_add_scalar(float const *a, float const *b, float *dst, size_t n) {
+	for (size_t i = 0; i < n; i++) dst[i] = a[i] + b[i];
+}
+
+inline void simd_mul_scalar(float const *a, float const *b, float *dst, size_t n) {
+	for (size_t i = 0; i < n; i++) dst[i] = a[i] * b[i];
+}
+
+//y += alpha*x
+inline void simd_axpy_scalar(float alpha, float const *x, float *y, size_t n) {
+	for (size_t i = 0; i < n; i++) y[i] += alpha * x[i];
+}
+
+//dst = alpha*x
+inline void simd_scale_scalar(float alpha, float const *x, float *dst, size_t n) {
+	for (size_t i = 0; i < n; i++) dst[i] = alpha * x[i];
+}
+
+//Horizontal reductions. max of an empty array is -inf.
+inline float simd_sum_scalar(float const *x, size_t n) {
+	float ret = 0;
+	for (size_t i = 0; i < n; i++) ret += x[i];
+	return ret;
+}
+
+inline float simd_max_scalar(float const *x, size_t n) {
+	float ret = -HUGE_VALF;
+	for (size_t i = 0; i < n; i++) ret = (x[i] > ret) ? x[i] : ret;
+	return ret;
+}
+
+//dst = max(a, b) elementwise
+inline void simd_vmax_scalar(float const *a, float const *b, float *dst, size_t n) {
+	for (size_t i = 0; i < n; i++) dst[i] = (b[i] > a[i]) ? b[i] : a[i];
+}
+
+#ifdef SIMD_HAVE_X86
+
+////////
+//SSE2//
+////////
+
+__attribute__((target("sse2")))
+inline void simd_add_sse2(float const *a, float const *b, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+	for (; i < n; i++) dst[i] = a[i] + b[i];
+}
+
+__attribute__((target("sse2")))
+inline void simd_mul_sse2(float const *a, float const *b, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+	for (; i < n; i++) dst[i] = a[i] * b[i];
+}
+
+__attribute__((target("sse2")))
+inline void simd_axpy_sse2(float alpha, float const *x, float *y, size_t n) {
+	__m128 va = _mm_set1_ps(alpha);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(va, _mm_loadu_ps(x + i))));
+	for (; i < n; i++) y[i] += alpha * x[i];
+}
+
+__attribute__((target("sse2")))
+inline void simd_scale_sse2(float alpha, float const *x, float *dst, size_t n) {
+	__m128 va = _mm_set1_ps(alpha);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(dst + i, _mm_mul_ps(va, _mm_loadu_ps(x + i)));
+	for (; i < n; i++) dst[i] = alpha * x[i];
+}
+
+__attribute__((target("sse2")))
+inline float simd_hsum_sse2(__m128 v) {
+	v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+	return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2")))
+inline float simd_hmax_sse2(__m128 v) {
+	v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+	v = _mm_max_ss(v, _mm_shuffle_ps(v, v, 1));
+	return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2")))
+inline float simd_sum_sse2(float const *x, size_t n) {
+	__m128 acc = _mm_setzero_ps();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) acc = _mm_add_ps(acc, _mm_loadu_ps(x + i));
+	float ret = simd_hsum_sse2(acc);
+	for (; i < n; i++) ret += x[i];
+	return ret;
+}
+
+__attribute__((target("sse2")))
+inline float simd_max_sse2(float const *x, size_t n) {
+	__m128 acc = _mm_set1_ps(-HUGE_VALF);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) acc = _mm_max_ps(acc, _mm_loadu_ps(x + i));
+	float ret = simd_hmax_sse2(acc);
+	for (; i < n; i++) ret = (x[i] > ret) ? x[i] : ret;
+	return ret;
+}
+
+__attribute__((target("sse2")))
+inline void simd_vmax_sse2(float const *a, float const *b, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(dst + i, _mm_max_ps(_mm_loadu_ps(b + i), _mm_loadu_ps(a + i)));
+	for (; i < n; i++) dst[i] = (b[i] > a[i]) ? b[i] : a[i];
+}
+
+////////
+//AVX2//
+////////
+
+__attribute__((target("avx2,fma")))
+inline void simd_add_avx2(float const *a, float const *b, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+	for (; i < n; i++) dst[i] = a[i] + b[i];
+}
+
+__attribute__((target("avx2,fma")))
+inline void simd_mul_avx2(float const *a, float const *b, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+	for (; i < n; i++) dst[i] = a[i] * b[i];
+}
+
+__attribute__((target("avx2,fma")))
+inline void simd_axpy_avx2(float alpha, float const *x, float *y, size_t n) {
+	__m256 va = _mm256_set1_ps(alpha);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+	for (; i < n; i++) y[i] += alpha * x[i];
+}
+
+__attribute__((target("avx2,fma")))
+inline void simd_scale_avx2(float alpha, float const *x, float *dst, size_t n) {
+	__m256 va = _mm256_set1_ps(alpha);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(va, _mm256_loadu_ps(x + i)));
+	for (; i < n; i++) dst[i] = alpha * x[i];
+}
+
+//Two accumulators to hide the add latency
+__attribute__((target("avx2,fma")))
+inline float simd_sum_avx2(float const *x, size_t n) {
+	__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(x + i));
+		acc1 = _mm256_add_ps(acc1, _mm256_loadu_ps(x + i + 8));
+	}
+	if (i + 8 <= n) {
+		acc0 = _mm256_add_ps(acc0, _mm256_loadu_ps(x + i));
+		i += 8;
+	}
+	__m256 acc = _mm256_add_ps(acc0, acc1);
+	float ret = simd_hsum_sse2(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+	for (; i < n; i++) ret += x[i];
+	return ret;
+}
+
+__attribute__((target("avx2,fma")))
+inline float simd_max_avx2(float const *x, size_t n) {
+	__m256 acc = _mm256_set1_ps(-HUGE_VALF);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) acc = _mm256_max_ps(acc, _mm256_loadu_ps(x + i));
+	float ret = simd_hmax_sse2(_mm_max_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+	for (; i < n; i++) ret = (x[i] > ret) ? x[i] : ret;
+	return ret;
+}
+
+__attribute__((target("avx2,fma")))
+inline void simd_vmax_avx2(float const *a, float const *b, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_max_ps(_mm256_loadu_ps(b + i), _mm256_loadu_ps(a + i)));
+	for (; i < n; i++) dst[i] = (b[i] > a[i]) ? b[i] : a[i];
+}
+
+///////////
+//AVX-512//
+///////////
+//Tails are done with a mask instead of a scalar loop
+
+__attribute__((target("avx512f")))
+inline void simd_add_avx512(float const *a, float const *b, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+		_mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+	if (i < n) {
+		__mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+		_mm512_mask_storeu_ps(dst + i, m,
+			_mm512_add_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i)));
+	}
+}
+
+__attribute__((target("avx512f")))
+inline void simd_mul_avx512(float const *a, float const *b, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+		_mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+	if (i < n) {
+		__mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+		_mm512_mask_storeu_ps(dst + i, m,
+			_mm512_mul_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i)));
+	}
+}
+
+__attribute__((target("avx512f")))
+inline void simd_axpy_avx512(float alpha, float const *x, float *y, size_t n) {
+	__m512 va = _mm512_set1_ps(alpha);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+		_mm512_storeu_ps(y + i, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+	if (i < n) {
+		__mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+		_mm512_mask_storeu_ps(y + i, m,
+			_mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i)));
+	}
+}
+
+__attribute__((target("avx512f")))
+inline void simd_scale_avx512(float alpha, float const *x, float *dst, size_t n) {
+	__m512 va = _mm512_set1_ps(alpha);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+		_mm512_storeu_ps(dst + i, _mm512_mul_ps(va, _mm512_loadu_ps(x + i)));
+	if (i < n) {
+		__mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+		_mm512_mask_storeu_ps(dst + i, m, _mm512_mul_ps(va, _mm512_maskz_loadu_ps(m, x + i)));
+	}
+}
+
+//GCC 12's unmasked _mm512_max_ps, _mm512_extractf64x4_pd,
+//_mm512_castps512_ps256 and _mm512_reduce_*_ps all trip -Wuninitialized
+//inside its own headers, so these use the masked forms with an explicit
+//source instead.
+__attribute__((target("avx512f")))
+inline __m512 simd_max512(__m512 a, __m512 b) {
+	return _mm512_mask_max_ps(a, (__mmask16) 0xFFFF, a, b);
+}
+
+__attribute__((target("avx512f")))
+inline __m128 simd_fold_avx512(__m512 v, bool is_max) {
+	__m512d vd = _mm512_castps_pd(v);
+	__m256 lo = _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xF, vd, 0));
+	__m256 hi = _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xF, vd, 1));
+	__m256 v8 = is_max ? _mm256_max_ps(lo, hi) : _mm256_add_ps(lo, hi);
+	__m128 l4 = _mm256_castps256_ps128(v8), h4 = _mm256_extractf128_ps(v8, 1);
+	return is_max ? _mm_max_ps(l4, h4) : _mm_add_ps(l4, h4);
+}
+
+__attribute__((target("avx512f")))
+inline float simd_sum_avx512(float const *x, size_t n) {
+	__m512 acc = _mm512_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) acc = _mm512_add_ps(acc, _mm512_loadu_ps(x + i));
+	if (i < n) {
+		__mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+		acc = _mm512_add_ps(acc, _mm512_maskz_loadu_ps(m, x + i));
+	}
+	return simd_hsum_sse2(simd_fold_avx512(acc, false));
+}
+
+__attribute__((target("avx512f")))
+inline float simd_max_avx512(float const *x, size_t n) {
+	__m512 acc = _mm512_set1_ps(-HUGE_VALF);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) acc = simd_max512(acc, _mm512_loadu_ps(x + i));
+	if (i < n) {
+		__mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+		acc = simd_max512(acc, _mm512_mask_loadu_ps(acc, m, x + i));
+	}
+	return simd_hmax_sse2(simd_fold_avx512(acc, true));
+}
+
+__attribute__((target("avx512f")))
+inline void simd_vmax_avx512(float const *a, float const *b, float *dst, size_t n) {
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+		_mm512_storeu_ps(dst + i, simd_max512(_mm512_loadu_ps(b + i), _mm512_loadu_ps(a + i)));
+	if (i < n) {
+		__mmask16 m = (__mmask16) ((1u << (n - i)) - 1);
+		_mm512_mask_storeu_ps(dst + i, m,
+			simd_max512(_mm512_maskz_loadu_ps(m, b + i), _mm512_maskz_loadu_ps(m, a + i)));
+	}
+}
+
+#endif //SIMD_HAVE_X86
+
+//////////////////
+//DISPATCH TABLE//
+//////////////////
+
+struct simd_kernels {
+	simd_level level;
+	void (*add)(float const*, float const*, float*, size_t);
+	void (*mul)(float const*, float const*, float*, size_t);
+	void (*axpy)(float, float const*, float*, size_t);
+	void (*scale)(float, float const*, float*, size_t);
+	float (*sum)(float const*, size_t);
+	float (*max)(float const*, size_t);
+	void (*vmax)(float const*, float const*, float*, size_t);
+};
+
+inline simd_kernels make_simd_kernels(simd_level l) {
+#ifdef SIMD_HAVE_X86
+	switch (l) {
+	case simd_level::avx512:
+		return {l, simd_add_avx512, simd_mul_avx512, simd_axpy_avx512, simd_scale_avx512,
+		        simd_sum_avx512, simd_max_avx512, simd_vmax_avx512};
+	case simd_level::avx2:
+		return {l, simd_add_avx2, simd_mul_avx2, simd_axpy_avx2, simd_scale_avx2,
+		        simd_sum_avx2, simd_max_avx2, simd_vmax_avx2};
+	case simd_level::sse2:
+		return {l, simd_add_sse2, simd_mul_sse2, simd_axpy_sse2, simd_scale_sse2,
+		        simd_sum_sse2, simd_max_sse2, simd_vmax_sse2};
+	default:
+		break;
+	}
+#endif
+	return {simd_level::scalar, simd_add_scalar, simd_mul_scalar, simd_axpy_scalar, simd_scale_scalar,
+	        simd_sum_scalar, simd_max_scalar, simd_vmax_scalar};
+}
+
+//The TENSORCOPTER_SIMD environment variable (scalar, sse2, avx2, avx512)
+//can be used to ask for a lower level than what the CPU supports. Asking
+//for more than the CPU has just gets you the CPU's level.
+inline simd_level initial_simd_level() {
+	simd_level hw = detect_simd_level();
+	char const *env = std::getenv("TENSORCOPTER_SIMD");
+	if (!env) return hw;
+
+	simd_level want = hw;
+	if (!std::strcmp(env, "scalar")) want = simd_level::scalar;
+	else if (!std::strcmp(env, "sse2")) want = simd_level::sse2;
+	else if (!std::strcmp(env, "avx2")) want = simd_level::avx2;
+	else if (!std::strcmp(env, "avx512")) want = simd_level::avx512;
+	return (want < hw) ? want : hw;
+}
+
+inline simd_kernels& simd_table() {
+	static simd_kernels table = make_simd_kernels(initial_simd_level());
+	return table;
+}
+
+inline simd_kernels const& simd() {
+	return simd_table();
+}
+
+//Mostly for testing: lets you force a lower level. Not thread-safe; call
+//it before kicking off any work.
+inline void set_simd_level(simd_level l) {
+	simd_level hw = detect_simd_level();
+	simd_table() = make_simd_kernels((l < hw) ? l : hw);
+}
+
+///////////////////
+//FUSED FUNCTIONS//
+///////////////////
+//For arbitrary lambdas we can't hand-write intrinsics, but if we stamp out
+//the loop once per target the compiler will happily inline the lambda and
+//vectorize the whole thing for that ISA. The lambda itself is compiled for
+//the baseline, so inlining it into a wider target is allowed.
+
+template <typename fn>
+void simd_map1_base(float const *x, float *dst, size_t n, fn& F) {
+	for (size_t i = 0; i < n; i++) dst[i] = F(x[i]);
+}
+
+template <typename fn>
+void simd_map2_base(float const *a, float const *b, float *dst, size_t n, fn& F) {
+	for (size_t i = 0; i < n; i++) dst[i] = F(a[i], b[i]);
+}
+
+#ifdef SIMD_HAVE_X86
+template <typename fn>
+__attribute__((target("avx2,fma")))
+void simd_map1_avx2(float const *x, float *dst, size_t n, fn& F) {
+	for (size_t i = 0; i < n; i++) dst[i] = F(x[i]);
+}
+
+template <typename fn>
+__attribute__((target("avx2,fma")))
+void simd_map2_avx2(float const *a, float const *b, float *dst, size_t n, fn& F) {
+	for (size_t i = 0; i < n; i++) dst[i] = F(a[i], b[i]);
+}
+
+template <typename fn>
+__attribute__((target("avx512f")))
+void simd_map1_avx512(float const *x, float *dst, size_t n, fn& F) {
+	for (size_t i = 0; i < n; i++) dst[i] = F(x[i]);
+}
+
+template <typename fn>
+__attribute__((target("avx512f")))
+void simd_map2_avx512(float const *a, float const *b, float *dst, size_t n, fn& F) {
+	for (size_t i = 0; i < n; i++) dst[i] = F(a[i], b[i]);
+}
+#endif
+
+//dst[i] = F(x[i]). dst may alias x.
+template <typename fn>
+void simd_map(float const *x, float *dst, size_t n, fn F) {
+#ifdef SIMD_HAVE_X86
+	switch (simd().level) {
+	case simd_level::avx512: simd_map1_avx512(x, dst, n, F); return;
+	case simd_level::avx2:   simd_map1_avx2(x, dst, n, F); return;
+	default: break;
+	}
+#endif
+	simd_map1_base(x, dst, n, F);
+}
+
+//Picks a hand-written kernel when F is one we know about, otherwise the
+//fused loop. dst may alias a or b.
+template <typename fn>
+void simd_map(float const *a, float const *b, float *dst, size_t n, fn F) {
+#ifdef SIMD_HAVE_X86
+	switch (simd().level) {
+	case simd_level::avx512: simd_map2_avx512(a, b, dst, n, F); return;
+	case simd_level::avx2:   simd_map2_avx2(a, b, dst, n, F); return;
+	default: break;
+	}
+#endif
+	simd_map2_base(a, b, dst, n, F);
+}
+
+//dst[i] = G(i). This is what the expression templates in tensor_expr.h
+//bottom out in: G reads however many operands it needs at index i, so the
+//whole expression becomes one vectorized loop.
+template <typename gen>
+void simd_generate_base(float *dst, size_t n, gen& G) {
+	for (size_t i = 0; i < n; i++) dst[i] = G(i);
+}
+
+#ifdef SIMD_HAVE_X86
+template <typename gen>
+__attribute__((target("avx2,fma")))
+void simd_generate_avx2(float *dst, size_t n, gen& G) {
+	for (size_t i = 0; i < n; i++) dst[i] = G(i);
+}
+
+template <typename gen>
+__attribute__((target("avx512f")))
+void simd_generate_avx512(float *dst, size_t n, gen& G) {
+	for (size_t i = 0; i < n; i++) dst[i] = G(i);
+}
+#endif
+
+template <typename gen>
+void simd_generate(float *dst, size_t n, gen G) {
+#ifdef SIMD_HAVE_X86
+	switch (simd().level) {
+	case simd_level::avx512: simd_generate_avx512(dst, n, G); return;
+	case simd_level::avx2:   simd_generate_avx2(dst, n, G); return;
+	default: break;
+	}
+#endif
+	simd_generate_base(dst, n, G);
+}
+
+inline void simd_map(float const *a, float const *b, float *dst, size_t n, std::plus<float>) {
+	simd().add(a, b, dst, n);
+}
+
+inline void simd_map(float const *a, float const *b, float *dst, size_t n, std::multiplies<float>) {
+	simd().mul(a, b, dst, n);
+}
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef SPARSE_H
+#define SPARSE_H 1
+
+//Compressed sparse row (CSR) matrices, for inputs that are mostly zeros.
+//An MNIST image is ~80% exact zeros, so in the first fc layer most of the
+//multiply-adds in x * W^T (and in the dErr/dW = dy^T * x on the way back)
+//are multiplying by zero. With x in CSR form we only touch the nonzeros:
+//
+//    csr_gemm:     C = alpha * A * B + beta * C      (A sparse, B dense)
+//    csr_gemm_tn:  C = alpha * A^T * D + beta * C    (A sparse, D dense)
+//
+//Each row of C is a weighted sum of the rows of the dense operand picked
+//out by the nonzeros in one row of A (csr_gemm_tn transposes A first, which
+//is cheap in CSR), so the work is nnz * n instead of rows * cols * n. The
+//row kernel keeps a 64-column strip of C in registers while it runs through
+//the nonzeros. The dense operand has to have unit-stride rows for that; if
+//it doesn't (e.g. W^T, which is what fc actually multiplies by) it gets
+//copied into a dense scratch buffer first, which costs cols * n but is
+//cheap next to the GEMM it replaces.
+//
+//fc (layers.h) converts its input on its own when at most
+//SPARSE_MAX_DENSITY of it is nonzero, or you can hand it a csr_matrix.
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "gemm.h" //gemm_scale_c, GEMM_PARALLEL_MIN
+#include "layout.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+//Inputs with at most this fraction of nonzeros take the sparse path
+#ifndef SPARSE_MAX_DENSITY
+#define SPARSE_MAX_DENSITY 0.3
+#endif
+
+//Writes the nonzeros of x[0, k) (stride s) and their indices to val and col,
+//and returns how many there were. Every element gets written and the write
+//position only moves on past nonzeros, so there's no branch in the loop.
+inline int csr_compress_row_scalar(float const *x, int k, int s, int *col, float *val) {
+	int p = 0;
+	for (int i = 0; i < k; i++) {
+		float v = x[(long) i*s];
+		col[p] = i;
+		val[p] = v;
+		p += (v != 0);
+	}
+	return p;
+}
+
+#ifdef SIMD_HAVE_X86
+//vcompressps does exactly this 16 at a time
+__attribute__((target("avx512f")))
+inline int csr_compress_row_avx512(float const *x, int k, int *col, float *val) {
+	__m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m512i const step = _mm512_set1_epi32(16);
+	__m512 const zero = _mm512_setzero_ps();
+	int p = 0, i = 0;
+	for (; i + 16 <= k; i += 16) {
+		__m512 v = _mm512_loadu_ps(x + i);
+		__mmask16 nz = _mm512_cmp_ps_mask(v, zero, _CMP_NEQ_UQ); //NaNs count as nonzero
+		_mm512_mask_compressstoreu_ps(val + p, nz, v);
+		_mm512_mask_compressstoreu_epi32(col + p, nz, idx);
+		p += __builtin_popcount(nz);
+		idx = _mm512_add_epi32(idx, step);
+	}
+	for (; i < k; i++) {
+		col[p] = i;
+		val[p] = x[i];
+		p += (x[i] != 0);
+	}
+	return p;
+}
+#endif
+
+inline int csr_compress_row(float const *x, int k, int s, int *col, float *val) {
+#ifdef SIMD_HAVE_X86
+	if (s == 1 && simd().level >= simd_level::avx512) return csr_compress_row_avx512(x, k, col, val);
+#endif
+	return csr_compress_row_scalar(x, k, s, col, val);
+}
+
+struct csr_matrix {
+	int rows = 0, cols = 0;
+	std::vector<int> row_ptr;  //rows + 1 entries; row r is [row_ptr[r], row_ptr[r+1])
+	std::vector<int> col_idx;  //Only the first nnz() entries of these two
+	std::vector<float> vals;   //mean anything (they're grow-only)
+
+	csr_matrix() = default;
+
+	csr_matrix(float const *x, int m, int k, int rs, int cs) {
+		assign(x, m, k, rs, cs);
+	}
+
+	//Rebuild from a dense m x k matrix, reusing the storage we already have.
+	//If max_nnz >= 0 and there turn out to be more nonzeros than that, gives
+	//up part way and returns false (and the matrix is garbage), so finding
+	//out a dense input isn't worth converting costs less than a full pass.
+	bool assign(float const *x, int m, int k, int rs, int cs, long max_nnz = -1) {
+		rows = m;
+		cols = k;
+		row_ptr.resize(m + 1);
+		size_t cap = (size_t) m * k;
+		if (vals.size() < cap) {
+			vals.resize(cap);
+			col_idx.resize(cap);
+		}
+
+		int p = 0;
+		for (int r = 0; r < m; r++) {
+			row_ptr[r] = p;
+			p += csr_compress_row(x + (long) r*rs, k, cs, col_idx.data() + p, vals.data() + p);
+			if (max_nnz >= 0 && p > max_nnz) return false;
+		}
+		row_ptr[m] = p;
+		return true;
+	}
+
+	long nnz() const { return row_ptr.empty() ? 0 : row_ptr[rows]; }
+
+	double density() const {
+		return (rows > 0 && cols > 0) ? double(nnz()) / (double(rows) * cols) : 0.0;
+	}
+
+	//t = this^T (a counting sort by column), reusing t's storage
+	void transpose_into(csr_matrix& t) const {
+		long nz = nnz();
+		t.rows = cols;
+		t.cols = rows;
+		t.row_ptr.assign(cols + 1, 0);
+		if ((long) t.vals.size() < nz) {
+			t.vals.resize(nz);
+			t.col_idx.resize(nz);
+		}
+
+		for (long j = 0; j < nz; j++) t.row_ptr[col_idx[j] + 1]++;
+		for (int i = 0; i < cols; i++) t.row_ptr[i + 1] += t.row_ptr[i];
+
+		//Walking our rows in order keeps each of t's rows sorted. next is
+		//kept around so fc backprop doesn't hit malloc every step
+		static thread_local std::vector<int> next;
+		next.assign(t.row_ptr.begin(), t.row_ptr.end() - 1);
+		for (int r = 0; r < rows; r++) {
+			for (int j = row_ptr[r]; j < row_ptr[r + 1]; j++) {
+				int p = next[col_idx[j]]++;
+				t.col_idx[p] = r;
+				t.vals[p] = vals[j];
+			}
+		}
+	}
+
+	//Back to dense (dst is rows x cols with the given strides)
+	void to_dense(float *dst, int rs, int cs) const {
+		for (int r = 0; r < rows; r++) {
+			float *row = dst + (long) r*rs;
+			for (int i = 0; i < cols; i++) row[(long) i*cs] = 0;
+			for (int j = row_ptr[r]; j < row_ptr[r + 1]; j++) row[(long) col_idx[j]*cs] = vals[j];
+		}
+	}
+};
+
+//Pointer to a k x n copy of B with unit-stride rows (B itself if it already
+//has them). ld is set to the row stride of whatever comes back.
+inline float const* sparse_dense_rows(float const *B, int k, int n, int rs_b, int cs_b, int& ld) {
+	if (cs_b == 1 || n == 1) {
+		ld = rs_b;
+		return B;
+	}
+	static thread_local std::vector<float> scratch;
+	if (scratch.size() < (size_t) k * n) scratch.resize((size_t) k * n);
+	int dims[2] = {k, n}, strides[2] = {rs_b, cs_b};
+	layout_gather(2, dims, B, strides, scratch.data());
+	ld = n;
+	return scratch.data();
+}
+
+//c[0, n) += alpha * sum_j val[j] * b[col[j]*ldb + (0, n)]
+inline void csr_row_scalar(
+	float alpha, int const *col, float const *val, int nz, float const *b, long ldb, float *c, int n
+) {
+	for (int j = 0; j < nz; j++) simd().axpy(alpha * val[j], b + col[j]*ldb, c, n);
+}
+
+#ifdef SIMD_HAVE_X86
+//Same thing, but a strip of 64 columns of c sits in 8 ymm registers for the
+//whole run of nonzeros, so each one is just a broadcast and 8 FMAs
+__attribute__((target("avx2,fma")))
+inline void csr_row_avx2(
+	float alpha, int const *col, float const *val, int nz, float const *b, long ldb, float *c, int n
+) {
+	int o = 0;
+	for (; o + 64 <= n; o += 64) {
+		__m256 a0 = _mm256_loadu_ps(c + o),      a1 = _mm256_loadu_ps(c + o + 8);
+		__m256 a2 = _mm256_loadu_ps(c + o + 16), a3 = _mm256_loadu_ps(c + o + 24);
+		__m256 a4 = _mm256_loadu_ps(c + o + 32), a5 = _mm256_loadu_ps(c + o + 40);
+		__m256 a6 = _mm256_loadu_ps(c + o + 48), a7 = _mm256_loadu_ps(c + o + 56);
+		for (int j = 0; j < nz; j++) {
+			__m256 v = _mm256_set1_ps(alpha * val[j]);
+			float const *br = b + col[j]*ldb + o;
+			a0 = _mm256_fmadd_ps(v, _mm256_loadu_ps(br),      a0);
+			a1 = _mm256_fmadd_ps(v, _mm256_loadu_ps(br + 8),  a1);
+			a2 = _mm256_fmadd_ps(v, _mm256_loadu_ps(br + 16), a2);
+			a3 = _mm256_fmadd_ps(v, _mm256_loadu_ps(br + 24), a3);
+			a4 = _mm256_fmadd_ps(v, _mm256_loadu_ps(br + 32), a4);
+			a5 = _mm256_fmadd_ps(v, _mm256_loadu_ps(br + 40), a5);
+			a6 = _mm256_fmadd_ps(v, _mm256_loadu_ps(br + 48), a6);
+			a7 = _mm256_fmadd_ps(v, _mm256_loadu_ps(br + 56), a7);
+		}
+		_mm256_storeu_ps(c + o, a0);      _mm256_storeu_ps(c + o + 8, a1);
+		_mm256_storeu_ps(c + o + 16, a2); _mm256_storeu_ps(c + o + 24, a3);
+		_mm256_storeu_ps(c + o + 32, a4); _mm256_storeu_ps(c + o + 40, a5);
+		_mm256_storeu_ps(c + o + 48, a6); _mm256_storeu_ps(c + o + 56, a7);
+	}
+	for (; o + 8 <= n; o += 8) {
+		__m256 a0 = _mm256_loadu_ps(c + o);
+		for (int j = 0; j < nz; j++) {
+			a0 = _mm256_fmadd_ps(_mm256_set1_ps(alpha * val[j]), _mm256_loadu_ps(b + col[j]*ldb + o), a0);
+		}
+		_mm256_storeu_ps(c + o, a0);
+	}
+	if (o < n) csr_row_scalar(alpha, col, val, nz, b + o, ldb, c + o, n - o);
+}
+#endif
+
+//C (A.rows x n) = alpha * A * B + beta * C, where B is A.cols x n. Rows of
+//C are independent, so big problems split across the pool by row.
+inline void csr_gemm(
+	csr_matrix const& A, int n,
+	float alpha,
+	float const *B, int rs_b, int cs_b,
+	float beta,
+	float *C, int rs_c, int cs_c
+) {
+	int m = A.rows;
+	if (m <= 0 || n <= 0) return;
+	gemm_scale_c(m, n, beta, C, rs_c, cs_c);
+	if (A.nnz() == 0 || alpha == 0) return;
+
+	int ldb;
+	float const *b = sparse_dense_rows(B, A.cols, n, rs_b, cs_b, ldb);
+
+	auto kernel = csr_row_scalar;
+#ifdef SIMD_HAVE_X86
+	if (simd().level >= simd_level::avx2) kernel = csr_row_avx2;
+#endif
+
+	auto row = [&](int r) {
+		int j0 = A.row_ptr[r], nz = A.row_ptr[r + 1] - j0;
+		if (nz == 0) return;
+		int const *col = A.col_idx.data() + j0;
+		float const *val = A.vals.data() + j0;
+		float *c = C + (long) r*rs_c;
+		if (cs_c == 1) {
+			kernel(alpha, col, val, nz, b, ldb, c, n);
+		} else {
+			for (int j = 0; j < nz; j++) {
+				float const *brow = b + (long) col[j]*ldb;
+				for (int o = 0; o < n; o++) c[(long) o*cs_c] += alpha * val[j] * brow[o];
+			}
+		}
+	};
+
+	if (m > 1 && static_cast<double>(A.nnz()) * n >= GEMM_PARALLEL_MIN) {
+		parallel_for(0, m, row);
+	} else {
+		for (int r = 0; r < m; r++) row(r);
+	}
+}
+
+//C (A.cols x n) = alpha * A^T * D + beta * C, where D is A.rows x n. Just
+//csr_gemm on the transpose of A.
+inline void csr_gemm_tn(
+	csr_matrix const& A, int n,
+	float alpha,
+	float const *D, int rs_d, int cs_d,
+	float beta,
+	float *C, int rs_c, int cs_c
+) {
+	static thread_local csr_matrix At;
+	A.transpose_into(At);
+	csr_gemm(At, n, alpha, D, rs_d, cs_d, beta, C, rs_c, cs_c);
+}
+
+#endif
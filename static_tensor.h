@@ -0,0 +1,208 @@
+#ifndef STATIC_TENSOR_H
+#define STATIC_TENSOR_H 1
+
+//Tensors whose shape is part of the type. Our models have fixed layer
+//sizes (784 -> 128 -> 64 -> 10 for MNIST), but every kernel reads dims[]
+//and strides[] out of a TSpan at runtime, so a loop over the 10 outputs
+//can't be unrolled or vectorized for exactly 10.
+//
+//  - StaticSpan<T, D0, D1, ...> is a view of a dense row-major block. The
+//    only runtime state is the data pointer; dims, strides and size are
+//    constexpr.
+//  - StaticTensor<T, D0, D1, ...> owns its elements inline (no heap), so
+//    keep it to small shapes.
+//
+//Both convert to TSpan<rank, T>, so they work anywhere a TSpan does
+//(tensormul, tensoreltwise, ctr_layer::ctr_ff...). When every operand is
+//static, tensoreltwise/tensorunary/tensormul pick up the overloads in here
+//instead, which are plain loops with constant trip counts that the
+//compiler fully unrolls and vectorizes.
+//
+//Going the other way, static_span<D...>(tspan) checks a runtime view's
+//shape and hands back a StaticSpan (throws if it doesn't match or isn't
+//dense). static_dispatch<MAX>(n, F) calls F(std::integral_constant<int, n>)
+//for a runtime n <= MAX, which is how softmax in layers.h gets its
+//unrolled row kernels.
+
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "tensor.h"
+#include "tensor_alloc.h" //TENSOR_ALIGNMENT
+
+//Static products bigger than this (M*N*K) go to the regular GEMM
+#ifndef STATIC_GEMM_MAX
+#define STATIC_GEMM_MAX 4096
+#endif
+
+//Widest row that gets its own unrolled kernel through static_dispatch
+#ifndef STATIC_MAX_WIDTH
+#define STATIC_MAX_WIDTH 16
+#endif
+
+template <int... Ds>
+constexpr std::array<int, sizeof...(Ds)> static_strides() {
+	std::array<int, sizeof...(Ds)> dims = {Ds...};
+	std::array<int, sizeof...(Ds)> ret = {};
+	int prod = 1;
+	for (int i = (int) sizeof...(Ds) - 1; i >= 0; i--) {
+		ret[i] = prod;
+		prod *= dims[i];
+	}
+	return ret;
+}
+
+template <typename T, int D0, int... Ds>
+struct StaticSpan {
+	static constexpr int rank = 1 + sizeof...(Ds);
+	static constexpr std::array<int, rank> dims = {D0, Ds...};
+	static constexpr std::array<int, rank> strides = static_strides<D0, Ds...>();
+	static constexpr int size = (D0 * ... * Ds);
+
+	T const *data;
+
+	StaticSpan() : data(nullptr) {}
+	explicit StaticSpan(T const *data) : data(data) {}
+
+	//Rank > 1 gives the sub-span, rank 1 gives the element
+	decltype(auto) operator[](int n) const {
+		assert(n >= 0 && n < D0);
+		if constexpr (sizeof...(Ds) > 0) {
+			return StaticSpan<T, Ds...>(data + n*strides[0]);
+		} else {
+			return const_cast<T&>(data[n]);
+		}
+	}
+
+	T& at(int n) const { return const_cast<T&>(data[n]); } //Flat index
+
+	operator TSpan<rank, T>() const {
+		return TSpan<rank, T>(data, dims.data(), strides.data());
+	}
+
+	operator RTSpan<T>() const {
+		return RTSpan<T>(data, rank, dims.data(), strides.data());
+	}
+};
+
+template <typename T, int... Ds>
+struct StaticTensor {
+	using span_type = StaticSpan<T, Ds...>;
+	static constexpr int rank = span_type::rank;
+	static constexpr int size = span_type::size;
+
+	alignas(TENSOR_ALIGNMENT) std::array<T, size> storage{};
+
+	span_type span() const { return span_type(storage.data()); }
+
+	decltype(auto) operator[](int n) const { return span()[n]; }
+
+	operator TSpan<rank, T>() const { return span(); }
+
+	template <int span_rank>
+	TSpan<span_rank, T> as_tspan() const {
+		static_assert(span_rank == rank, "TSpan rank doesn't match StaticTensor rank");
+		return span();
+	}
+};
+
+//Checked view of a runtime TSpan as a StaticSpan
+template <int... Ds, int rank, typename T>
+StaticSpan<T, Ds...> static_span(TSpan<rank, T> const& t) {
+	static_assert(rank == sizeof...(Ds), "static_span needs one size per dimension");
+	using S = StaticSpan<T, Ds...>;
+	if (t.dims != S::dims || contiguous_size(rank, t.dims.data(), t.strides.data()) < 0) {
+		std::string msg = "Cannot view [";
+		for (int i = 0; i < rank; i++) msg += (i ? " x " : "") + std::to_string(t.dims[i]);
+		throw std::runtime_error(msg + "] as a dense static shape");
+	}
+	return S(t.data);
+}
+
+//Calls F(std::integral_constant<int, n>{}) if 1 <= n <= MAX, returns false
+//otherwise. Every n gets its own instantiation of F.
+template <int MAX, int N = 1, typename fn>
+bool static_dispatch(int n, fn&& F) {
+	if constexpr (N > MAX) {
+		return false;
+	} else {
+		if (n == N) {
+			F(std::integral_constant<int, N>{});
+			return true;
+		}
+		return static_dispatch<MAX, N + 1>(n, F);
+	}
+}
+
+/////////////////
+//STATIC KERNELS//
+/////////////////
+//Every StaticSpan is dense, so the elementwise ops are one flat loop.
+
+template <typename T, int... Ds, typename fn>
+void tensorunary(StaticSpan<T, Ds...> const src, StaticSpan<T, Ds...> dest, fn F) {
+	for (int i = 0; i < StaticSpan<T, Ds...>::size; i++) dest.at(i) = F(src.data[i]);
+}
+
+//dest may alias either input
+template <typename T, int... Ds, typename fn>
+void tensoreltwise(
+	StaticSpan<T, Ds...> const lhs, StaticSpan<T, Ds...> const rhs,
+	StaticSpan<T, Ds...> dest, fn F
+) {
+	for (int i = 0; i < StaticSpan<T, Ds...>::size; i++) dest.at(i) = F(lhs.data[i], rhs.data[i]);
+}
+
+//[M x K] times [K x N], accumulating into dest like the other tensormuls
+template <typename T, int M, int K, int N>
+void tensormul(StaticSpan<T, M, K> const A, StaticSpan<T, K, N> const B, StaticSpan<T, M, N> dest) {
+	if constexpr (long(M) * N * K > STATIC_GEMM_MAX) {
+		tensormul(TSpan<2, T>(A), TSpan<2, T>(B), TSpan<2, T>(dest));
+	} else {
+		//i-k-j order: the inner loop is a length-N axpy on a row of dest
+		for (int i = 0; i < M; i++) {
+			for (int k = 0; k < K; k++) {
+				T a = A.data[i*K + k];
+				for (int j = 0; j < N; j++) dest.at(i*N + j) += a * B.data[k*N + j];
+			}
+		}
+	}
+}
+
+//Softmax of one row. Same steps as softmax::ff in layers.h: subtract the
+//max, exponentiate, divide by the sum.
+template <int N>
+void static_softmax_row(StaticSpan<float, N> const x, StaticSpan<float, N> y) {
+	float m = x.data[0];
+	for (int i = 1; i < N; i++) m = (x.data[i] > m) ? x.data[i] : m;
+
+	float sum = 0;
+	for (int i = 0; i < N; i++) {
+		y.at(i) = exp(x.data[i] - m);
+		sum += y.at(i);
+	}
+	assert(!std::isinf(sum) && !std::isnan(sum));
+	assert(sum > 1e-8);
+	for (int i = 0; i < N; i++) y.at(i) /= sum;
+}
+
+//dx += J * dy for one row, where J = diag(y) - y^T * y is the softmax
+//Jacobian. J never gets written out.
+template <int N>
+void static_softmax_bp_row(StaticSpan<float, N> const y, StaticSpan<float, N> const dy, StaticSpan<float, N> dx) {
+	for (int j = 0; j < N; j++) {
+		float acc = 0;
+		for (int k = 0; k < N; k++) {
+			float J = -y.data[j] * y.data[k];
+			if (j == k) J += y.data[j];
+			acc += J * dy.data[k];
+		}
+		dx.at(j) += acc;
+	}
+}
+
+#endif
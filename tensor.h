@@ -15,6 +15,14 @@
 #include <random>
 #include <cmath>
 #include <functional>
+#include <type_traits>
+
+#include "gemm.h"
+#include "gemm_tune.h"
+#include "tensor_alloc.h"
+#include "simd.h"
+#include "layout.h"
+#include "reduce.h"
 
 template <typename T>
 [[maybe_unused]] static bool compare(T const& a, T const& b) {
@@ -31,72 +39,53 @@ template <typename T>
 	return fabs(a - b) < DOUBLE_TOL;
 }
 
-class RCTSpanData {
-    int ref_cnt;
-    int const* dims;
-    int const* strides;
-
-public:
-    RCTSpanData(int const* dims, int const* strides) :
-        ref_cnt(0), dims(dims), strides(strides)
-    {}
-
-    RCTSpanData(RCTSpanData const& other) = delete;
-    RCTSpanData(RCTSpanData&& other) = delete;
-    RCTSpanData& operator=(RCTSpanData const& other) = delete;
-    RCTSpanData& operator=(RCTSpanData&& other) = delete;
-    
-	//No need to call ref right after constructing
-    void ref() {
-        ref_cnt++;
-    }
-
-    void deref() {
-        ref_cnt--;
-        if (ref_cnt == 0)
-            delete this;
-    }
-
-private:
-    ~RCTSpanData() {
-        delete[] dims;
-        delete[] strides;
-    }
-};
-
 //Forward-declare RTSpan
 template <typename T>
 struct RTSpan;
 
-//Template specialization below covers ndims = 1, we can assume
-//this struct always has ndims > 1
+//Throws unless perm[0..rank) is a permutation of 0..rank-1
+inline void check_permutation(int rank, int const *perm) {
+	bool seen[TENSOR_MAX_RANK] = {};
+	for (int i = 0; i < rank; i++) {
+		if (rank > TENSOR_MAX_RANK || perm[i] < 0 || perm[i] >= rank || seen[perm[i]]) {
+			throw std::runtime_error("Invalid permutation of a rank " + std::to_string(rank) + " tensor");
+		}
+		seen[perm[i]] = true;
+	}
+}
+
+//A TSpan is just a view: a data pointer plus its dims and strides, which 
+//are stored inline. Making one (transpose, submat, operator[], ...) never 
+//touches the heap, and copying one is just copying a few ints.
+//
+//Threading: views own nothing and share nothing, so any TSpan or RTSpan 
+//can be copied to (or shared with) other threads without synchronization.
+//There is no refcount anywhere, so operator[] stays a plain copy. The only
+//rules are the obvious ones: the Tensor that owns the storage has to 
+//outlive every view of it, and two threads shouldn't write the same 
+//elements at the same time.
 template <int rank, typename T>
 struct TSpan {
     static_assert(rank >= 1, "TSpan code only handles positive-rank tensors");
 
     T const* data;
-    int const* dims;
-    int const* strides;
-
-    RCTSpanData *rc_data;
+    std::array<int, rank> dims;
+    std::array<int, rank> strides;
 
 	//FIXME: should we keep this? Currently fixes a problem in the 
 	//Adam optimizer where we wanted to cache the TSpans. Another 
 	//solution would be to regenerate the TSpans every time
-	TSpan() : data(nullptr), dims(nullptr), strides(nullptr), rc_data(nullptr) {}
+	TSpan() : data(nullptr), dims{}, strides{} {}
 
-    TSpan(T const* data, int const* dims, int const* strides, 
-          RCTSpanData *rc_data = nullptr) :
-        data(data), dims(dims), strides(strides), rc_data(rc_data)
+	//Copies rank ints out of each of dims and strides
+    TSpan(T const* data, int const* dims, int const* strides) :
+        data(data)
     {
-        if (rc_data) {
-            rc_data->ref();
-        }
+		std::copy(dims, dims + rank, this->dims.begin());
+		std::copy(strides, strides + rank, this->strides.begin());
     }
 
-	TSpan(RTSpan<T> const& other)
-		: TSpan(other.data, other.dims, other.strides, other.rc_data)
-	{
+	TSpan(RTSpan<T> const& other) : data(other.data) {
 		if (other.rank != rank) {
 			throw std::runtime_error(
 				std::string("Could not construct TSpan of rank ")
@@ -105,83 +94,37 @@ struct TSpan {
 				+ std::to_string(other.rank)
 			);
 		}
+		std::copy(other.dims.begin(), other.dims.begin() + rank, dims.begin());
+		std::copy(other.strides.begin(), other.strides.begin() + rank, strides.begin());
 	}
 
-    ~TSpan() {
-        if (rc_data)
-            rc_data->deref();
-    }
-
-	//constructor delegation takes care of calling ref() on rc_data
-    TSpan(TSpan const& other) :
-        TSpan(other.data, other.dims, other.strides, other.rc_data) 
-    {}
-
-    TSpan(TSpan&& other) {
-        data = other.data;
-        dims = other.dims;
-        strides = other.strides;
-        rc_data = other.rc_data;
-
-        other.data = nullptr; //Technically unnecessary
-        other.dims = nullptr; //Technically unnecessary
-        other.strides = nullptr; //Technically unnecessary
-        other.rc_data = nullptr; //Necessary
-    }
-
-    //TODO: this is more thorny
-    TSpan& operator=(TSpan const&) = delete;
-
-    TSpan& operator=(TSpan&& other) {
-        if(this != &other) {
-            //Get rid of what was here before
-            if (rc_data)
-                rc_data->deref();
-
-            //Copy from the other guy
-            data = other.data;
-            dims = other.dims;
-            strides = other.strides;
-            rc_data = other.rc_data;
-
-            //Get rid of other guy's stuff
-            other.data = nullptr; //Technically unnecessary
-            other.dims = nullptr; //Technically unnecessary
-            other.strides = nullptr; //Technically unnecessary
-            other.rc_data = nullptr; //Necessary
-        }
-        return *this;
-    }
-
 	//////////////////////////////////////////
 	//OPERATOR[] AND BACK_INDEX FOR RANK > 1//
 	//////////////////////////////////////////
 	template <bool rank_is_1 = (rank == 1)>
     std::enable_if_t<not rank_is_1,
 	TSpan<rank - 1, T> > operator[] (int n) {
-        //auto ptr = const_cast<T*>(data);
-        //return TSpan<rank - 1, T>(ptr + n * strides[0], dims + 1, strides + 1);
-        return TSpan<rank - 1, T>(data + n * strides[0], dims + 1, strides + 1, rc_data);
+        return TSpan<rank - 1, T>(data + n * strides[0], dims.data() + 1, strides.data() + 1);
     }
 
 	template <bool rank_is_1 = (rank == 1)>
     std::enable_if_t<not rank_is_1,
 	TSpan<rank - 1, T> > const operator[] (int n) const {
-        return TSpan<rank - 1, T>(data + n * strides[0], dims + 1, strides + 1, rc_data);
+        return TSpan<rank - 1, T>(data + n * strides[0], dims.data() + 1, strides.data() + 1);
     }
 
     //Like doing my_tensor(:,:,:,n) in MATLAB syntax
 	template <bool rank_is_1 = (rank == 1)>
     std::enable_if_t<not rank_is_1,
 	TSpan<rank - 1, T> > back_index(int n) {
-        return TSpan<rank - 1, T>(data + n*strides[rank-1], dims, strides, rc_data);
+        return TSpan<rank - 1, T>(data + n*strides[rank-1], dims.data(), strides.data());
     }
 
     //Like doing my_tensor(:,:,:,n) in MATLAB syntax
     template <bool rank_is_1 = (rank == 1)>
     std::enable_if_t<not rank_is_1,
 	TSpan<rank - 1, T> > const back_index(int n) const {
-        return TSpan<rank - 1, T>(data + n*strides[rank-1], dims, strides, rc_data);
+        return TSpan<rank - 1, T>(data + n*strides[rank-1], dims.data(), strides.data());
     }
 
 	
@@ -216,27 +159,27 @@ struct TSpan {
         return (*this)[n];
     }
 
-	//////////////////////////
-	//DEEP COPY FOR RANK > 1//
-	//////////////////////////
-	template <bool rank_is_1 = (rank == 1)>
-	std::enable_if_t<not rank_is_1,
-	void> deep_copy_to(TSpan<rank, T> other) {
-		assert(this->dims[0] == other.dims[0]);//Not the most efficient, but whatever
-		for (int i = 0; i < this->dims[0]; i++) {
-			(*this)[i].deep_copy_to(other[i]);
-		}
-	}
-
-	//////////////////////////
-	//DEEP COPY FOR RANK = 1//
-	//////////////////////////
-	template <bool rank_is_1 = (rank == 1)>
-	std::enable_if_t<rank_is_1,
-	void> deep_copy_to(TSpan<rank, T> other) {
-		assert(this->dims[0] == other.dims[0]);//Not the most efficient, but whatever
-		for (int i = 0; i < this->dims[0]; i++) {
-			other[i] = (*this)[i];
+	/////////////
+	//DEEP COPY//
+	/////////////
+	//Dense (or mergeable) layouts become one flat copy, see layout.h. The 
+	//recursion is only there for ranks bigger than TENSOR_MAX_RANK
+	void deep_copy_to(TSpan<rank, T> other) const {
+		assert(this->dims == other.dims);
+		if (layout_copy(
+				rank, dims.data(), data, strides.data(), 
+				const_cast<T*>(other.data), other.strides.data()
+			))
+			return;
+
+		if constexpr (rank == 1) {
+			for (int i = 0; i < this->dims[0]; i++) {
+				other[i] = (*this)[i];
+			}
+		} else {
+			for (int i = 0; i < this->dims[0]; i++) {
+				(*this)[i].deep_copy_to(other[i]);
+			}
 		}
 	}
 
@@ -247,40 +190,50 @@ struct TSpan {
 	//(Always better to avoid enable_if_t)
     TSpan<2, T> transpose() const {
         static_assert(rank == 2, "transpose only available for rank-2 tensors");
-        int *new_dims = new int[2];
-        new_dims[0] = dims[1];
-        new_dims[1] = dims[0];
-        int *new_strides = new int[2];
-		new_strides[0] = strides[1];
-		new_strides[1] = strides[0];
-
-        TSpan<2, T> ret = TSpan(
-			data, new_dims, new_strides,
-            new RCTSpanData(new_dims, new_strides)
-		);
+        TSpan<2, T> ret;
+		ret.data = data;
+        ret.dims = {dims[1], dims[0]};
+		ret.strides = {strides[1], strides[0]};
         return ret;
     }
     
+    //Generalized transpose: dimension i of the result is dimension perm[i]
+    //of this one (like numpy's transpose(axes)). Just shuffles dims and
+    //strides; use tensorpermute() to get a dense copy.
+    TSpan<rank, T> permute(std::array<int, rank> const& perm) const {
+		check_permutation(rank, perm.data());
+        TSpan<rank, T> ret;
+		ret.data = data;
+		for (int i = 0; i < rank; i++) {
+			ret.dims[i] = dims[perm[i]];
+			ret.strides[i] = strides[perm[i]];
+		}
+        return ret;
+    }
+
+    //len entries along axis, starting at begin. Like submat, but for any
+    //rank and any axis
+    TSpan<rank, T> slice(int axis, int begin, int len) const {
+		assert(axis >= 0 && axis < rank);
+		assert(begin >= 0 && len >= 0 && begin + len <= dims[axis]);
+        TSpan<rank, T> ret = *this;
+		ret.data = data + (long) begin * strides[axis];
+		ret.dims[axis] = len;
+        return ret;
+    }
+
     TSpan<2, T> submat(int x0, int y0, int xsz, int ysz) const {
+        static_assert(rank == 2, "submat only available for rank-2 tensors");
         //Assert in bounds
         assert(x0 + xsz <= dims[1]);
         assert(y0 + ysz <= dims[0]);
 		assert(x0 >= 0);
 		assert(y0 >= 0);
-        int *new_dims = new int[2];
-        int *new_strides = new int[2];
-        new_dims[0] = ysz; new_dims[1] = xsz;
-        new_strides[0] = strides[0];
-        new_strides[1] = strides[1];
-
-        T const* new_data = data + (y0 * strides[0]) + (x0 * strides[1]);
-
-        return TSpan<2,T>(
-            new_data, 
-            new_dims, 
-            new_strides, 
-            new RCTSpanData(new_dims, new_strides)
-        );
+        TSpan<2, T> ret;
+        ret.data = data + (y0 * strides[0]) + (x0 * strides[1]);
+        ret.dims = {ysz, xsz};
+        ret.strides = strides;
+        return ret;
     }
 
     int length() const {
@@ -320,39 +273,37 @@ using MSpan = TSpan<2,T>;
 template <typename T>
 using VSpan = TSpan<1,T>;
 
+//Runtime-rank version of TSpan. Same idea: dims and strides live inline,
+//in a fixed buffer big enough for TENSOR_MAX_RANK dimensions.
 template <typename T>
 struct RTSpan {
 	T const *data;
 	
 	int rank;
-	int const *dims;
-	int const *strides;
-	
-	RCTSpanData *rc_data;
+	std::array<int, TENSOR_MAX_RANK> dims;
+	std::array<int, TENSOR_MAX_RANK> strides;
 
 	RTSpan(
 		T const *data, 
-		int rank, int const* dims, int const* strides, 
-		RCTSpanData *rc_data = nullptr
+		int rank, int const* dims, int const* strides
 	)
-		: data(data), rank(rank), dims(dims), strides(strides), rc_data(rc_data)
+		: data(data), rank(rank)
 	{
-        if (rc_data) {
-            rc_data->ref();
-        }
+		if (rank > TENSOR_MAX_RANK) {
+			throw std::runtime_error(
+				"RTSpan rank " + std::to_string(rank) 
+				+ " exceeds TENSOR_MAX_RANK (" + std::to_string(TENSOR_MAX_RANK) + ")"
+			);
+		}
+		std::copy(dims, dims + rank, this->dims.begin());
+		std::copy(strides, strides + rank, this->strides.begin());
 	}
 
-	//Constructor delegation takes care of calling ref on rc_data
 	template <int other_rank>
 	RTSpan(TSpan<other_rank, T> const& other) 
-		: RTSpan(other.data, other_rank, other.dims, other.strides, other.rc_data)
+		: RTSpan(other.data, other_rank, other.dims.data(), other.strides.data())
 	{}
 
-	~RTSpan() {
-		if(rc_data) 
-			rc_data->deref();
-	}
-
 	template<int rank>
 	TSpan<rank, T> as_tspan() {
 		return TSpan<rank, T>(*this);
@@ -365,12 +316,12 @@ struct RTSpan {
 
 	RTSpan operator[](int n) {
 		assert(rank > 0);
-		return RTSpan(data + n*strides[0], rank - 1, dims + 1, strides + 1, rc_data);
+		return RTSpan(data + n*strides[0], rank - 1, dims.data() + 1, strides.data() + 1);
 	}
 	
 	RTSpan const operator[](int n) const {
 		assert(rank > 0);
-		return RTSpan(data + n*strides[0], rank - 1, dims + 1, strides + 1, rc_data);
+		return RTSpan(data + n*strides[0], rank - 1, dims.data() + 1, strides.data() + 1);
 	}
 
 	//This lets you at least do *my_rtspan[3][4][5] when you 
@@ -388,21 +339,27 @@ struct RTSpan {
 
 	//Like doing my_tensor(:,:,:,n) in MATLAB syntax
     RTSpan<T> back_index(int n) {
-        return RTSpan<T>(data + n*strides[rank-1], rank - 1, dims, strides, rc_data);
+        return RTSpan<T>(data + n*strides[rank-1], rank - 1, dims.data(), strides.data());
     }
 
     //Like doing my_tensor(:,:,:,n) in MATLAB syntax
     RTSpan<T> const back_index(int n) const {
-        return RTSpan<T>(data + n*strides[rank-1], rank - 1, dims, strides, rc_data);
+        return RTSpan<T>(data + n*strides[rank-1], rank - 1, dims.data(), strides.data());
     }
 
-	void deep_copy_to(RTSpan<float> other) {
+	void deep_copy_to(RTSpan<T> other) const {
 		assert(rank == other.rank);
-		assert(dims[0] == other.dims[0]); //Not the most efficient, but whatever
+		assert(std::equal(dims.begin(), dims.begin() + rank, other.dims.begin()));
+
+		if (layout_copy(
+				rank, dims.data(), data, strides.data(), 
+				const_cast<T*>(other.data), other.strides.data()
+			))
+			return;
 
 		if (rank == 1) {
 			for (int i = 0; i < dims[0]; i++) {
-				*((*this)[i]) = *(other[i]);
+				*(other[i]) = *((*this)[i]);
 			}
 		} else {
 			for (int i = 0; i < dims[0]; i++) {
@@ -413,19 +370,22 @@ struct RTSpan {
 
     RTSpan transpose() const {
         assert(rank == 2);
+		RTSpan<T> ret = *this;
+        ret.dims[0] = dims[1];
+        ret.dims[1] = dims[0];
+		ret.strides[0] = strides[1];
+		ret.strides[1] = strides[0];
+        return ret;
+    }
 
-		int *new_dims = new int[2];
-        new_dims[0] = dims[1];
-        new_dims[1] = dims[0];
-
-        int *new_strides = new int[2];
-		new_strides[0] = strides[1];
-		new_strides[1] = strides[0];
-
-        RTSpan<T> ret = RTSpan(
-			data, 2, new_dims, new_strides, 
-			new RCTSpanData(new_dims, new_strides)
-		);
+    //See TSpan::permute. perm has rank entries
+    RTSpan permute(int const *perm) const {
+		check_permutation(rank, perm);
+		RTSpan<T> ret = *this;
+		for (int i = 0; i < rank; i++) {
+			ret.dims[i] = dims[perm[i]];
+			ret.strides[i] = strides[perm[i]];
+		}
         return ret;
     }
 
@@ -455,6 +415,11 @@ struct RTSpan {
     }
 };
 
+//If either of these ever fails, someone added shared state to the views 
+//and they are no longer safe to hand to another thread (see above)
+static_assert(std::is_trivially_copyable<TSpan<2, float>>::value, "TSpan must stay a plain value type");
+static_assert(std::is_trivially_copyable<RTSpan<float>>::value, "RTSpan must stay a plain value type");
+
 template<int ndims, typename T>
 std::ostream& operator<<(std::ostream &o, TSpan<ndims, T> const& t) {
     o << "[";
@@ -524,9 +489,10 @@ struct uniform_randgen {
 
 template <typename T>
 struct Tensor {
-    std::vector<T> storage;
-    std::vector<int> dims;
-    std::vector<int> strides;
+    //64-byte aligned, huge pages for big buffers (see tensor_alloc.h)
+    tensor_vector<T> storage;
+    tensor_vector<int> dims;
+    tensor_vector<int> strides;
     size_t rank;
 
     int copy_dims_get_strides(int const *dims) {        
@@ -552,7 +518,7 @@ struct Tensor {
 	{
         this->rank = dim_len;
         int prod = copy_dims_get_strides(dims);
-        storage = std::vector<T>(prod, T());
+        storage = tensor_vector<T>(prod, T());
     }
 
     Tensor(std::vector<int> const& dims): Tensor(dims.data(), dims.size()) {}
@@ -562,10 +528,23 @@ struct Tensor {
 	{
         this->rank = dim_len;
         int prod = copy_dims_get_strides(dims);
-        
-        storage = std::vector<T>();
-        for (int i = 0; i < prod; ++i) {
-            storage.push_back(data[i]);
+        storage.assign(data, data + prod); //One allocation, then a memcpy
+    }
+
+    //Copies a view (any strides) into fresh dense storage
+    Tensor(T const* data, int const* dims, int const* strides, size_t dim_len) 
+		: dims(dim_len), strides(dim_len) //Make sure vectors have space
+	{
+        this->rank = dim_len;
+        int prod = copy_dims_get_strides(dims);
+        if (contiguous_size(dim_len, dims, strides) >= 0) {
+            storage.assign(data, data + prod);
+            return;
+        }
+
+        storage.resize(prod);
+        if (!layout_gather(dim_len, dims, data, strides, storage.data())) {
+            throw std::runtime_error("Rank too big to copy from a strided view");
         }
     }
 
@@ -585,12 +564,12 @@ struct Tensor {
         }
     }
 
-	Tensor(RTSpan<T> const& s) : Tensor(s.data, s.dims, s.rank) {}
+	Tensor(RTSpan<T> const& s) : Tensor(s.data, s.dims.data(), s.strides.data(), s.rank) {}
 
     template<int rank>
-    Tensor(TSpan<rank, T> const& t) : Tensor(t.data, t.dims, rank) {}
+    Tensor(TSpan<rank, T> const& t) : Tensor(t.data, t.dims.data(), t.strides.data(), rank) {}
     
-    Tensor(std::vector<T> vec, int const* dims, size_t dim_len) 
+    Tensor(tensor_vector<T> vec, int const* dims, size_t dim_len) 
 		: storage(std::move(vec)),
 		  dims(dim_len), strides(dim_len) //Make sure vectors have space
 	{
@@ -598,7 +577,7 @@ struct Tensor {
         copy_dims_get_strides(dims);
     }
 
-    Tensor(std::vector<T> vec, std::vector<int> dims) 
+    Tensor(tensor_vector<T> vec, std::vector<int> dims) 
 		: storage(std::move(vec)),
 		  dims(dims.size()), strides(dims.size()) //Make sure vectors have space
 	{
@@ -606,6 +585,14 @@ struct Tensor {
         copy_dims_get_strides(dims.data());
     }
 
+    //A plain std::vector can't hand over its buffer (wrong allocator), so
+    //these copy. Build a tensor_vector up front if you want the move.
+    Tensor(std::vector<T> const& vec, int const* dims, size_t dim_len) 
+		: Tensor(tensor_vector<T>(vec.begin(), vec.end()), dims, dim_len) {}
+
+    Tensor(std::vector<T> const& vec, std::vector<int> dims) 
+		: Tensor(tensor_vector<T>(vec.begin(), vec.end()), std::move(dims)) {}
+
     RTSpan<T> operator[] (int n) {
       return RTSpan<T>(*this)[n];
     }
@@ -733,7 +720,7 @@ void> tensormul(
 
 //Does NOT perform any safety checks.
 template<int LHS_rank, int RHS_rank, typename T>
-std::enable_if_t<(LHS_rank > 2) || (LHS_rank == 2 && RHS_rank != 2),
+std::enable_if_t<(LHS_rank > 3) || (LHS_rank == 3 && RHS_rank != 2) || (LHS_rank == 2 && RHS_rank != 2),
 void> tensormul(
     TSpan<LHS_rank, T> const& A, 
     TSpan<RHS_rank, T> const& B,
@@ -757,110 +744,160 @@ void> tensormul(
     }
 }
 
-//TODO: find a nicer way to supply the block size
-#define BSZ 64
-//TODO: 64 is just a magic number
-
-template<typename T>
-Tensor<TSpan<2,T> > tilize(TSpan<2,T> A) {
-/*
-
-   +-------------+-------------+-------------+-------+
-   |             |             |             |       |
-   |             |             |             |       |
-   |   BSZ*BSZ   |   BSZ*BSZ   |   BSZ*BSZ   |       |
-   |             |             |             |       |
-   |             |             |             |       |
-   +-------------+-------------+-------------+-------+
-   |             |             |             |       |
-   |             |             |             |       |
-   |   BSZ*BSZ   |   BSZ*BSZ   |   BSZ*BSZ   |       |
-   |             |             |             |       |
-   |             |             |             |       |
-   +-------------+-------------+-------------+-------+
-   |             |             |             |  XX   |
-   +-------------+-------------+-------------+-------+
-
-*/	
-
-	//Uses a neat little trick:
-	//     (A + (B-1)) / B = ceil(A/B)
-	//                 ^           ^
-	//Integer division /           |
-	//Regular division------------/
-
-	int blocks_dims[2] = {
-		(A.dims[0] + BSZ - 1) / BSZ, 
-		(A.dims[1] + BSZ - 1) / BSZ
-	};
-
-	Tensor<TSpan<2,T>> blocks(blocks_dims, 2);
-    auto blocks_spn = blocks.template as_tspan<2>();
-    
-    for (int y = 0, yy = 0; y < blocks.dims[0]; y++, yy += BSZ) {
-        int y_space = A.dims[0] - yy;
-        int ybsz = (y_space > BSZ) ? BSZ : y_space;
-
-		int x, xx;
-        //Do the first n - 1
-        for (x = 0, xx = 0; x < blocks.dims[1] - 1; x++, xx += BSZ) {
-            blocks_spn[y][x] = A.submat(xx, yy, BSZ, ybsz);
-        }
-        //Do the last one
-        int xbsz = A.dims[1] - xx;
-        assert(xbsz > 0);
-        assert(xbsz <= BSZ);
-        blocks_spn[y][x] = A.submat(xx, yy, xbsz, ybsz);
-    }
+//Special overload for matrix-matrix products. Anything big enough to be
+//worth it goes through the packed GEMM engine in gemm.h; tiny products
+//(and element types the engine doesn't know about) use the plain recursion.
+//Big square-ish products only take the Strassen path if it's been switched
+//on with gemm_strassen_min() (see gemm.h), since it rounds differently
+template<int LHS_rank, int RHS_rank, typename T>
+std::enable_if_t<(LHS_rank == 2) && (RHS_rank == 2),
+void> tensormul(
+    TSpan<LHS_rank, T> const& A, 
+    TSpan<RHS_rank, T> const& B,
+    TSpan<2, T> dest
+) {
+    assert(A.dims[1] == B.dims[0]);
+    assert(dest.dims[0] == A.dims[0]);
+    assert(dest.dims[1] == B.dims[1]);
 
-    return blocks;
+	long work = long(A.dims[0]) * B.dims[1] * A.dims[1];
+	if (!std::is_arithmetic<T>::value || work <= GEMM_SMALL) {
+		for (int i = 0; i < A.dims[0]; i++) {
+			tensormul(A[i], B, dest[i]);
+		}
+	} else if (gemm_use_strassen<T>(A.dims[0], B.dims[1], A.dims[1])) {
+		gemm_strassen(
+			A.dims[0], B.dims[1], A.dims[1],
+			A.data, A.strides[0], A.strides[1],
+			B.data, B.strides[0], B.strides[1],
+			const_cast<T*>(dest.data), dest.strides[0], dest.strides[1]
+		);
+	} else {
+		gemm_accumulate(
+			A.dims[0], B.dims[1], A.dims[1],
+			A.data, A.strides[0], A.strides[1],
+			B.data, B.strides[0], B.strides[1],
+			const_cast<T*>(dest.data), dest.strides[0], dest.strides[1]
+		);
+	}
 }
 
-//Special overload for doing tiling matrix multiplications
+//[batch x M x K] times [K x N]. This is the same contraction the general
+//recursion above would do, but if the batches of A and dest sit back to back
+//in memory it's really one (batch*M) x K product, which is much better for
+//the GEMM. See gemm_batched.
 template<int LHS_rank, int RHS_rank, typename T>
-std::enable_if_t<(LHS_rank == 2) && (RHS_rank == 2),
+std::enable_if_t<(LHS_rank == 3) && (RHS_rank == 2),
 void> tensormul(
     TSpan<LHS_rank, T> const& A, 
     TSpan<RHS_rank, T> const& B,
-    TSpan<2, T> dest
+    TSpan<3, T> dest
 ) {
-	if (
-		A.dims[0] <= BSZ ||
-		B.dims[0] <= BSZ ||
-		B.dims[1] <= BSZ
-	) {
+    assert(A.dims[2] == B.dims[0]);
+    assert(dest.dims[0] == A.dims[0]);
+    assert(dest.dims[1] == A.dims[1]);
+    assert(dest.dims[2] == B.dims[1]);
+
+	if constexpr (!std::is_arithmetic<T>::value) {
 		for (int i = 0; i < A.dims[0]; i++) {
 			tensormul(A[i], B, dest[i]);
 		}
 	} else {
-		//copy in the block matmul
-        assert(A.dims[1] == B.dims[0]);
-        assert(dest.dims[0] == A.dims[0]);
-        assert(dest.dims[1] == B.dims[1]);
-
-        //Start by creating a matrix of blocks (where each block is itself 
-        //a matrix of size bsz*bsz) for the inputs and the output
-
-        Tensor<TSpan<2,T>> lhs_blocks = tilize(A);
-        Tensor<TSpan<2,T>> rhs_blocks = tilize(B);
-        Tensor<TSpan<2,T>> res_blocks = tilize(dest);
-
-        auto lhs_blocks_spn = lhs_blocks.template as_tspan<2>();
-        auto rhs_blocks_spn = rhs_blocks.template as_tspan<2>();
-        auto res_blocks_spn = res_blocks.template as_tspan<2>();
-
-        //Now iterate over all blocks of the output and calculate the 
-        //matrix product 
-        for (int i = 0; i < res_blocks_spn.dims[0]; i++) {
-            for (int j = 0; j < res_blocks_spn.dims[1]; j++) {
-                for (int k = 0; k < lhs_blocks_spn.dims[1]; k++) {
-                    tensormul(lhs_blocks_spn[i][k], rhs_blocks_spn[k][j], res_blocks_spn[i][j]);
-                }
-            }
-        }
+		gemm_batched(
+			A.dims[0], A.dims[1], B.dims[1], A.dims[2],
+			A.data, A.strides[0], A.strides[1], A.strides[2],
+			B.data, 0, B.strides[0], B.strides[1],
+			const_cast<T*>(dest.data), dest.strides[0], dest.strides[1], dest.strides[2]
+		);
+	}
+}
+
+//C = alpha * op(A) * op(B) + beta * C, where op(X) is X or X^T depending on
+//the flag. This is the BLAS gemm, except everything is a TSpan so any
+//strides work. Unlike tensormul, beta = 0 overwrites C instead of adding to
+//it, and beta = 1 accumulates (e.g. summing gradients in place).
+template <typename T>
+void tensorgemm(
+	bool transA, bool transB,
+	T alpha, TSpan<2, T> const& A, TSpan<2, T> const& B,
+	T beta, TSpan<2, T> C
+) {
+	TSpan<2, T> a = transA ? A.transpose() : A;
+	TSpan<2, T> b = transB ? B.transpose() : B;
+	assert(a.dims[1] == b.dims[0]);
+	assert(C.dims[0] == a.dims[0]);
+	assert(C.dims[1] == b.dims[1]);
+
+	gemm(
+		a.dims[0], b.dims[1], a.dims[1],
+		alpha,
+		a.data, a.strides[0], a.strides[1],
+		b.data, b.strides[0], b.strides[1],
+		beta,
+		const_cast<T*>(C.data), C.strides[0], C.strides[1]
+	);
+}
+
+//Batched matrix multiply: dest[i] += A[i] * B[i] for every i along the first
+//axis, so [batch x M x K] times [batch x K x N] gives [batch x M x N]. (This
+//is not what tensormul does with two rank-3 tensors; that contracts A's
+//last axis with B's first and gives a rank-4 result.) Passing a rank-2 B
+//uses the same B for every batch entry. Lots of small products get spread
+//over the thread pool, one batch entry per task.
+//
+//Like tensormul, this accumulates into dest.
+template <typename T>
+void tensorbmm(TSpan<3, T> const& A, TSpan<3, T> const& B, TSpan<3, T> dest) {
+	assert(A.dims[0] == B.dims[0]);
+	assert(A.dims[2] == B.dims[1]);
+	assert(dest.dims[0] == A.dims[0]);
+	assert(dest.dims[1] == A.dims[1]);
+	assert(dest.dims[2] == B.dims[2]);
+
+	if constexpr (!std::is_arithmetic<T>::value) {
+		for (int i = 0; i < A.dims[0]; i++) {
+			tensormul(A[i], B[i], dest[i]);
+		}
+	} else {
+		gemm_batched(
+			A.dims[0], A.dims[1], B.dims[2], A.dims[2],
+			A.data, A.strides[0], A.strides[1], A.strides[2],
+			B.data, B.strides[0], B.strides[1], B.strides[2],
+			const_cast<T*>(dest.data), dest.strides[0], dest.strides[1], dest.strides[2]
+		);
+	}
+}
+
+template <typename T>
+void tensorbmm(TSpan<3, T> const& A, TSpan<2, T> const& B, TSpan<3, T> dest) {
+	tensormul(A, B, dest);
+}
+
+template <int RHS_rank, typename T>
+Tensor<T> tensorbmm(TSpan<3, T> const& A, TSpan<RHS_rank, T> const& B) {
+	static_assert(RHS_rank == 2 || RHS_rank == 3, "RHS of tensorbmm must be rank 2 or 3");
+	constexpr int b = RHS_rank - 2; //Skips B's batch axis, if it has one
+
+	if ((RHS_rank == 3 && A.dims[0] != B.dims[0]) || A.dims[2] != B.dims[b]) {
+		std::string msg = "Dimensions don't agree for tensorbmm. LHS dims = ";
+		std::string delim = "[";
+		for (int i = 0; i < 3; i++) {
+			msg += delim + std::to_string(A.dims[i]);
+			delim = ",";
+		}
 
-        //Phew!
+		delim = "], RHS dims = [";
+		for (int i = 0; i < RHS_rank; i++) {
+			msg += delim + std::to_string(B.dims[i]);
+			delim = ",";
+		}
+		throw std::runtime_error(msg + "]");
 	}
+
+	int ret_dims[3] = {A.dims[0], A.dims[1], B.dims[b + 1]};
+	Tensor<T> ret(ret_dims, 3);
+	tensorbmm(A, B, TSpan<3, T>(ret));
+	return ret;
 }
 
 template<int LHS_rank, int RHS_rank, typename T>
@@ -905,31 +942,282 @@ Tensor<T> tensormul(
     return ret;
 }
 
+//Mixed precision: 16-bit (bf16 or fp16) inputs, float output. The inputs
+//are widened to float while the GEMM packs them, so everything is
+//accumulated in float but A and B only ever get read from memory at half
+//the size. Accumulates into dest like the other tensormuls.
+template <typename S>
+std::enable_if_t<is_half<S>::value,
+void> tensormul(
+    TSpan<2, S> const& A, 
+    TSpan<2, S> const& B,
+    TSpan<2, float> dest
+) {
+    assert(A.dims[1] == B.dims[0]);
+    assert(dest.dims[0] == A.dims[0]);
+    assert(dest.dims[1] == B.dims[1]);
+
+	long work = long(A.dims[0]) * B.dims[1] * A.dims[1];
+	if (work <= GEMM_SMALL) {
+		for (int i = 0; i < A.dims[0]; i++) {
+			for (int j = 0; j < B.dims[1]; j++) {
+				float acc = dest[i][j];
+				for (int p = 0; p < A.dims[1]; p++) acc += float(A[i][p]) * float(B[p][j]);
+				dest[i][j] = acc;
+			}
+		}
+	} else {
+		gemm_accumulate(
+			A.dims[0], B.dims[1], A.dims[1],
+			A.data, A.strides[0], A.strides[1],
+			B.data, B.strides[0], B.strides[1],
+			const_cast<float*>(dest.data), dest.strides[0], dest.strides[1]
+		);
+	}
+}
+
+template <typename S>
+std::enable_if_t<is_half<S>::value,
+Tensor<float>> tensormul(TSpan<2, S> const& A, TSpan<2, S> const& B) {
+	if (A.dims[1] != B.dims[0]) {
+		throw std::runtime_error("Inner dimensions must agree. LHS dims = [" 
+			+ std::to_string(A.dims[0]) + "," + std::to_string(A.dims[1]) + "], RHS dims = ["
+			+ std::to_string(B.dims[0]) + "," + std::to_string(B.dims[1]) + "]");
+	}
+	int ret_dims[2] = {A.dims[0], B.dims[1]};
+	Tensor<float> ret(ret_dims, 2);
+	tensormul(A, B, ret.as_tspan<2>());
+	return ret;
+}
+
+//dest = src, converting the element type (e.g. float weights down to bf16,
+//or bf16 activations back up to float). Any strides.
+template <int rank, typename S, typename D>
+void tensorconvert(TSpan<rank, S> const& src, TSpan<rank, D> dest) {
+	static_assert(rank <= TENSOR_MAX_RANK, "Rank too big for tensorconvert");
+	assert(src.dims == dest.dims);
+	int const *strides[2] = {src.strides.data(), dest.strides.data()};
+	flat_layout<2> L;
+	collapse_layout(rank, src.dims.data(), strides, L);
+	flat_convert(L, 0, src.data, const_cast<D*>(dest.data));
+}
+
+template <typename D, int rank, typename S>
+Tensor<D> tensorconvert(TSpan<rank, S> const& src) {
+	Tensor<D> ret(src.dims.data(), rank);
+	tensorconvert(src, ret.template as_tspan<rank>());
+	return ret;
+}
+
+//Dense copy of src with its dimensions reordered (see TSpan::permute).
+//Goes through layout_gather, which transposes block by block instead of
+//striding through the source an element at a time.
+template <int rank, typename T>
+Tensor<T> tensorpermute(TSpan<rank, T> const& src, decltype(src.dims) const& perm) {
+	return Tensor<T>(src.permute(perm));
+}
+
+template <typename T>
+Tensor<T> tensorpermute(RTSpan<T> const& src, int const *perm) {
+	return Tensor<T>(src.permute(perm));
+}
+
+//////////
+//CONCAT//
+//////////
+//Two ways to use these:
+//
+//  - tensorconcat(axis, {a, b, ...}) allocates the result and fills it
+//  - tensorslices(dest, axis, {na, nb, ...}) hands back views of the pieces
+//    of a preallocated dest, so whatever produces a and b can write its
+//    result straight into place (e.g. an fc's ff into its slice of an RNN's
+//    [x, h] input). tensorconcat(axis, {...}, dest) notices parts that are
+//    already where they belong and doesn't copy them again.
+
+//Views of consecutive pieces of dest along axis, sizes[i] long each
+template <int rank, typename T>
+std::vector<TSpan<rank, T>> tensorslices(TSpan<rank, T> const& dest, int axis, std::initializer_list<int> sizes) {
+	std::vector<TSpan<rank, T>> ret;
+	int begin = 0;
+	for (int n : sizes) {
+		ret.push_back(dest.slice(axis, begin, n));
+		begin += n;
+	}
+	if (begin != dest.dims[axis]) {
+		throw std::runtime_error("tensorslices: sizes add up to " + std::to_string(begin)
+			+ " but the axis is " + std::to_string(dest.dims[axis]) + " long");
+	}
+	return ret;
+}
+
+template <int rank, typename T>
+void tensorconcat(int axis, std::initializer_list<TSpan<rank, T>> parts, TSpan<rank, T> dest) {
+	assert(axis >= 0 && axis < rank);
+	int begin = 0;
+	for (auto const& p : parts) {
+		for (int i = 0; i < rank; i++) {
+			if (i != axis && p.dims[i] != dest.dims[i]) {
+				throw std::runtime_error("tensorconcat: parts don't match along dimension " + std::to_string(i));
+			}
+		}
+		begin += p.dims[axis];
+	}
+	if (begin != dest.dims[axis]) throw std::runtime_error("tensorconcat: parts don't add up to dest");
+
+	auto in_place = [&](TSpan<rank, T> const& p, TSpan<rank, T> const& slot) {
+		return p.data == slot.data && p.strides == slot.strides;
+	};
+
+	//Everything dense: one pass with layout_concat. Each part's row is its
+	//block from axis on in, and there are (product of dims before axis) rows
+	long outer = 1;
+	for (int i = 0; i < axis; i++) outer *= dest.dims[i];
+	long inner = 1;
+	for (int i = axis + 1; i < rank; i++) inner *= dest.dims[i];
+
+	//(Past 64 parts we just don't bother with the fused version)
+	bool dense = contiguous_size(rank, dest.dims.data(), dest.strides.data()) >= 0
+		&& parts.size() <= 64;
+	for (auto const& p : parts) dense = dense && contiguous_size(rank, p.dims.data(), p.strides.data()) >= 0;
+
+	if (dense) {
+		T const *srcs[64];
+		long lens[64];
+		int n = 0;
+		begin = 0;
+		for (auto const& p : parts) {
+			srcs[n] = in_place(p, dest.slice(axis, begin, p.dims[axis])) ? nullptr : p.data;
+			lens[n] = p.dims[axis] * inner;
+			begin += p.dims[axis];
+			n++;
+		}
+		layout_concat(outer, n, srcs, lens, const_cast<T*>(dest.data));
+		return;
+	}
+
+	begin = 0;
+	for (auto const& p : parts) {
+		auto slot = dest.slice(axis, begin, p.dims[axis]);
+		if (!in_place(p, slot)) p.deep_copy_to(slot);
+		begin += p.dims[axis];
+	}
+}
+
+template <int rank, typename T>
+Tensor<T> tensorconcat(int axis, std::initializer_list<TSpan<rank, T>> parts) {
+	assert(parts.size() > 0);
+	std::array<int, rank> dims = parts.begin()->dims;
+	dims[axis] = 0;
+	for (auto const& p : parts) dims[axis] += p.dims[axis];
+	Tensor<T> ret(dims.data(), rank);
+	tensorconcat(axis, parts, ret.template as_tspan<rank>());
+	return ret;
+}
+
+//NumPy-style broadcasting. Dimensions line up from the right; wherever src
+//has size 1 (or doesn't have the dimension at all) it gets stretched to
+//the target size with a stride of 0, so the view costs nothing. Throws if
+//the shapes aren't compatible. Writes the rank target strides into out.
+inline void broadcast_strides(
+	int src_rank, int const *src_dims, int const *src_strides,
+	int rank, int const *dims, int *out
+) {
+	bool ok = (src_rank <= rank);
+	for (int i = 0; ok && i < rank; i++) {
+		int j = i - (rank - src_rank);
+		if (j < 0) {
+			out[i] = 0;
+		} else if (src_dims[j] == dims[i]) {
+			out[i] = (dims[i] == 1) ? 0 : src_strides[j];
+		} else if (src_dims[j] == 1) {
+			out[i] = 0;
+		} else {
+			ok = false;
+		}
+	}
+	if (!ok) {
+		std::string msg = "Cannot broadcast [";
+		for (int i = 0; i < src_rank; i++) msg += (i ? " x " : "") + std::to_string(src_dims[i]);
+		msg += "] to [";
+		for (int i = 0; i < rank; i++) msg += (i ? " x " : "") + std::to_string(dims[i]);
+		throw std::runtime_error(msg + "]");
+	}
+}
+
+//View of src stretched to the shape of ref. e.g. a [N] bias against a
+//[B x N] batch, or a [B x 1] row max against [B x N]. Don't write through
+//the result, since the stretched elements all share storage.
+template <int rank, int src_rank, typename T>
+TSpan<rank, T> broadcast_to(TSpan<src_rank, T> const& src, TSpan<rank, T> const& ref) {
+	TSpan<rank, T> ret;
+	ret.data = src.data;
+	ret.dims = ref.dims;
+	broadcast_strides(src_rank, src.dims.data(), src.strides.data(),
+		rank, ref.dims.data(), ret.strides.data());
+	return ret;
+}
+
+template <typename T>
+RTSpan<T> broadcast_to(RTSpan<T> const& src, RTSpan<T> const& ref) {
+	RTSpan<T> ret(src.data, ref.rank, ref.dims.data(), ref.strides.data());
+	broadcast_strides(src.rank, src.dims.data(), src.strides.data(),
+		ref.rank, ref.dims.data(), ret.strides.data());
+	return ret;
+}
+
 //This specifically does NOT just directly index the underlying
-//data pointer in the TSpan. This has to support proper striding
+//data pointer in the TSpan. This has to support proper striding.
+//(Unless everything happens to be unit-stride floats, in which case we 
+//hand the row to the SIMD kernels in simd.h)
 template <int rank, typename fn, typename T>
 std::enable_if_t<rank == 1,
-void> tensorunary(TSpan<rank, T> const t, TSpan<rank, T> dest, fn F) {
-	assert(t.dims[0] == dest.dims[0]);
+void> tensorunary(TSpan<rank, T> const src, TSpan<rank, T> dest, fn F) {
+	auto t = broadcast_to(src, dest);
+	if constexpr (std::is_same<T, float>::value) {
+		if (t.strides[0] == 1 && dest.strides[0] == 1) {
+			simd_map(t.data, const_cast<float*>(dest.data), t.dims[0], F);
+			return;
+		}
+	}
 	for (int i = 0; i < t.dims[0]; i++)
 		dest[i] = F(t[i]);
 }
 
 template <int rank, typename fn, typename T>
 std::enable_if_t<(rank > 1),
-void> tensorunary(TSpan<rank, T> const t, TSpan<rank, T> dest, fn F) {
-	assert(t.dims[0] == dest.dims[0]);
+void> tensorunary(TSpan<rank, T> const src, TSpan<rank, T> dest, fn F) {
+	auto t = broadcast_to(src, dest);
+	if (layout_unary(
+			rank, t.dims.data(), t.data, t.strides.data(), 
+			const_cast<T*>(dest.data), dest.strides.data(), F
+		))
+		return;
+
 	for (int i = 0; i < t.dims[0]; i++)
 		tensorunary<rank - 1, fn, T>(t[i], dest[i], F);
 }
 
+//Lower-rank source, broadcast up to dest
+template <int rank, int src_rank, typename fn, typename T>
+std::enable_if_t<(src_rank < rank),
+void> tensorunary(TSpan<src_rank, T> const src, TSpan<rank, T> dest, fn F) {
+	tensorunary<rank, fn, T>(broadcast_to(src, dest), dest, F);
+}
+
 //The dest TSpan can safely alias either (or both) of the 
-//inputs
+//inputs. The inputs get broadcast to dest's shape (see broadcast_to), so
+//e.g. a [N] or [1 x N] rhs works against a [B x N] lhs and dest.
 template <int rank, typename fn, typename T>
 std::enable_if_t<rank == 1, 
-void> tensoreltwise(TSpan<rank,T> const lhs, TSpan<rank,T> const rhs, TSpan<rank,T> dest, fn F) {
-	assert(lhs.dims[0] == rhs.dims[0]);
-	assert(lhs.dims[0] == dest.dims[0]);
+void> tensoreltwise(TSpan<rank,T> const lhs_in, TSpan<rank,T> const rhs_in, TSpan<rank,T> dest, fn F) {
+	auto lhs = broadcast_to(lhs_in, dest);
+	auto rhs = broadcast_to(rhs_in, dest);
+	if constexpr (std::is_same<T, float>::value) {
+		if (lhs.strides[0] == 1 && rhs.strides[0] == 1 && dest.strides[0] == 1) {
+			simd_map(lhs.data, rhs.data, const_cast<float*>(dest.data), lhs.dims[0], F);
+			return;
+		}
+	}
 	for (int i = 0; i < lhs.dims[0]; i++) {
 		dest[i] = F(lhs[i], rhs[i]);
 	}
@@ -937,24 +1225,48 @@ void> tensoreltwise(TSpan<rank,T> const lhs, TSpan<rank,T> const rhs, TSpan<rank
 
 template <int rank, typename fn, typename T>
 std::enable_if_t<(rank > 1), 
-void> tensoreltwise(TSpan<rank,T> const lhs, TSpan<rank,T> const rhs, TSpan<rank,T> dest, fn F) {
-	assert(lhs.dims[0] == rhs.dims[0]);
-	assert(lhs.dims[0] == dest.dims[0]);
+void> tensoreltwise(TSpan<rank,T> const lhs_in, TSpan<rank,T> const rhs_in, TSpan<rank,T> dest, fn F) {
+	auto lhs = broadcast_to(lhs_in, dest);
+	auto rhs = broadcast_to(rhs_in, dest);
+	if (layout_binary(
+			rank, lhs.dims.data(), lhs.data, lhs.strides.data(), rhs.data, rhs.strides.data(),
+			const_cast<T*>(dest.data), dest.strides.data(), F
+		))
+		return;
+
 	for (int i = 0; i < lhs.dims[0]; i++) {
         auto dest_i = dest[i];
 		tensoreltwise<rank - 1, fn, T>(lhs[i], rhs[i], dest_i, F);
 	}
 }
 
+//Mixed ranks, e.g. [B x N] + [N]
+template <int rank, int lrank, int rrank, typename fn, typename T>
+std::enable_if_t<(lrank <= rank && rrank <= rank && (lrank < rank || rrank < rank)),
+void> tensoreltwise(TSpan<lrank,T> const lhs, TSpan<rrank,T> const rhs, TSpan<rank,T> dest, fn F) {
+	tensoreltwise<rank, fn, T>(broadcast_to(lhs, dest), broadcast_to(rhs, dest), dest, F);
+}
+
 template <typename fn, typename T>
-void tensoreltwise(RTSpan<T> const lhs, RTSpan<T> const rhs, RTSpan<T> dest, fn F) {
-	assert(lhs.rank == rhs.rank);
-	assert(lhs.rank > 0); //Are we allowed to have rank 0?
-	assert(lhs.dims[0] == rhs.dims[0]);
-	assert(lhs.dims[0] == dest.dims[0]);
+void tensoreltwise(RTSpan<T> const lhs_in, RTSpan<T> const rhs_in, RTSpan<T> dest, fn F) {
+	assert(dest.rank > 0); //Are we allowed to have rank 0?
+	auto lhs = broadcast_to(lhs_in, dest);
+	auto rhs = broadcast_to(rhs_in, dest);
+
+	if (layout_binary(
+			lhs.rank, lhs.dims.data(), lhs.data, lhs.strides.data(), rhs.data, rhs.strides.data(),
+			const_cast<T*>(dest.data), dest.strides.data(), F
+		))
+		return;
 
 	if (lhs.rank == 1) {
 		//Base case 
+		if constexpr (std::is_same<T, float>::value) {
+			if (lhs.strides[0] == 1 && rhs.strides[0] == 1 && dest.strides[0] == 1) {
+				simd_map(lhs.data, rhs.data, const_cast<float*>(dest.data), lhs.dims[0], F);
+				return;
+			}
+		}
 		for (int i = 0; i < lhs.dims[0]; i++) {
 			*dest[i] = F(*lhs[i], *rhs[i]);
 		}
@@ -980,33 +1292,148 @@ void tensorprod(TSpan<rank,T> const lhs, TSpan<rank,T> const rhs, TSpan<rank,T>
 	tensoreltwise(lhs, rhs, dest, std::multiplies<T>{});
 }
 
-template <int rank, typename T>
+template <typename T>
 void tensorprod(RTSpan<T> const lhs, RTSpan<T> const rhs, RTSpan<T> dest) {
 	tensoreltwise(lhs, rhs, dest, std::multiplies<T>{});
 }
 
+//y += alpha*x
 template <int rank, typename T>
-Tensor<T> operator+(TSpan<rank,T> const lhs, TSpan<rank,T> const rhs) {
-	assert(std::equal(lhs.dims,lhs.dims+rank,rhs.dims));
+void tensoraxpy(T alpha, TSpan<rank,T> const x, TSpan<rank,T> y) {
+	assert(x.dims[0] == y.dims[0]);
+	if constexpr (rank == 1) {
+		if constexpr (std::is_same<T, float>::value) {
+			if (x.strides[0] == 1 && y.strides[0] == 1) {
+				simd().axpy(alpha, x.data, const_cast<float*>(y.data), x.dims[0]);
+				return;
+			}
+		}
+		for (int i = 0; i < x.dims[0]; i++) y[i] += alpha * x[i];
+	} else {
+		for (int i = 0; i < x.dims[0]; i++) tensoraxpy(alpha, x[i], y[i]);
+	}
+}
+
+//dest = alpha*x. dest may alias x.
+template <int rank, typename T>
+void tensorscale(T alpha, TSpan<rank,T> const x, TSpan<rank,T> dest) {
+	assert(x.dims[0] == dest.dims[0]);
+	if constexpr (rank == 1) {
+		if constexpr (std::is_same<T, float>::value) {
+			if (x.strides[0] == 1 && dest.strides[0] == 1) {
+				simd().scale(alpha, x.data, const_cast<float*>(dest.data), x.dims[0]);
+				return;
+			}
+		}
+		for (int i = 0; i < x.dims[0]; i++) dest[i] = alpha * x[i];
+	} else {
+		for (int i = 0; i < x.dims[0]; i++) tensorscale(alpha, x[i], dest[i]);
+	}
+}
+
+//////////////
+//REDUCTIONS//
+//////////////
+//See reduce.h for how the traversal gets picked. argmax writes out indices
+//(converted to whatever type dest holds).
 
-	Tensor<T> ret(lhs.dims, rank);
-	tensorplus(lhs, rhs, ret.template as_tspan<rank>());
+//Drops the reduced axis: dest has src's dims minus dims[axis]
+template <int rank, typename T, typename U>
+std::enable_if_t<(rank > 1),
+void> tensorreduce(reduce_op op, TSpan<rank,T> const src, int axis, TSpan<rank-1,U> dest) {
+	int dst_strides[rank];
+	for (int i = 0, j = 0; i < rank; i++) {
+		if (i == axis) {
+			dst_strides[i] = 0;
+		} else {
+			assert(dest.dims[j] == src.dims[i]);
+			dst_strides[i] = dest.strides[j++];
+		}
+	}
+	reduce_axis(op, rank, src.dims.data(), src.data, src.strides.data(), axis,
+		const_cast<U*>(dest.data), dst_strides);
+}
+
+//keepdims: dest has the same rank as src, with dims[axis] == 1
+template <int rank, typename T, typename U>
+void tensorreduce(reduce_op op, TSpan<rank,T> const src, int axis, TSpan<rank,U> dest) {
+	assert(dest.dims[axis] == 1);
+	for (int i = 0; i < rank; i++) assert(i == axis || dest.dims[i] == src.dims[i]);
+	reduce_axis(op, rank, src.dims.data(), src.data, src.strides.data(), axis,
+		const_cast<U*>(dest.data), dest.strides.data());
+}
+
+//Allocating version. For argmax the indices come back as T
+template <int rank, typename T>
+Tensor<T> tensorreduce(reduce_op op, TSpan<rank,T> const src, int axis, bool keepdims = false) {
+	int dims[rank];
+	int out_rank = 0;
+	for (int i = 0; i < rank; i++) {
+		if (i != axis) dims[out_rank++] = src.dims[i];
+		else if (keepdims) dims[out_rank++] = 1;
+	}
+	//Reducing a vector without keepdims still gives back one element
+	if (out_rank == 0) dims[out_rank++] = 1;
+
+	Tensor<T> ret(dims, out_rank);
+	int dst_strides[rank];
+	for (int i = 0, j = 0; i < rank; i++) {
+		if (i == axis && !keepdims) dst_strides[i] = 0;
+		else dst_strides[i] = ret.strides[j++];
+	}
+	reduce_axis(op, rank, src.dims.data(), src.data, src.strides.data(), axis,
+		ret.storage.data(), dst_strides);
 	return ret;
 }
 
-//This is pretty rudimentary, but it's enough to do some interesting
-//things.
+//Everything down to one value (argmax gives the row-major index)
+template <int rank, typename T>
+T tensorreduce(reduce_op op, TSpan<rank,T> const src) {
+	return reduce_all(op, rank, src.dims.data(), src.data, src.strides.data());
+}
+
+template <typename T>
+T tensorreduce(reduce_op op, RTSpan<T> const src) {
+	return reduce_all(op, src.rank, src.dims.data(), src.data, src.strides.data());
+}
+
+//Sum of F(lhs, rhs) over every element, without a temporary for F's
+//results. lhs and rhs must have the same shape
+template <typename T, typename fn>
+T tensorreduce_binary(RTSpan<T> const lhs, RTSpan<T> const rhs, fn F) {
+	if (lhs.rank != rhs.rank || !std::equal(lhs.dims.begin(), lhs.dims.begin() + lhs.rank, rhs.dims.begin())) {
+		throw std::runtime_error("tensorreduce_binary needs two tensors of the same shape");
+	}
+	return reduce_all_binary(lhs.rank, lhs.dims.data(), lhs.data, lhs.strides.data(),
+		rhs.data, rhs.strides.data(), F);
+}
+
+//dest.rank is either src.rank - 1 or src.rank (keepdims)
+template <typename T, typename U>
+void tensorreduce(reduce_op op, RTSpan<T> const src, int axis, RTSpan<U> dest) {
+	int dst_strides[TENSOR_MAX_RANK];
+	if (src.rank > TENSOR_MAX_RANK) throw std::runtime_error("Rank too big for tensorreduce");
+	bool keepdims = (dest.rank == src.rank);
+	assert(keepdims || dest.rank == src.rank - 1);
+	for (int i = 0, j = 0; i < src.rank; i++) {
+		if (i == axis && !keepdims) dst_strides[i] = 0;
+		else dst_strides[i] = dest.strides[j++];
+	}
+	reduce_axis(op, src.rank, src.dims.data(), src.data, src.strides.data(), axis,
+		const_cast<U*>(dest.data), dst_strides);
+}
+
+//Special case of broadcast_to for a bare pointer
 template <int rank, typename T>
 TSpan<rank, T> broadcast_scalar_to(T *scalar, TSpan<rank, T> const &ref_sz) {
-	int *new_dims = new int[rank];
-	std::copy(ref_sz.dims, ref_sz.dims+rank, new_dims);
-	int *new_strides = new int[rank];
-	for (int i = 0; i < rank; i++) new_strides[i] = 0;
-
-	return TSpan<rank,T>(
-		scalar, new_dims, new_strides, 
-		new RCTSpanData(new_dims, new_strides)
-	);
+	TSpan<rank, T> ret;
+	ret.data = scalar;
+	ret.dims = ref_sz.dims;
+	ret.strides.fill(0);
+	return ret;
 }
 
+//operator+ and friends on TSpans build lazy expressions; see tensor_expr.h
+#include "tensor_expr.h"
+
 #endif
\ No newline at end of file
@@ -0,0 +1,430 @@
+#ifndef TENSOR_ALLOC_H
+#define TENSOR_ALLOC_H 1
+
+//Where Tensor storage comes from. Every Tensor's storage goes through
+//tensor_allocator<T>, which forwards to a pair of runtime hooks. The default
+//hooks guarantee 64-byte alignment (so a row start never splits a cache
+//line and the SIMD kernels get aligned data), and back big buffers with
+//huge pages:
+//
+//  - Below huge_threshold bytes: aligned operator new
+//  - At or above it: an anonymous mmap, with MAP_HUGETLB if use_hugetlb is
+//    set (falls back if the system has no huge pages reserved), otherwise
+//    madvise(MADV_HUGEPAGE) to ask for transparent huge pages
+//
+//If you want something else entirely, install your own hooks with
+//set_tensor_allocator_hooks(). Do that before creating any Tensors: memory
+//is always handed back to whatever hooks are installed at the time.
+//
+//Short-lived tensors can skip all of that and come from a per-step arena
+//instead; see PER-STEP ARENAS below.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#define TENSOR_ALLOC_HAVE_MMAP 1
+#endif
+
+#define TENSOR_ALIGNMENT 64
+
+struct tensor_alloc_config {
+	//Buffers this big or bigger get mmapped and huge-paged. 2MB is one x86
+	//huge page; anything smaller can't use one anyway.
+	size_t huge_threshold = size_t(2) << 20;
+	bool use_hugetlb = false; //Needs pages reserved in /proc/sys/vm/nr_hugepages
+	bool madvise_huge = true; //Transparent huge pages
+};
+
+inline tensor_alloc_config& tensor_alloc_settings() {
+	static tensor_alloc_config cfg = [] {
+		tensor_alloc_config c;
+		if (std::getenv("TENSORCOPTER_HUGETLB")) c.use_hugetlb = true;
+		return c;
+	}();
+	return cfg;
+}
+
+struct tensor_allocator_hooks {
+	void* (*allocate)(size_t bytes);
+	void (*deallocate)(void *p, size_t bytes);
+};
+
+//The default hooks put a small header in front of each block saying how it
+//was allocated, so freeing doesn't depend on the settings staying the same.
+//The header is TENSOR_ALIGNMENT bytes so the payload stays aligned.
+struct tensor_block_header {
+	enum kind_t : uint32_t { heap, mapped } kind;
+	size_t mapped_len;
+};
+static_assert(sizeof(tensor_block_header) <= TENSOR_ALIGNMENT, "Header must fit in the alignment padding");
+
+inline void* tensor_default_allocate(size_t bytes) {
+	size_t total = bytes + TENSOR_ALIGNMENT;
+	tensor_alloc_config const& cfg = tensor_alloc_settings();
+	char *base = nullptr;
+	tensor_block_header hdr = {tensor_block_header::heap, 0};
+
+#ifdef TENSOR_ALLOC_HAVE_MMAP
+	if (total >= cfg.huge_threshold) {
+		size_t const huge = size_t(2) << 20;
+		size_t len = (total + huge - 1) / huge * huge;
+		void *p = MAP_FAILED;
+	#ifdef MAP_HUGETLB
+		if (cfg.use_hugetlb) {
+			p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+			         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		}
+	#endif
+		if (p == MAP_FAILED) {
+			p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	#ifdef MADV_HUGEPAGE
+			if (p != MAP_FAILED && cfg.madvise_huge) madvise(p, len, MADV_HUGEPAGE);
+	#endif
+		}
+		if (p == MAP_FAILED) throw std::bad_alloc();
+		base = static_cast<char*>(p);
+		hdr = {tensor_block_header::mapped, len};
+	}
+#else
+	(void) cfg;
+#endif
+
+	if (!base) {
+		base = static_cast<char*>(::operator new(total, std::align_val_t(TENSOR_ALIGNMENT)));
+	}
+
+	*reinterpret_cast<tensor_block_header*>(base) = hdr;
+	return base + TENSOR_ALIGNMENT;
+}
+
+inline void tensor_default_deallocate(void *p, size_t) {
+	if (!p) return;
+	char *base = static_cast<char*>(p) - TENSOR_ALIGNMENT;
+	tensor_block_header hdr = *reinterpret_cast<tensor_block_header*>(base);
+#ifdef TENSOR_ALLOC_HAVE_MMAP
+	if (hdr.kind == tensor_block_header::mapped) {
+		munmap(base, hdr.mapped_len);
+		return;
+	}
+#endif
+	::operator delete(base, std::align_val_t(TENSOR_ALIGNMENT));
+}
+
+inline tensor_allocator_hooks& tensor_allocator_hooks_ref() {
+	static tensor_allocator_hooks hooks = {tensor_default_allocate, tensor_default_deallocate};
+	return hooks;
+}
+
+inline void set_tensor_allocator_hooks(tensor_allocator_hooks h) {
+	tensor_allocator_hooks_ref() = h;
+}
+
+////////////////////
+//ALLOCATION STATS//
+////////////////////
+//Build with -DTENSOR_ALLOC_STATS (or `make stats`) to count every
+//allocation that goes through tensor_allocator: how many, how many bytes,
+//how many bytes are live right now and the most that have ever been live
+//at once. That covers Tensor storage, dims and strides, and anything else
+//kept in a tensor_vector. Without the flag none of this exists, and the
+//allocator has no extra code in it at all.
+//
+//Allocations are attributed to whatever tag is current on the thread.
+//TENSOR_ALLOC_TAG(tag) opens a tag for the rest of the enclosing block;
+//tags nest, so an fc layer's optimizer allocating during backprop shows up
+//as "bp/fc_0/optimizer". Anything on a thread with no tag open (including
+//thread pool workers) is "(untagged)". The tag expression isn't evaluated
+//when the stats are compiled out.
+//
+//Per-tag counts are kept for the current step only: tensor_alloc_begin_step()
+//clears them, and tensor_alloc_report() prints the step and the per-tag
+//breakdown, biggest first. Arena allocations count as freed when the arena
+//is reset. Every translation unit has to be built with the same setting.
+
+#ifdef TENSOR_ALLOC_STATS
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+
+struct tensor_alloc_counters {
+	long allocs = 0;
+	long frees = 0;
+	size_t bytes = 0; //Total handed out, not what's live
+};
+
+struct tensor_alloc_stats {
+	std::mutex mtx;
+	tensor_alloc_counters total;
+	tensor_alloc_counters step;
+	size_t live = 0;
+	size_t peak = 0;      //Since the program started
+	size_t step_peak = 0; //Since tensor_alloc_begin_step()
+	std::map<std::string, tensor_alloc_counters> by_tag; //This step
+};
+
+inline tensor_alloc_stats& tensor_alloc_stats_instance() {
+	static tensor_alloc_stats ret;
+	return ret;
+}
+
+inline std::string& tensor_alloc_current_tag() {
+	static thread_local std::string tag;
+	return tag;
+}
+
+struct tensor_alloc_tag_scope {
+	size_t prev_len;
+
+	explicit tensor_alloc_tag_scope(std::string const& tag) 
+		: prev_len(tensor_alloc_current_tag().size())
+	{
+		std::string& cur = tensor_alloc_current_tag();
+		if (!cur.empty()) cur += '/';
+		cur += tag;
+	}
+
+	~tensor_alloc_tag_scope() { tensor_alloc_current_tag().resize(prev_len); }
+
+	tensor_alloc_tag_scope(tensor_alloc_tag_scope const&) = delete;
+	tensor_alloc_tag_scope& operator=(tensor_alloc_tag_scope const&) = delete;
+};
+
+inline void tensor_alloc_record(size_t bytes) {
+	std::string const& tag = tensor_alloc_current_tag();
+	tensor_alloc_stats& s = tensor_alloc_stats_instance();
+	std::lock_guard<std::mutex> lk(s.mtx);
+	s.total.allocs++;
+	s.total.bytes += bytes;
+	s.step.allocs++;
+	s.step.bytes += bytes;
+	s.live += bytes;
+	s.peak = std::max(s.peak, s.live);
+	s.step_peak = std::max(s.step_peak, s.live);
+
+	tensor_alloc_counters& t = s.by_tag[tag.empty() ? "(untagged)" : tag];
+	t.allocs++;
+	t.bytes += bytes;
+}
+
+inline void tensor_alloc_record_free(size_t bytes, long count = 1) {
+	tensor_alloc_stats& s = tensor_alloc_stats_instance();
+	std::lock_guard<std::mutex> lk(s.mtx);
+	s.total.frees += count;
+	s.step.frees += count;
+	s.live -= bytes;
+}
+
+inline void tensor_alloc_begin_step() {
+	tensor_alloc_stats& s = tensor_alloc_stats_instance();
+	std::lock_guard<std::mutex> lk(s.mtx);
+	s.step = tensor_alloc_counters();
+	s.step_peak = s.live;
+	s.by_tag.clear();
+}
+
+inline void tensor_alloc_report(std::ostream& o, std::string const& title = "Step") {
+	tensor_alloc_stats& s = tensor_alloc_stats_instance();
+	std::lock_guard<std::mutex> lk(s.mtx);
+	o << title << ": " << s.step.allocs << " allocations, " << s.step.bytes << " bytes, "
+	  << s.step.frees << " frees. Live " << s.live << " bytes, peak " << s.step_peak 
+	  << " this step, " << s.peak << " overall\n";
+
+	std::vector<std::pair<std::string, tensor_alloc_counters>> tags(s.by_tag.begin(), s.by_tag.end());
+	std::sort(tags.begin(), tags.end(), [](auto const& a, auto const& b) {
+		return a.second.bytes > b.second.bytes;
+	});
+	for (auto const& t : tags) {
+		o << "    " << t.first << ": " << t.second.allocs << " allocations, " 
+		  << t.second.bytes << " bytes\n";
+	}
+}
+
+#define TENSOR_ALLOC_CAT2(a, b) a##b
+#define TENSOR_ALLOC_CAT(a, b) TENSOR_ALLOC_CAT2(a, b)
+#define TENSOR_ALLOC_TAG(tag) \
+	tensor_alloc_tag_scope TENSOR_ALLOC_CAT(tensor_alloc_tag_, __LINE__)(tag)
+#else
+#define TENSOR_ALLOC_TAG(tag)
+#endif
+
+///////////////////
+//PER-STEP ARENAS//
+///////////////////
+//A training step makes the same few dozen temporaries every time (layer
+//outputs, gradients, jacobians, optimizer updates...). Instead of going to
+//malloc for each of them, open a tensor_arena_scope: every Tensor created on
+//this thread while it's open bumps a pointer in the arena, freeing is a
+//no-op, and reset() takes the whole lot back at once. Chunks are kept
+//across resets, so once the arena has seen one full step it never needs to
+//ask for memory again.
+//
+//The catch: anything allocated inside the scope dies at the next reset().
+//If you're creating state that has to outlive the step (optimizer
+//accumulators, caches...) wrap it in a tensor_arena_pause.
+
+#ifndef TENSOR_ARENA_CHUNK
+#define TENSOR_ARENA_CHUNK (size_t(1) << 20)
+#endif
+
+struct tensor_arena {
+	struct chunk {
+		char *base;
+		size_t size;
+	};
+
+	std::vector<chunk> chunks;
+	size_t cur = 0; //Chunk we're bumping in
+	size_t offset = 0;
+#ifdef TENSOR_ALLOC_STATS
+	size_t stats_live = 0; //Handed out since the last reset
+	long stats_count = 0;
+#endif
+
+	tensor_arena() = default;
+	tensor_arena(tensor_arena const&) = delete;
+	tensor_arena& operator=(tensor_arena const&) = delete;
+
+	void* allocate(size_t bytes) {
+		bytes = (bytes + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT * TENSOR_ALIGNMENT;
+		if (bytes == 0) bytes = TENSOR_ALIGNMENT;
+
+		for (; cur < chunks.size(); cur++, offset = 0) {
+			if (offset + bytes <= chunks[cur].size) {
+				void *ret = chunks[cur].base + offset;
+				offset += bytes;
+				return ret;
+			}
+		}
+
+		//Out of room. Grow geometrically so we settle down after a step or two
+		size_t sz = chunks.empty() ? TENSOR_ARENA_CHUNK : 2*chunks.back().size;
+		if (sz < bytes) sz = bytes;
+		char *base = static_cast<char*>(tensor_allocator_hooks_ref().allocate(sz));
+		chunks.push_back({base, sz});
+		cur = chunks.size() - 1;
+		offset = bytes;
+		return base;
+	}
+
+	//O(1): everything handed out so far is fair game again
+	void reset() {
+		cur = 0;
+		offset = 0;
+#ifdef TENSOR_ALLOC_STATS
+		tensor_alloc_record_free(stats_live, stats_count);
+		stats_live = 0;
+		stats_count = 0;
+#endif
+	}
+
+	size_t capacity() const {
+		size_t ret = 0;
+		for (chunk const& c : chunks) ret += c.size;
+		return ret;
+	}
+
+	~tensor_arena() {
+		for (chunk const& c : chunks) tensor_allocator_hooks_ref().deallocate(c.base, c.size);
+	}
+};
+
+//Every thread gets its own arena, so worker threads can use them without
+//any locking
+inline tensor_arena& tensor_thread_arena() {
+	static thread_local tensor_arena arena;
+	return arena;
+}
+
+//Arena new Tensors on this thread should come from, or nullptr for the
+//regular hooks
+inline tensor_arena*& tensor_current_arena() {
+	static thread_local tensor_arena *cur = nullptr;
+	return cur;
+}
+
+struct tensor_arena_scope {
+	tensor_arena *prev;
+
+	explicit tensor_arena_scope(tensor_arena& a = tensor_thread_arena()) 
+		: prev(tensor_current_arena())
+	{
+		tensor_current_arena() = &a;
+	}
+
+	~tensor_arena_scope() { tensor_current_arena() = prev; }
+
+	tensor_arena_scope(tensor_arena_scope const&) = delete;
+	tensor_arena_scope& operator=(tensor_arena_scope const&) = delete;
+};
+
+//Temporarily go back to the regular allocator inside an arena scope
+struct tensor_arena_pause {
+	tensor_arena *prev;
+
+	tensor_arena_pause() : prev(tensor_current_arena()) { tensor_current_arena() = nullptr; }
+	~tensor_arena_pause() { tensor_current_arena() = prev; }
+
+	tensor_arena_pause(tensor_arena_pause const&) = delete;
+	tensor_arena_pause& operator=(tensor_arena_pause const&) = delete;
+};
+
+//Standard-library-compatible allocator so Tensor can keep using std::vector.
+//It remembers which arena (if any) was current when it was made, and moves
+//along with the vector, so a buffer always goes back where it came from.
+template <typename T>
+struct tensor_allocator {
+	using value_type = T;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	tensor_arena *arena;
+
+	tensor_allocator() : arena(tensor_current_arena()) {}
+	template <typename U>
+	tensor_allocator(tensor_allocator<U> const& other) : arena(other.arena) {}
+
+	//Copies go wherever new allocations are going right now, not wherever
+	//the original came from
+	tensor_allocator select_on_container_copy_construction() const {
+		return tensor_allocator();
+	}
+
+	T* allocate(size_t n) {
+#ifdef TENSOR_ALLOC_STATS
+		tensor_alloc_record(n * sizeof(T));
+		if (arena) {
+			arena->stats_live += n * sizeof(T);
+			arena->stats_count++;
+		}
+#endif
+		if (arena) return static_cast<T*>(arena->allocate(n * sizeof(T)));
+		return static_cast<T*>(tensor_allocator_hooks_ref().allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t n) {
+		if (arena) return; //Given back all at once by reset()
+#ifdef TENSOR_ALLOC_STATS
+		tensor_alloc_record_free(n * sizeof(T));
+#endif
+		tensor_allocator_hooks_ref().deallocate(p, n * sizeof(T));
+	}
+
+	template <typename U>
+	bool operator==(tensor_allocator<U> const& other) const { return arena == other.arena; }
+	template <typename U>
+	bool operator!=(tensor_allocator<U> const& other) const { return arena != other.arena; }
+};
+
+template <typename T>
+using tensor_vector = std::vector<T, tensor_allocator<T>>;
+
+#endif
@@ -0,0 +1,296 @@
+#ifndef TENSOR_EXPR_H
+#define TENSOR_EXPR_H 1
+
+//Lazy elementwise arithmetic on TSpans. Writing
+//
+//    auto e = a*x + b*y;
+//
+//doesn't compute anything, it just builds a little tree of nodes holding
+//copies of the views and scalars. Nothing happens until you evaluate it:
+//
+//    tensoreval(e, dest);          //Writes into an existing view
+//    Tensor<float> t = a*x + b*y;  //Allocates and evaluates
+//
+//Evaluation is one pass over memory no matter how big the expression is.
+//All the operands and the destination go through collapse_layout together
+//(see layout.h), and when the innermost loop is unit-stride float the
+//whole expression becomes the body of one simd_generate loop.
+//
+//The nodes hold views by value, so it's fine to build an expression out of
+//temporaries. Just don't let the expression outlive the Tensors it points
+//at. dest may appear in the expression (e.g. tensoreval(beta*m + g, m)) as
+//long as it's the same view, not a shifted or transposed one.
+//
+//This file is included at the bottom of tensor.h; don't include it on its
+//own.
+
+template <typename derived>
+struct tensor_expr {
+	derived const& self() const { return static_cast<derived const&>(*this); }
+
+	//(derived is still incomplete in here, hence the dummy template
+	//parameter to put off looking at it)
+	template <typename D = derived>
+	Tensor<typename D::value_type> eval() const {
+		constexpr int rank = D::rank;
+		auto dims = self().dims();
+		Tensor<typename D::value_type> ret(dims.data(), rank);
+		tensoreval(self(), ret.template as_tspan<rank>());
+		return ret;
+	}
+
+	template <typename T>
+	operator Tensor<T>() const { return eval(); }
+};
+
+//////////
+//LEAVES//
+//////////
+//Every node knows how many views are underneath it (num_leaves). When we
+//evaluate, each view gets a slot K in an array of row pointers, and at<K>
+//reads element i of whatever the current row is.
+
+template <int rank_, typename T>
+struct expr_span : tensor_expr<expr_span<rank_, T>> {
+	using value_type = T;
+	static constexpr int rank = rank_;
+	static constexpr int num_leaves = 1;
+
+	TSpan<rank, T> s;
+
+	expr_span(TSpan<rank, T> const& s) : s(s) {}
+
+	std::array<int, rank> const& dims() const { return s.dims; }
+
+	void leaves(T const **ptrs, int const **strides) const {
+		ptrs[0] = s.data;
+		strides[0] = s.strides.data();
+	}
+
+	template <int K>
+	T at(T const *const *ptrs, long i) const { return ptrs[K][i]; }
+};
+
+template <typename T>
+struct expr_scalar : tensor_expr<expr_scalar<T>> {
+	using value_type = T;
+	static constexpr int rank = 0; //Takes the shape of whatever it's next to
+	static constexpr int num_leaves = 0;
+
+	T val;
+
+	expr_scalar(T val) : val(val) {}
+
+	void leaves(T const **, int const **) const {}
+
+	template <int K>
+	T at(T const *const *, long) const { return val; }
+};
+
+/////////
+//NODES//
+/////////
+
+template <typename E, typename op>
+struct expr_unary : tensor_expr<expr_unary<E, op>> {
+	using value_type = typename E::value_type;
+	static constexpr int rank = E::rank;
+	static constexpr int num_leaves = E::num_leaves;
+
+	E e;
+	op F;
+
+	expr_unary(E const& e, op F) : e(e), F(F) {}
+
+	auto dims() const { return e.dims(); }
+
+	void leaves(value_type const **ptrs, int const **strides) const {
+		e.leaves(ptrs, strides);
+	}
+
+	template <int K>
+	value_type at(value_type const *const *ptrs, long i) const {
+		return F(e.template at<K>(ptrs, i));
+	}
+};
+
+template <typename L, typename R, typename op>
+struct expr_binary : tensor_expr<expr_binary<L, R, op>> {
+	static_assert(std::is_same<typename L::value_type, typename R::value_type>::value,
+		"Both sides of a tensor expression need the same element type");
+	static_assert(L::rank == R::rank || L::rank == 0 || R::rank == 0,
+		"Both sides of a tensor expression need the same rank");
+
+	using value_type = typename L::value_type;
+	static constexpr int rank = (L::rank > R::rank) ? L::rank : R::rank;
+	static constexpr int num_leaves = L::num_leaves + R::num_leaves;
+
+	L l;
+	R r;
+	op F;
+
+	expr_binary(L const& l, R const& r, op F) : l(l), r(r), F(F) {
+		if constexpr (L::rank != 0 && R::rank != 0) {
+			assert(l.dims() == r.dims());
+		}
+	}
+
+	auto dims() const {
+		if constexpr (L::rank != 0) return l.dims();
+		else return r.dims();
+	}
+
+	void leaves(value_type const **ptrs, int const **strides) const {
+		l.leaves(ptrs, strides);
+		r.leaves(ptrs + L::num_leaves, strides + L::num_leaves);
+	}
+
+	template <int K>
+	value_type at(value_type const *const *ptrs, long i) const {
+		return F(l.template at<K>(ptrs, i), r.template at<K + L::num_leaves>(ptrs, i));
+	}
+};
+
+//////////////
+//EVALUATION//
+//////////////
+
+//ptrs[k] is the start of the current row of leaf k. d is the (collapsed)
+//dimension we're iterating over.
+template <int N, typename E, typename T>
+void expr_flat_eval(flat_layout<N> const& L, int d, E const& e, T const *const *ptrs, T *dst) {
+	constexpr int M = N - 1; //Leaves; the last slot in L is dest
+	int n = L.dims[d];
+	int ds = L.strides[M][d];
+
+	if (d < L.rank - 1) {
+		T const *sub[M];
+		for (int i = 0; i < n; i++) {
+			for (int k = 0; k < M; k++) sub[k] = ptrs[k] + (long) i * L.strides[k][d];
+			expr_flat_eval(L, d + 1, e, sub, dst + (long) i * ds);
+		}
+		return;
+	}
+
+	bool unit = (ds == 1);
+	for (int k = 0; k < M; k++) unit = unit && (L.strides[k][d] == 1);
+
+	if constexpr (std::is_same<T, float>::value) {
+		if (unit) {
+			simd_generate(dst, n, [&](size_t i) { return e.template at<0>(ptrs, i); });
+			return;
+		}
+	}
+
+	//Strided: walk a cursor per leaf and always read element 0
+	T const *cur[M];
+	for (int k = 0; k < M; k++) cur[k] = ptrs[k];
+	for (int i = 0; i < n; i++) {
+		dst[(long) i * ds] = e.template at<0>(cur, 0);
+		for (int k = 0; k < M; k++) cur[k] += L.strides[k][d];
+	}
+}
+
+template <typename E, int rank, typename T>
+void tensoreval(tensor_expr<E> const& expr, TSpan<rank, T> dest) {
+	E const& e = expr.self();
+	static_assert(E::rank == rank, "Expression rank doesn't match destination");
+	static_assert(E::num_leaves > 0, "Expression has no tensors in it");
+	static_assert(rank <= TENSOR_MAX_RANK, "Rank too big for tensoreval");
+	assert(e.dims() == dest.dims);
+
+	constexpr int N = E::num_leaves + 1;
+	T const *ptrs[N];
+	int const *strides[N];
+	e.leaves(ptrs, strides);
+	strides[N - 1] = dest.strides.data();
+
+	flat_layout<N> L;
+	collapse_layout(rank, dest.dims.data(), strides, L);
+	expr_flat_eval(L, 0, e, ptrs, const_cast<T*>(dest.data));
+}
+
+/////////////
+//OPERATORS//
+/////////////
+//Anything that's a TSpan or an expression node can go on either side. A
+//plain number on one side gets converted to the element type of the other.
+
+template <typename X>
+struct is_expr_operand : std::is_base_of<tensor_expr<X>, X> {};
+
+template <int rank, typename T>
+struct is_expr_operand<TSpan<rank, T>> : std::true_type {};
+
+template <typename E>
+E const& as_expr(tensor_expr<E> const& e) { return e.self(); }
+
+template <int rank, typename T>
+expr_span<rank, T> as_expr(TSpan<rank, T> const& s) { return expr_span<rank, T>(s); }
+
+template <typename X>
+using expr_of = std::decay_t<decltype(as_expr(std::declval<X>()))>;
+
+struct expr_negate {
+	template <typename T>
+	T operator()(T x) const { return -x; }
+};
+
+//The fused loop only vectorizes this if the compiler doesn't have to keep
+//errno up to date for sqrt of a negative number, so the Makefile builds
+//with -fno-math-errno. Without it every element is a scalar sqrt (about
+//3.5x slower for Adam's update).
+struct expr_sqrt {
+	template <typename T>
+	T operator()(T x) const { return std::sqrt(x); }
+};
+
+#define TENSOR_EXPR_BINOP(sym, functor)                                                  \
+template <typename L, typename R,                                                        \
+          typename = std::enable_if_t<is_expr_operand<L>::value && is_expr_operand<R>::value>> \
+auto operator sym(L const& l, R const& r) {                                              \
+	return expr_binary<expr_of<L>, expr_of<R>, functor>(as_expr(l), as_expr(r), functor{}); \
+}                                                                                        \
+                                                                                         \
+template <typename L, typename S,                                                        \
+          typename = std::enable_if_t<is_expr_operand<L>::value && std::is_arithmetic<S>::value>> \
+auto operator sym(L const& l, S s) {                                                     \
+	using T = typename expr_of<L>::value_type;                                           \
+	return expr_binary<expr_of<L>, expr_scalar<T>, functor>(                             \
+		as_expr(l), expr_scalar<T>(T(s)), functor{});                                    \
+}                                                                                        \
+                                                                                         \
+template <typename S, typename R,                                                        \
+          typename = std::enable_if_t<std::is_arithmetic<S>::value && is_expr_operand<R>::value>, \
+          typename = void>                                                               \
+auto operator sym(S s, R const& r) {                                                     \
+	using T = typename expr_of<R>::value_type;                                           \
+	return expr_binary<expr_scalar<T>, expr_of<R>, functor>(                             \
+		expr_scalar<T>(T(s)), as_expr(r), functor{});                                    \
+}
+
+TENSOR_EXPR_BINOP(+, std::plus<>)
+TENSOR_EXPR_BINOP(-, std::minus<>)
+TENSOR_EXPR_BINOP(*, std::multiplies<>)
+TENSOR_EXPR_BINOP(/, std::divides<>)
+
+#undef TENSOR_EXPR_BINOP
+
+template <typename X, typename = std::enable_if_t<is_expr_operand<X>::value>>
+auto operator-(X const& x) {
+	return expr_unary<expr_of<X>, expr_negate>(as_expr(x), expr_negate{});
+}
+
+template <typename X, typename = std::enable_if_t<is_expr_operand<X>::value>>
+auto tensorsqrt(X const& x) {
+	return expr_unary<expr_of<X>, expr_sqrt>(as_expr(x), expr_sqrt{});
+}
+
+//Lazy version of tensorunary: F gets applied elementwise when the
+//expression is evaluated
+template <typename X, typename fn, typename = std::enable_if_t<is_expr_operand<X>::value>>
+auto tensormap(X const& x, fn F) {
+	return expr_unary<expr_of<X>, fn>(as_expr(x), F);
+}
+
+#endif
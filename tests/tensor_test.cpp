@@ -1,7 +1,11 @@
 #include "../tensor.h"
+#include "../layers.h"
+#include "../activation_fns.h"
+#include "../optimizers.h"
 #include <random>
 #include <iostream>
 #include <exception>
+#include <thread>
 
 #define _STRINGIFY(x) #x
 #define STRINGIFY(x) _STRINGIFY(x)
@@ -70,6 +74,1056 @@ void test_transpose_index() {
     }
 }
 
+//Reference product: one dot product per output element, no packing
+void naive_matmul(MSpan<float> const A, MSpan<float> const B, MSpan<float> C) {
+	for (int i = 0; i < A.dims[0]; i++) {
+		for (int j = 0; j < B.dims[1]; j++) {
+			float acc = 0;
+			for (int k = 0; k < A.dims[1]; k++) acc += A[i][k] * B[k][j];
+			C[i][j] = acc;
+		}
+	}
+}
+
+bool close_enough(MSpan<float> const A, MSpan<float> const B, float tol) {
+	for (int i = 0; i < A.dims[0]; i++) {
+		for (int j = 0; j < A.dims[1]; j++) {
+			if (fabs(A[i][j] - B[i][j]) > tol) return false;
+		}
+	}
+	return true;
+}
+
+//Odd sizes so we hit the ragged edges of the micro-kernel and the 
+//cache blocks, and transposed operands so packing sees non-unit strides
+void gemm_matches_naive() {
+	static uint32_t seed = 1234;
+	Tensor<float> A = make_random_tensor<float>({67,301}, seed++);
+	Tensor<float> B = make_random_tensor<float>({301,45}, seed++);
+	Tensor<float> Bt = make_random_tensor<float>({45,301}, seed++);
+
+	Tensor<float> expected({67,45});
+	Tensor<float> got({67,45});
+	naive_matmul(A.as_tspan<2>(), B.as_tspan<2>(), expected.as_tspan<2>());
+	tensormul(A.as_tspan<2>(), B.as_tspan<2>(), got.as_tspan<2>());
+	OUR_ASSERT(close_enough(&got, &expected, 1e-4));
+
+	Tensor<float> expected2({67,45});
+	Tensor<float> got2_T({45,67});
+	MSpan<float> Bt_T = (&Bt).transpose();
+	naive_matmul(A.as_tspan<2>(), Bt_T, expected2.as_tspan<2>());
+	tensormul(A.as_tspan<2>(), Bt_T, got2_T.as_tspan<2>().transpose());
+	OUR_ASSERT(close_enough(got2_T.as_tspan<2>().transpose(), &expected2, 1e-4));
+}
+
+//Run the elementwise ops at every SIMD level the machine has, on a length
+//that leaves a ragged tail, and check them against plain loops
+void simd_eltwise_matches_scalar() {
+	static uint32_t seed = 99;
+	Tensor<float> a = make_random_tensor<float>({3,37}, seed++);
+	Tensor<float> b = make_random_tensor<float>({3,37}, seed++);
+	auto a_spn = a.as_tspan<2>();
+	auto b_spn = b.as_tspan<2>();
+
+	simd_level const levels[] = {
+		simd_level::scalar, simd_level::sse2, simd_level::avx2, simd_level::avx512
+	};
+	for (simd_level l : levels) {
+		set_simd_level(l);
+
+		Tensor<float> sum({3,37}), prod({3,37}), fused({3,37}), y(b), scaled({3,37});
+		tensorplus(a_spn, b_spn, sum.as_tspan<2>());
+		tensorprod(a_spn, b_spn, prod.as_tspan<2>());
+		tensoreltwise(a_spn, b_spn, fused.as_tspan<2>(), 
+			[](float x, float y) {return 0.5f*x - y*y;}
+		);
+		tensoraxpy(3.0f, a_spn, y.as_tspan<2>());
+		tensorscale(-2.0f, a_spn, scaled.as_tspan<2>());
+
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 37; j++) {
+				float x = a_spn[i][j], z = b_spn[i][j];
+				OUR_ASSERT(compare(sum.as_tspan<2>()[i][j], x + z));
+				OUR_ASSERT(compare(prod.as_tspan<2>()[i][j], x * z));
+				OUR_ASSERT(compare(fused.as_tspan<2>()[i][j], 0.5f*x - z*z));
+				OUR_ASSERT(compare(y.as_tspan<2>()[i][j], z + 3.0f*x));
+				OUR_ASSERT(compare(scaled.as_tspan<2>()[i][j], -2.0f*x));
+			}
+		}
+
+		//Horizontal and vertical reductions
+		float const *row = a_spn[1].data;
+		float sum_row = 0, max_row = -HUGE_VALF;
+		for (int j = 0; j < 37; j++) {
+			sum_row += row[j];
+			max_row = std::max(max_row, row[j]);
+		}
+		OUR_ASSERT(fabs(simd().sum(row, 37) - sum_row) < 1e-4);
+		OUR_ASSERT(simd().max(row, 37) == max_row);
+		float vmax[37];
+		simd().vmax(a_spn[0].data, b_spn[0].data, vmax, 37);
+		for (int j = 0; j < 37; j++) OUR_ASSERT(vmax[j] == std::max(a_spn[0][j], b_spn[0][j]));
+	}
+	set_simd_level(detect_simd_level());
+}
+
+//Dense tensors should collapse to one flat loop, real views should not,
+//and both should still give the right answer
+void layout_collapse() {
+	static uint32_t seed = 7;
+	Tensor<float> A = make_random_tensor<float>({4,5,6}, seed++);
+	auto A_spn = A.as_tspan<3>();
+	OUR_ASSERT(contiguous_size(3, A_spn.dims.data(), A_spn.strides.data()) == 4*5*6);
+
+	int const *strides[2] = {A_spn.strides.data(), A_spn.strides.data()};
+	flat_layout<2> L;
+	OUR_ASSERT(collapse_layout(3, A_spn.dims.data(), strides, L));
+	OUR_ASSERT(L.is_flat() && L.dims[0] == 120);
+
+	Tensor<float> M = make_random_tensor<float>({30,20}, seed++);
+	MSpan<float> M_T = (&M).transpose();
+	OUR_ASSERT(contiguous_size(2, M_T.dims.data(), M_T.strides.data()) == -1);
+
+	//Copy a transpose out and back in, and a submatrix into a dense tensor
+	Tensor<float> M_T_copy({20,30});
+	M_T.deep_copy_to(M_T_copy.as_tspan<2>());
+	OUR_ASSERT(M_T_copy.as_tspan<2>() == M_T);
+
+	MSpan<float> sub = M.as_tspan<2>().submat(3, 4, 10, 5);
+	Tensor<float> sub_copy({5,10});
+	sub.deep_copy_to(sub_copy.as_tspan<2>());
+	OUR_ASSERT(sub_copy.as_tspan<2>() == sub);
+
+	Tensor<float> doubled({20,30});
+	tensorunary(M_T, doubled.as_tspan<2>(), [](float f) {return 2*f;});
+	for (int i = 0; i < 20; i++) {
+		for (int j = 0; j < 30; j++) {
+			OUR_ASSERT(compare(doubled.as_tspan<2>()[i][j], 2*M_T[i][j]));
+		}
+	}
+}
+
+//deep_copy_to writes into its argument and leaves itself alone, for
+//RTSpans of every rank (rank 1 used to copy the other way round)
+void deep_copy_direction() {
+	static uint32_t seed = 4242;
+	Tensor<float> src = make_random_tensor<float>({6,9}, seed++);
+	Tensor<float> src_before(src.as_tspan<2>());
+	auto S = src.as_tspan<2>();
+
+	//Rank 1: a dense row and a strided column
+	Tensor<float> row({9}), col({6});
+	RTSpan<float>(S[2]).deep_copy_to(RTSpan<float>(&row));
+	RTSpan<float>((&src).transpose()[4]).deep_copy_to(RTSpan<float>(&col));
+	for (int j = 0; j < 9; j++) OUR_ASSERT(row.storage[j] == S[2][j]);
+	for (int i = 0; i < 6; i++) OUR_ASSERT(col.storage[i] == S[i][4]);
+
+	//Rank 2, into a transposed destination
+	Tensor<float> dst({9,6});
+	RTSpan<float>(S).deep_copy_to(RTSpan<float>((&dst).transpose()));
+	OUR_ASSERT(dst.as_tspan<2>().transpose() == S);
+
+	OUR_ASSERT(S == src_before.as_tspan<2>());
+}
+
+//Hand views of one shared tensor to several threads at once. Each thread 
+//makes its own transposes/submatrices (and copies of the views it was 
+//given) and the results have to match doing it all on one thread.
+void views_across_threads() {
+	static uint32_t seed = 555;
+	Tensor<float> A = make_random_tensor<float>({64,48}, seed++);
+	MSpan<float> const A_spn = A.as_tspan<2>();
+	RTSpan<float> const A_rt = &A;
+
+	int const nthreads = 4;
+	std::vector<Tensor<float>> results;
+	for (int t = 0; t < nthreads; t++) results.push_back(Tensor<float>({16,16}));
+
+	auto work = [&](int t, MSpan<float> my_A, RTSpan<float> my_A_rt, MSpan<float> out) {
+		for (int rep = 0; rep < 200; rep++) {
+			MSpan<float> block = my_A.submat(0, 16*t, 48, 16); //16 x 48
+			MSpan<float> block_rt = MSpan<float>(my_A_rt).submat(0, 16*t, 48, 16);
+			MSpan<float> copy = block_rt; //copies share nothing
+			tensorunary(out, out, [](float) {return 0.0f;});
+			tensormul(block, copy.transpose(), out);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nthreads; t++) {
+		threads.emplace_back(work, t, A_spn, A_rt, results[t].as_tspan<2>());
+	}
+	for (auto& th : threads) th.join();
+
+	for (int t = 0; t < nthreads; t++) {
+		Tensor<float> expected({16,16});
+		MSpan<float> block = A_spn.submat(0, 16*t, 48, 16);
+		naive_matmul(block, block.transpose(), expected.as_tspan<2>());
+		OUR_ASSERT(close_enough(&results[t], &expected, 1e-4));
+	}
+}
+
+void storage_is_aligned() {
+	//Small ones come from operator new, the big one (> 2MB) gets mmapped
+	int sizes[] = {1, 3, 17, 1000, 1 << 20};
+	for (int n : sizes) {
+		int dims[1] = {n};
+		Tensor<float> t(dims, 1);
+		OUR_ASSERT(reinterpret_cast<uintptr_t>(t.storage.data()) % TENSOR_ALIGNMENT == 0);
+		t.storage[n-1] = 2; //Make sure the whole thing is writable
+		OUR_ASSERT(t.storage[n-1] == 2 && t.storage[0] == (n == 1 ? 2 : 0));
+	}
+
+	std::vector<float> vals = {1, 2, 3, 4, 5, 6};
+	Tensor<float> copied(vals, std::vector<int>{2,3});
+	OUR_ASSERT(reinterpret_cast<uintptr_t>(copied.storage.data()) % TENSOR_ALIGNMENT == 0);
+	OUR_ASSERT(copied.as_tspan<2>()[1][2] == 6);
+}
+
+void arena_reuses_memory() {
+	tensor_arena arena;
+	float *first;
+	{
+		tensor_arena_scope scope(arena);
+		Tensor<float> a({32, 32});
+		Tensor<float> b(a); //Copies made in the scope come from the arena too
+		first = a.storage.data();
+		OUR_ASSERT(a.storage.get_allocator().arena == &arena);
+		OUR_ASSERT(b.storage.get_allocator().arena == &arena);
+		OUR_ASSERT(reinterpret_cast<uintptr_t>(b.storage.data()) % TENSOR_ALIGNMENT == 0);
+
+		tensor_arena_pause p;
+		Tensor<float> c({4});
+		OUR_ASSERT(c.storage.get_allocator().arena == nullptr);
+	}
+	size_t cap = arena.capacity();
+
+	//Same sequence of allocations after a reset lands in the same place
+	//and doesn't grow the arena
+	arena.reset();
+	{
+		tensor_arena_scope scope(arena);
+		Tensor<float> a({32, 32});
+		Tensor<float> b(a);
+		OUR_ASSERT(a.storage.data() == first);
+		OUR_ASSERT(arena.capacity() == cap);
+	}
+
+	//Outside the scope we're back on the heap, and each thread has its own
+	Tensor<float> d({4});
+	OUR_ASSERT(d.storage.get_allocator().arena == nullptr);
+	tensor_arena *main_arena = &tensor_thread_arena();
+	tensor_arena *other_arena = nullptr;
+	std::thread([&]{ other_arena = &tensor_thread_arena(); }).join();
+	OUR_ASSERT(main_arena != other_arena);
+}
+
+void expr_matches_loops() {
+	static uint32_t seed = 777;
+	int M = 1 + rand() % 40, N = 1 + rand() % 40;
+	Tensor<float> x = make_random_tensor<float>({M, N}, seed++);
+	Tensor<float> y = make_random_tensor<float>({M, N}, seed++);
+	Tensor<float> yT = make_random_tensor<float>({N, M}, seed++);
+	MSpan<float> xs = x.as_tspan<2>(), ys = y.as_tspan<2>();
+	MSpan<float> yTs = yT.as_tspan<2>().transpose(); //Forces the strided path
+
+	//Copy-constructing from an expression evaluates it
+	Tensor<float> sum = xs + ys;
+	Tensor<float> fancy = 2.0f*xs - ys/4 + yTs*xs;
+	for (int i = 0; i < M; i++) {
+		for (int j = 0; j < N; j++) {
+			float x_ = xs[i][j], y_ = ys[i][j], yT_ = yTs[i][j];
+			OUR_ASSERT(sum.as_tspan<2>()[i][j] == x_ + y_);
+			OUR_ASSERT(fabs(fancy.as_tspan<2>()[i][j] - (2*x_ - y_/4 + yT_*x_)) < 1e-5);
+		}
+	}
+
+	//dest can be one of the operands
+	Tensor<float> before(xs);
+	tensoreval(0.5f*xs + tensorsqrt(ys*ys), xs);
+	for (int i = 0; i < M; i++) {
+		for (int j = 0; j < N; j++) {
+			float expected = 0.5f*before.as_tspan<2>()[i][j] + fabs(ys[i][j]);
+			OUR_ASSERT(fabs(xs[i][j] - expected) < 1e-5);
+		}
+	}
+
+	//Writing into a strided destination
+	tensoreval(-tensormap(ys, [](float v) { return v + 1; }), yTs);
+	for (int i = 0; i < M; i++)
+		for (int j = 0; j < N; j++)
+			OUR_ASSERT(yTs[i][j] == -(ys[i][j] + 1));
+}
+
+//Force a few threads even on a small machine, and use sizes that leave
+//ragged tiles in both directions
+void parallel_gemm_matches_naive() {
+	static uint32_t seed = 4321;
+	int old_threads = tensor_num_threads();
+	set_tensor_num_threads(4);
+
+	int dims[][3] = {{200, 150, 300}, {32, 600, 784}, {97, 33, 65}};
+	for (auto& d : dims) {
+		Tensor<float> A = make_random_tensor<float>({d[0], d[2]}, seed++);
+		Tensor<float> B = make_random_tensor<float>({d[2], d[1]}, seed++);
+		Tensor<float> expected({d[0], d[1]});
+		Tensor<float> got({d[0], d[1]});
+		naive_matmul(A.as_tspan<2>(), B.as_tspan<2>(), expected.as_tspan<2>());
+		tensormul(A.as_tspan<2>(), B.as_tspan<2>(), got.as_tspan<2>());
+		OUR_ASSERT(close_enough(&got, &expected, 1e-3));
+	}
+
+	//Every index gets visited exactly once
+	std::vector<int> hits(1000, 0);
+	parallel_for(0, 1000, [&](int i) { hits[i]++; });
+	OUR_ASSERT(std::count(hits.begin(), hits.end(), 1) == 1000);
+
+	set_tensor_num_threads(old_threads);
+}
+
+//Every op along every axis of a 3D tensor, on a dense tensor and on a
+//permuted view of one (to hit both the horizontal and vertical paths)
+void reduce_matches_loops() {
+	static uint32_t seed = 2468;
+	int D0 = 1 + rand() % 7, D1 = 1 + rand() % 40, D2 = 1 + rand() % 300;
+	Tensor<float> t = make_random_tensor<float>({D0, D1, D2}, seed++);
+	TSpan<3,float> dense = t.as_tspan<3>();
+	TSpan<3,float> flipped = dense; //dims are {D0, D2, D1}
+	std::swap(flipped.dims[1], flipped.dims[2]);
+	std::swap(flipped.strides[1], flipped.strides[2]);
+
+	reduce_op const ops[] = {reduce_op::sum, reduce_op::max, reduce_op::mean, reduce_op::argmax};
+	for (TSpan<3,float> src : {dense, flipped}) {
+		for (int axis = 0; axis < 3; axis++) {
+			for (reduce_op op : ops) {
+				Tensor<float> got = tensorreduce(op, src, axis, true);
+				TSpan<3,float> g = got.as_tspan<3>();
+				int n = src.dims[axis];
+
+				int idx[3];
+				for (idx[0] = 0; idx[0] < g.dims[0]; idx[0]++)
+				for (idx[1] = 0; idx[1] < g.dims[1]; idx[1]++)
+				for (idx[2] = 0; idx[2] < g.dims[2]; idx[2]++) {
+					float sum = 0, mx = -HUGE_VALF;
+					int amax = 0;
+					for (int k = 0; k < n; k++) {
+						int j[3] = {idx[0], idx[1], idx[2]};
+						j[axis] = k;
+						float v = src[j[0]][j[1]][j[2]];
+						sum += v;
+						if (v > mx) { mx = v; amax = k; }
+					}
+					float expected = (op == reduce_op::sum) ? sum :
+					                 (op == reduce_op::max) ? mx :
+					                 (op == reduce_op::mean) ? sum / n : amax;
+					OUR_ASSERT(fabs(g[idx[0]][idx[1]][idx[2]] - expected) < 1e-3);
+				}
+			}
+		}
+
+		float total = 0;
+		for (int i = 0; i < D0; i++) for (int j = 0; j < src.dims[1]; j++) for (int k = 0; k < src.dims[2]; k++)
+			total += src[i][j][k];
+		OUR_ASSERT(fabs(tensorreduce(reduce_op::sum, src) - total) < 1e-2);
+	}
+
+	//Fused binary sums: both dense, then a permuted view against a dense
+	//tensor of the same shape
+	Tensor<float> u = make_random_tensor<float>({D0, D2, D1}, seed++);
+	TSpan<3,float> ud = u.as_tspan<3>();
+	float sumsq = 0, sqdiff = 0;
+	for (int i = 0; i < D0; i++) for (int j = 0; j < D2; j++) for (int k = 0; k < D1; k++) {
+		float v = flipped[i][j][k], diff = v - ud[i][j][k];
+		sumsq += v*v;
+		sqdiff += diff*diff;
+	}
+	float got_sumsq = tensorreduce_binary(dense.as_rtspan(), dense.as_rtspan(), std::multiplies<float>{});
+	float got_sqdiff = tensorreduce_binary(flipped.as_rtspan(), ud.as_rtspan(), [](float a, float b) {
+		return (a - b)*(a - b);
+	});
+	OUR_ASSERT(fabs(got_sumsq - sumsq) < 1e-4 * (1 + sumsq));
+	OUR_ASSERT(fabs(got_sqdiff - sqdiff) < 1e-4 * (1 + sqdiff));
+
+	//Whole-tensor argmax is a row-major index
+	t.storage[D0*D1*D2 / 2] = 1000;
+	OUR_ASSERT(tensorreduce(reduce_op::argmax, dense) == D0*D1*D2 / 2);
+
+	//Dropping the axis, with an int dest
+	Tensor<int> am({D0, D1});
+	tensorreduce(reduce_op::argmax, dense, 2, am.as_tspan<2>());
+	OUR_ASSERT(am.as_tspan<2>()[(D0*D1*D2/2) / (D1*D2)][((D0*D1*D2/2) / D2) % D1] == (D0*D1*D2/2) % D2);
+}
+
+//Per-sample, shared-B and tiny (softmax jacobian sized) batches, checked
+//one matrix at a time against naive_matmul
+void bmm_matches_naive() {
+	static uint32_t seed = 1357;
+	int old_threads = tensor_num_threads();
+	set_tensor_num_threads(4);
+
+	int dims[][4] = {{5, 40, 30, 50}, {64, 10, 1, 10}, {3, 100, 70, 90}, {1 + rand() % 20, 1 + rand() % 50, 1 + rand() % 50, 1 + rand() % 50}};
+	for (auto& d : dims) {
+		int b = d[0], m = d[1], n = d[2], k = d[3];
+		Tensor<float> A = make_random_tensor<float>({b, m, k}, seed++);
+		Tensor<float> B = make_random_tensor<float>({b, k, n}, seed++);
+		Tensor<float> B2 = make_random_tensor<float>({k, n}, seed++);
+		Tensor<float> got = tensorbmm(A.as_tspan<3>(), B.as_tspan<3>());
+		Tensor<float> got2 = tensorbmm(A.as_tspan<3>(), B2.as_tspan<2>());
+
+		Tensor<float> expected({m, n});
+		for (int i = 0; i < b; i++) {
+			naive_matmul(A.as_tspan<3>()[i], B.as_tspan<3>()[i], expected.as_tspan<2>());
+			OUR_ASSERT(close_enough(got.as_tspan<3>()[i], &expected, 1e-3));
+			naive_matmul(A.as_tspan<3>()[i], B2.as_tspan<2>(), expected.as_tspan<2>());
+			OUR_ASSERT(close_enough(got2.as_tspan<3>()[i], &expected, 1e-3));
+		}
+	}
+
+	bool threw = false;
+	try {
+		Tensor<float> A({2, 3, 4}), B({2, 5, 3});
+		tensorbmm(A.as_tspan<3>(), B.as_tspan<3>());
+	} catch (std::runtime_error const&) {
+		threw = true;
+	}
+	OUR_ASSERT(threw);
+
+	set_tensor_num_threads(old_threads);
+}
+
+//All four transpose combinations with alpha and beta, small and big enough
+//to hit the packed path
+void gemm_trans_alpha_beta() {
+	static uint32_t seed = 8642;
+	int sizes[][3] = {{7, 5, 3}, {70, 90, 130}, {1 + rand() % 100, 1 + rand() % 100, 1 + rand() % 100}};
+	for (auto& d : sizes) {
+		int m = d[0], n = d[1], k = d[2];
+		for (int ta = 0; ta < 2; ta++) for (int tb = 0; tb < 2; tb++) {
+			//Stored so that op(A) is m x k and op(B) is k x n
+			Tensor<float> A = ta ? make_random_tensor<float>({k, m}, seed++) : make_random_tensor<float>({m, k}, seed++);
+			Tensor<float> B = tb ? make_random_tensor<float>({n, k}, seed++) : make_random_tensor<float>({k, n}, seed++);
+			Tensor<float> C = make_random_tensor<float>({m, n}, seed++);
+			Tensor<float> C0(&C);
+
+			float alpha = 0.5f, beta = (ta + tb == 1) ? 0.0f : -2.0f;
+			tensorgemm(ta != 0, tb != 0, alpha, A.as_tspan<2>(), B.as_tspan<2>(), beta, C.as_tspan<2>());
+
+			MSpan<float> a = ta ? A.as_tspan<2>().transpose() : A.as_tspan<2>();
+			MSpan<float> b = tb ? B.as_tspan<2>().transpose() : B.as_tspan<2>();
+			Tensor<float> expected({m, n});
+			naive_matmul(a, b, expected.as_tspan<2>());
+			MSpan<float> e = expected.as_tspan<2>(), c0 = C0.as_tspan<2>();
+			for (int i = 0; i < m; i++) for (int j = 0; j < n; j++) {
+				e[i][j] = alpha*e[i][j] + beta*c0[i][j];
+			}
+			OUR_ASSERT(close_enough(&C, &expected, 1e-3));
+		}
+	}
+
+	//Pointer version, accumulating into C twice
+	float A[2*3] = {1, 2, 3, 4, 5, 6};  //2x3, used as A^T (3x2)
+	float B[2*2] = {1, 0, 0, 1};
+	float C[3*2] = {};
+	gemm(true, false, 3, 2, 2, 1.0f, A, 3, B, 2, 1.0f, C, 2);
+	gemm(true, false, 3, 2, 2, 1.0f, A, 3, B, 2, 1.0f, C, 2);
+	float want[3*2] = {2, 8, 4, 10, 6, 12};
+	OUR_ASSERT(std::equal(C, C + 6, want));
+}
+
+//Tensors built from views have to follow the view's strides, not just copy
+//whatever memory is under it
+void tensor_from_view() {
+	static uint32_t seed = 9753;
+	int R = 1 + rand() % 100, C = 1 + rand() % 100;
+	Tensor<float> M = make_random_tensor<float>({R, C}, seed++);
+	MSpan<float> m = &M;
+
+	Tensor<float> copy(m);
+	OUR_ASSERT(copy == M);
+
+	Tensor<float> T_copy(m.transpose());
+	OUR_ASSERT(T_copy.dims[0] == C && T_copy.dims[1] == R);
+	OUR_ASSERT(T_copy.strides[0] == R && T_copy.strides[1] == 1);
+	OUR_ASSERT(&T_copy == m.transpose());
+
+	int x0 = rand() % C, y0 = rand() % R;
+	MSpan<float> sub = m.submat(x0, y0, C - x0, R - y0);
+	Tensor<float> sub_copy(sub);
+	OUR_ASSERT(&sub_copy == sub);
+	Tensor<float> subT_copy(sub.transpose());
+	OUR_ASSERT(&subT_copy == sub.transpose());
+
+	//A permuted rank-3 view, through the RTSpan constructor
+	int D0 = 1 + rand() % 5;
+	Tensor<float> t = make_random_tensor<float>({D0, R, C}, seed++);
+	TSpan<3,float> p = t.as_tspan<3>();
+	std::swap(p.dims[0], p.dims[2]);
+	std::swap(p.strides[0], p.strides[2]);
+	RTSpan<float> p_rt = p;
+	Tensor<float> p_copy(p_rt);
+	TSpan<3,float> pc = p_copy.as_tspan<3>();
+	for (int i = 0; i < C; i++) for (int j = 0; j < R; j++) for (int k = 0; k < D0; k++) {
+		OUR_ASSERT(pc[i][j][k] == p[i][j][k]);
+	}
+}
+
+//Known encodings, rounding, the SIMD conversions against the scalar ones,
+//and the mixed-precision tensormul against a float one on the same values
+void half_types() {
+	static uint32_t seed = 1122;
+	OUR_ASSERT(bf16(1.0f).bits == 0x3f80);
+	OUR_ASSERT(bf16(1.0f + 1.0f/256).bits == 0x3f80); //Tie, rounds to even
+	OUR_ASSERT(bf16(1.0f + 3.0f/256).bits == 0x3f82); //Tie, rounds to even
+	OUR_ASSERT(std::isnan(float(bf16(NAN))));
+	OUR_ASSERT(fp16(1.0f).bits == 0x3c00);
+	OUR_ASSERT(fp16(65504.0f).bits == 0x7bff);
+	OUR_ASSERT(fp16(65520.0f).bits == 0x7c00); //Overflows to inf
+	OUR_ASSERT(fp16(-2.0f).bits == 0xc000);
+	OUR_ASSERT(fp16(5.9604645e-8f).bits == 0x0001); //Smallest subnormal
+	OUR_ASSERT(float(fp16::from_bits(0x0001)) == 5.9604645e-8f);
+	OUR_ASSERT(std::isnan(float(fp16(NAN))));
+	for (uint32_t b = 0; b < 0x10000; b++) {
+		fp16 h = fp16::from_bits(b);
+		if (!std::isnan(float(h))) OUR_ASSERT(fp16(float(h)).bits == b);
+	}
+
+	int n = 1 + rand() % 1000;
+	Tensor<float> x = make_random_tensor<float>({n}, seed++);
+	x.storage[0] = NAN;
+	x.storage[n / 2] = 1e-6f;
+	std::vector<bf16> b(n), b_ref(n);
+	std::vector<fp16> h(n), h_ref(n);
+	std::vector<float> back(n);
+	convert_n(x.storage.data(), b.data(), n);
+	convert_n(x.storage.data(), h.data(), n);
+	for (int i = 0; i < n; i++) {
+		b_ref[i] = bf16(x.storage[i]);
+		h_ref[i] = fp16(x.storage[i]);
+		OUR_ASSERT(i == 0 || b[i].bits == b_ref[i].bits);
+		OUR_ASSERT(i == 0 || h[i].bits == h_ref[i].bits);
+	}
+	OUR_ASSERT(std::isnan(float(b[0])) && std::isnan(float(h[0])));
+	convert_n(b.data(), back.data(), n);
+	for (int i = 1; i < n; i++) OUR_ASSERT(back[i] == float(b_ref[i]));
+	convert_n(h.data(), back.data(), n);
+	for (int i = 1; i < n; i++) OUR_ASSERT(back[i] == float(h_ref[i]));
+
+	int m = 1 + rand() % 80, k = 1 + rand() % 80, c = 1 + rand() % 80;
+	Tensor<float> A = make_random_tensor<float>({m, k}, seed++);
+	Tensor<float> B = make_random_tensor<float>({k, c}, seed++);
+	Tensor<bf16> A16 = tensorconvert<bf16>(A.as_tspan<2>());
+	Tensor<bf16> B16 = tensorconvert<bf16>(B.as_tspan<2>().transpose()); //Strided
+	Tensor<float> A_back = tensorconvert<float>(A16.as_tspan<2>());
+	Tensor<float> B_back({k, c});
+	tensorconvert(B16.as_tspan<2>().transpose(), B_back.as_tspan<2>());
+
+	Tensor<float> expected({m, c});
+	naive_matmul(&A_back, &B_back, expected.as_tspan<2>());
+	Tensor<float> got = tensormul(A16.as_tspan<2>(), B16.as_tspan<2>().transpose());
+	OUR_ASSERT(close_enough(&got, &expected, 1e-4));
+}
+
+//The int8 kernels all have to agree exactly (see the note about ranges in
+//quant.h), and a quantized fc should land close to the float one
+void quantized_fc_matches() {
+	static uint32_t seed = 3344;
+	int n = 1 + rand() % 70, k = 1 + rand() % 300;
+	int kp = QUANT_KALIGN * ((k + QUANT_KALIGN - 1) / QUANT_KALIGN);
+	std::vector<uint8_t> x(2 * kp);
+	std::vector<int8_t> w(n * kp);
+	std::mt19937 g(seed++);
+	for (int r = 0; r < 2; r++) for (int i = 0; i < k; i++) x[r*kp + i] = g() % (QUANT_X_MAX + 1);
+	for (int o = 0; o < n; o++) for (int i = 0; i < k; i++) w[o*kp + i] = int(g() % (2*QUANT_W_MAX + 1)) - QUANT_W_MAX;
+	std::vector<int32_t> ref(2 * n), got(2 * n);
+	quant_dot_rows_scalar(x.data(), 2, w.data(), n, kp, ref.data(), n);
+	//Call each kernel by name: quant_pick_kernel only ever hands back one of
+	//the SIMD ones, so going through it would leave the other untested
+	std::vector<quant_dot_rows_t> kernels = {quant_dot_rows_scalar};
+#ifdef SIMD_HAVE_X86
+	if (detect_simd_level() >= simd_level::avx2) {
+		kernels.push_back(quant_dot_rows_avx2);
+		if (quant_have_vnni()) kernels.push_back(quant_dot_rows_vnni);
+	}
+#endif
+	for (quant_dot_rows_t k : kernels) {
+		for (int mr : {1, 2}) {
+			std::fill(got.begin(), got.end(), 0);
+			k(x.data(), mr, w.data(), n, kp, got.data(), n);
+			OUR_ASSERT(std::equal(got.begin(), got.begin() + mr*n, ref.begin()));
+		}
+	}
+
+	int batch = 1 + rand() % 40, n_in = 1 + rand() % 200, n_out = 1 + rand() % 50;
+	auto f = std::make_unique<fc>(n_out, n_in, new sigmoid(), new GD<2>(0.1), new GD<1>(0.1));
+	Tensor<float> in = make_random_tensor<float>({batch, n_in}, seed++);
+	Tensor<float> expected = f->ff_alloc(&in);
+
+	std::vector<std::unique_ptr<layer>> layers;
+	layers.push_back(std::move(f));
+	quantize_layers(layers, &in);
+	OUR_ASSERT(dynamic_cast<quantized_fc*>(layers[0].get()));
+	Tensor<float> out = layers[0]->ff_alloc(&in);
+	OUR_ASSERT(close_enough(&out, &expected, 0.02));
+}
+
+//CSR products against the naive one, and an fc fed mostly-zero inputs (so
+//it takes the sparse path) against the same math done densely
+void sparse_fc_matches() {
+	static uint32_t seed = 4455;
+	int m = 1 + rand() % 40, k = 1 + rand() % 300, n = 1 + rand() % 60;
+	Tensor<float> x = make_random_tensor<float>({m, k}, seed++);
+	std::mt19937 g(seed++);
+	for (auto& v : x.storage) if (g() % 8) v = 0;
+	csr_matrix xs(x.storage.data(), m, k, k, 1);
+
+	Tensor<float> Bt = make_random_tensor<float>({n, k}, seed++);
+	MSpan<float> B = (&Bt).transpose(); //Strided, like W^T in fc
+	Tensor<float> expected({m, n}), got({m, n});
+	naive_matmul(&x, B, &expected);
+	csr_gemm(xs, n, 1.0f, B.data, B.strides[0], B.strides[1], 0.0f, got.storage.data(), n, 1);
+	OUR_ASSERT(close_enough(&got, &expected, 1e-4));
+
+	Tensor<float> D = make_random_tensor<float>({m, n}, seed++);
+	Tensor<float> expected_tn({k, n}), got_tn({n, k});
+	naive_matmul((&x).transpose(), &D, &expected_tn);
+	MSpan<float> got_tn_T = (&got_tn).transpose();
+	csr_gemm_tn(xs, n, 1.0f, D.storage.data(), n, 1, 0.0f, got_tn.storage.data(), got_tn_T.strides[0], got_tn_T.strides[1]);
+	OUR_ASSERT(close_enough(got_tn_T, &expected_tn, 1e-4));
+
+	float lr = 0.5f;
+	auto f = std::make_unique<fc>(n, k, new sigmoid(), new GD<2>(lr), new GD<1>(lr));
+	RTSpan<float> W_span(f->W);
+	Tensor<float> W_old(W_span);
+	sigmoid act;
+
+	Tensor<float> y_ref({m, n});
+	tensorgemm(false, true, 1.0f, x.as_tspan<2>(), W_old.as_tspan<2>(), 0.0f, y_ref.as_tspan<2>());
+	auto yr = y_ref.as_tspan<2>();
+	for (int i = 0; i < m; i++) for (int j = 0; j < n; j++) yr[i][j] = act(yr[i][j] + f->bias[j]);
+
+	Tensor<float> y = f->ff_alloc(&x, true);
+	OUR_ASSERT(close_enough(&y, &y_ref, 1e-5));
+	Tensor<float> y_csr({m, n});
+	f->ctr_ff(xs, y_csr.as_tspan<2>());
+	OUR_ASSERT(close_enough(&y_csr, &y_ref, 1e-5));
+
+	Tensor<float> dy = make_random_tensor<float>({m, n}, seed++);
+	Tensor<float> z2({m, n});
+	auto z2s = z2.as_tspan<2>(), dys = dy.as_tspan<2>(), ys = y.as_tspan<2>();
+	for (int i = 0; i < m; i++) for (int j = 0; j < n; j++) z2s[i][j] = dys[i][j] * act[ys[i][j]];
+	Tensor<float> dW({n, k}), dx_ref({m, k});
+	naive_matmul((&z2).transpose(), &x, &dW);
+	naive_matmul(&z2, &W_old, &dx_ref);
+
+	Tensor<float> dx = f->bp_alloc(&x, &y, &dy, true);
+	OUR_ASSERT(close_enough(&dx, &dx_ref, 1e-4));
+	auto Wo = W_old.as_tspan<2>(), dWs = dW.as_tspan<2>();
+	for (int i = 0; i < n; i++) for (int j = 0; j < k; j++) Wo[i][j] -= lr * dWs[i][j];
+	OUR_ASSERT(close_enough(f->W, &W_old, 1e-4));
+}
+
+//Permuted copies against plain index arithmetic, on odd sizes so the
+//transpose hits its ragged edges
+void permute_matches_index() {
+	static uint32_t seed = 5566;
+	int d0 = 1 + rand() % 40, d1 = 1 + rand() % 40, d2 = 1 + rand() % 40;
+	Tensor<float> A = make_random_tensor<float>({d0, d1, d2}, seed++);
+	auto a = A.as_tspan<3>();
+	std::array<int, 3> perm = {0, 1, 2};
+	std::shuffle(perm.begin(), perm.end(), std::mt19937(seed++));
+	Tensor<float> P = tensorpermute(a, perm);
+	auto p = P.as_tspan<3>();
+	for (int i = 0; i < p.dims[0]; i++) {
+		for (int j = 0; j < p.dims[1]; j++) {
+			for (int k = 0; k < p.dims[2]; k++) {
+				int idx[3];
+				idx[perm[0]] = i;
+				idx[perm[1]] = j;
+				idx[perm[2]] = k;
+				OUR_ASSERT(p[i][j][k] == a[idx[0]][idx[1]][idx[2]]);
+			}
+		}
+	}
+
+	//Big enough that layout_transpose has to split, at every SIMD level
+	int m = 100 + rand() % 200, n = 100 + rand() % 200;
+	Tensor<float> B = make_random_tensor<float>({m, n}, seed++);
+	for (simd_level l : {simd_level::scalar, simd_level::avx2}) {
+		set_simd_level(l);
+		Tensor<float> Bt = tensorpermute(B.as_tspan<2>(), {1, 0});
+		OUR_ASSERT(close_enough(&Bt, B.as_tspan<2>().transpose(), 0));
+	}
+	set_simd_level(detect_simd_level());
+
+	bool threw = false;
+	try {
+		a.permute({0, 2, 2});
+	} catch (std::runtime_error const&) {
+		threw = true;
+	}
+	OUR_ASSERT(threw);
+}
+
+//Concat along a random axis, dense (fused path) and with a strided part
+//(per-part copies), plus a part that was written into its slice in place
+void concat_matches_index() {
+	static uint32_t seed = 6677;
+	int axis = rand() % 3;
+	std::array<int, 3> da = {1 + rand() % 10, 1 + rand() % 10, 1 + rand() % 10};
+	std::array<int, 3> db = da;
+	db[axis] = 1 + rand() % 10;
+	Tensor<float> A = make_random_tensor<float>({da[0], da[1], da[2]}, seed++);
+	Tensor<float> B = make_random_tensor<float>({db[0], db[1], db[2]}, seed++);
+	Tensor<float> Bp = tensorpermute(B.as_tspan<3>(), {2, 1, 0});
+	auto a = A.as_tspan<3>();
+	auto b = B.as_tspan<3>();
+	auto b_strided = Bp.as_tspan<3>().permute({2, 1, 0}); //Same values as b
+
+	auto check = [&](TSpan<3, float> c) {
+		OUR_ASSERT(c.dims[axis] == da[axis] + db[axis]);
+		for (int i = 0; i < c.dims[0]; i++) {
+			for (int j = 0; j < c.dims[1]; j++) {
+				for (int k = 0; k < c.dims[2]; k++) {
+					int idx[3] = {i, j, k};
+					float expected;
+					if (idx[axis] < da[axis]) {
+						expected = a[i][j][k];
+					} else {
+						idx[axis] -= da[axis];
+						expected = b[idx[0]][idx[1]][idx[2]];
+					}
+					OUR_ASSERT(c[i][j][k] == expected);
+				}
+			}
+		}
+	};
+
+	Tensor<float> C = tensorconcat(axis, {a, b});
+	check(C.as_tspan<3>());
+	Tensor<float> C2 = tensorconcat(axis, {a, b_strided});
+	check(C2.as_tspan<3>());
+
+	Tensor<float> D(C.dims.data(), 3);
+	auto d = D.as_tspan<3>();
+	auto parts = tensorslices(d, axis, {da[axis], db[axis]});
+	a.deep_copy_to(parts[0]);
+	tensorconcat(axis, {parts[0], b}, d);
+	check(d);
+}
+
+void broadcast_matches_loops() {
+	static uint32_t seed = 7788;
+	int B = 1 + rand() % 20, N = 1 + rand() % 40;
+	Tensor<float> A = make_random_tensor<float>({B, N}, seed++);
+	Tensor<float> bias = make_random_tensor<float>({N}, seed++);
+	Tensor<float> col = make_random_tensor<float>({B, 1}, seed++);
+	Tensor<float> out = make_random_tensor<float>({B, N}, seed++);
+	auto a = A.as_tspan<2>();
+	auto b = bias.as_tspan<1>();
+	auto c = col.as_tspan<2>();
+	auto o = out.as_tspan<2>();
+
+	//[B x N] - [N]
+	tensoreltwise(a, b, o, std::minus<float>{});
+	for (int i = 0; i < B; i++) for (int j = 0; j < N; j++) {
+		OUR_ASSERT(o[i][j] == a[i][j] - b[j]);
+	}
+
+	//[B x 1] * [B x N], broadcast operand on the left
+	tensoreltwise(c, a, o, std::multiplies<float>{});
+	for (int i = 0; i < B; i++) for (int j = 0; j < N; j++) {
+		OUR_ASSERT(o[i][j] == c[i][0] * a[i][j]);
+	}
+
+	//Into a transposed dest, through RTSpans
+	Tensor<float> outT = make_random_tensor<float>({N, B}, seed++);
+	auto ot = outT.as_tspan<2>().transpose();
+	tensoreltwise(RTSpan<float>(a), RTSpan<float>(b), RTSpan<float>(ot), std::plus<float>{});
+	for (int i = 0; i < B; i++) for (int j = 0; j < N; j++) {
+		OUR_ASSERT(ot[i][j] == a[i][j] + b[j]);
+	}
+
+	//Stretching the bias down every row
+	tensorunary(b, o, [](float x) { return 2*x; });
+	for (int i = 0; i < B; i++) for (int j = 0; j < N; j++) {
+		OUR_ASSERT(o[i][j] == 2*b[j]);
+	}
+
+	auto bb = broadcast_to(b, a);
+	OUR_ASSERT(bb.strides[0] == 0 && bb.data == b.data);
+
+	bool threw = false;
+	Tensor<float> wrong = make_random_tensor<float>({N + 1}, seed++);
+	try {
+		broadcast_to(wrong.as_tspan<1>(), a);
+	} catch (std::runtime_error const&) {
+		threw = true;
+	}
+	OUR_ASSERT(threw);
+}
+
+void mapped_tensor_roundtrip() {
+	static uint32_t seed = 8899;
+	int r = 1 + rand() % 50, c = 1 + rand() % 50;
+	Tensor<float> A = make_random_tensor<float>({r, c}, seed++);
+	Tensor<float> B = make_random_tensor<float>({c}, seed++);
+	auto a = A.as_tspan<2>();
+	auto at = a.transpose(); //Saved dense
+	auto b = B.as_tspan<1>();
+
+	char path[] = "/tmp/tensor_test_XXXXXX";
+	int fd = mkstemp(path);
+	OUR_ASSERT(fd >= 0);
+	close(fd);
+
+	long off = tensor_save(path, RTSpan<float>(at));
+	long off_b = tensor_save(path, RTSpan<float>(b), true);
+	OUR_ASSERT(off == 0 && off_b % MAPPED_TENSOR_ALIGN == 0);
+
+	{
+		MappedTensor<float> mt(path, mapped_mode::read_only);
+		auto m = mt.as_tspan<2>();
+		OUR_ASSERT(m.dims == at.dims);
+		for (int i = 0; i < c; i++) for (int j = 0; j < r; j++) OUR_ASSERT(m[i][j] == at[i][j]);
+		OUR_ASSERT(mt.next_offset() == off_b);
+
+		MappedTensor<float> mb(path, mapped_mode::read_only, mt.next_offset());
+		for (int i = 0; i < c; i++) OUR_ASSERT(mb.as_tspan<1>()[i] == b[i]);
+
+		//Writes to a copy-on-write mapping stay private
+		MappedTensor<float> cow(path, mapped_mode::copy_on_write);
+		cow.data[0] = at[0][0] + 1;
+		OUR_ASSERT(m[0][0] == at[0][0]);
+
+		bool threw = false;
+		try {
+			MappedTensor<int32_t> wrong(path, mapped_mode::read_only);
+		} catch (std::runtime_error const&) {
+			threw = true;
+		}
+		OUR_ASSERT(threw);
+	}
+
+	//Corrupted headers get rejected, including a count so big that
+	//count * sizeof(float) wraps around
+	{
+		mapped_tensor_header hdr;
+		std::memset(&hdr, 0, sizeof(hdr));
+		std::memcpy(hdr.magic, mapped_tensor_magic(), sizeof(hdr.magic));
+		hdr.version = MAPPED_TENSOR_VERSION;
+		hdr.dtype = tensor_dtype<float>::code;
+		hdr.elem_size = sizeof(float);
+		hdr.rank = 1;
+		hdr.data_offset = MAPPED_TENSOR_ALIGN;
+		hdr.dims[0] = 1000;
+		hdr.strides[0] = 1;
+
+		uint64_t const counts[] = {1ull << 62, 1000, 3};
+		for (uint64_t count : counts) {
+			hdr.count = count;
+			std::vector<char> file(MAPPED_TENSOR_ALIGN + 64, 0);
+			std::memcpy(file.data(), &hdr, sizeof(hdr));
+			std::ofstream(path, std::ios::binary | std::ios::trunc).write(file.data(), file.size());
+
+			bool threw = false;
+			try {
+				MappedTensor<float> bad(path, mapped_mode::read_only);
+			} catch (std::runtime_error const&) {
+				threw = true;
+			}
+			OUR_ASSERT(threw);
+		}
+	}
+
+	//fc layer running off mapped parameters
+	int m = 1 + rand() % 10;
+	auto f = std::make_unique<fc>(r, c, new sigmoid(), new GD<2>(0.1f), new GD<1>(0.1f));
+	auto g = std::make_unique<fc>(r, c, new sigmoid(), new GD<2>(0.1f), new GD<1>(0.1f));
+	f->save_params(path);
+	g->map_params(path, mapped_mode::read_only);
+	Tensor<float> x = make_random_tensor<float>({m, c}, seed++);
+	Tensor<float> yf = f->ff_alloc(&x), yg = g->ff_alloc(&x);
+	OUR_ASSERT(close_enough(&yf, &yg, 0));
+
+	unlink(path);
+}
+
+void static_tensor_matches() {
+	static uint32_t seed = 9900;
+	std::mt19937 g(seed++);
+	std::uniform_real_distribution<float> dist(-1, 1);
+
+	StaticTensor<float, 4, 6> A, B, C;
+	StaticTensor<float, 6, 3> D;
+	StaticTensor<float, 4, 3> E;
+	for (auto& v : A.storage) v = dist(g);
+	for (auto& v : B.storage) v = dist(g);
+	for (auto& v : D.storage) v = dist(g);
+
+	tensoreltwise(A.span(), B.span(), C.span(), std::plus<float>{});
+	for (int i = 0; i < 4; i++) for (int j = 0; j < 6; j++) OUR_ASSERT(C[i][j] == A[i][j] + B[i][j]);
+	tensorunary(A.span(), C.span(), [](float x) { return 3*x; });
+	for (int i = 0; i < 4; i++) for (int j = 0; j < 6; j++) OUR_ASSERT(C[i][j] == 3*A[i][j]);
+
+	//Static product vs the runtime one
+	Tensor<float> E_ref({4, 3});
+	tensormul(A.span(), D.span(), E.span());
+	tensormul(TSpan<2, float>(A), TSpan<2, float>(D), E_ref.as_tspan<2>());
+	OUR_ASSERT(close_enough(E.as_tspan<2>(), &E_ref, 1e-5));
+
+	//Big enough to go to the GEMM
+	StaticTensor<float, 20, 30> P;
+	StaticTensor<float, 30, 16> Q;
+	StaticTensor<float, 20, 16> R;
+	for (auto& v : P.storage) v = dist(g);
+	for (auto& v : Q.storage) v = dist(g);
+	Tensor<float> R_ref({20, 16});
+	tensormul(P.span(), Q.span(), R.span());
+	naive_matmul(P.as_tspan<2>(), Q.as_tspan<2>(), &R_ref);
+	OUR_ASSERT(close_enough(R.as_tspan<2>(), &R_ref, 1e-4));
+
+	//Runtime views in and out
+	auto a_static = static_span<4, 6>(TSpan<2, float>(A));
+	OUR_ASSERT(a_static.data == A.storage.data());
+	bool threw = false;
+	try {
+		static_span<6, 4>(A.as_tspan<2>().transpose());
+	} catch (std::runtime_error const&) {
+		threw = true;
+	}
+	OUR_ASSERT(threw);
+
+	//Through ctr_layer, and softmax's unrolled rows (10 wide) against the
+	//generic path (20 wide) and the formulas
+	auto f = std::make_unique<fc>(10, 6, new sigmoid(), new GD<2>(0.1f), new GD<1>(0.1f));
+	StaticTensor<float, 4, 10> y, sm, dsm, dx;
+	f->ctr_ff(A.span(), y.span());
+	Tensor<float> y_ref = f->ff_alloc(RTSpan<float>(A.span()));
+	OUR_ASSERT(close_enough(y.as_tspan<2>(), &y_ref, 1e-5));
+
+	softmax s;
+	s.ff(y.span(), sm.span());
+	for (auto& v : dsm.storage) v = dist(g);
+	s.bp(y.span(), sm.span(), dsm.span(), dx.span());
+	for (int i = 0; i < 4; i++) {
+		float mx = y[i][0], sum = 0;
+		for (int j = 0; j < 10; j++) mx = std::max(mx, y[i][j]);
+		for (int j = 0; j < 10; j++) sum += exp(y[i][j] - mx);
+		for (int j = 0; j < 10; j++) OUR_ASSERT(fabs(sm[i][j] - exp(y[i][j] - mx) / sum) < 1e-6);
+
+		float dot = 0;
+		for (int k = 0; k < 10; k++) dot += sm[i][k] * dsm[i][k];
+		for (int j = 0; j < 10; j++) OUR_ASSERT(fabs(dx[i][j] - sm[i][j] * (dsm[i][j] - dot)) < 1e-5);
+	}
+
+	Tensor<float> wide = make_random_tensor<float>({3, 20}, seed++);
+	Tensor<float> wide_sm = s.ff_alloc(&wide);
+	auto w = wide.as_tspan<2>(), ws = wide_sm.as_tspan<2>();
+	for (int i = 0; i < 3; i++) {
+		float sum = 0;
+		for (int j = 0; j < 20; j++) sum += ws[i][j];
+		OUR_ASSERT(fabs(sum - 1) < 1e-5 && (w[i][0] < w[i][1]) == (ws[i][0] < ws[i][1]));
+	}
+}
+
+void strassen_matches_naive() {
+	static uint32_t seed = 1122;
+	int saved = gemm_strassen_min();
+	gemm_strassen_min() = 16 + rand() % 16;
+
+	//Odd sizes so the peeling gets exercised, a transposed A, and C
+	//starting out nonzero since it accumulates
+	int m = 40 + rand() % 60, n = 40 + rand() % 60, k = 40 + rand() % 60;
+	Tensor<float> At = make_random_tensor<float>({k, m}, seed++);
+	Tensor<float> B = make_random_tensor<float>({k, n}, seed++);
+	Tensor<float> C = make_random_tensor<float>({m, n}, seed++);
+	Tensor<float> expected({m, n});
+	MSpan<float> a = At.as_tspan<2>().transpose();
+
+	naive_matmul(a, &B, &expected);
+	tensorplus(expected.as_tspan<2>(), C.as_tspan<2>(), expected.as_tspan<2>());
+	OUR_ASSERT(gemm_use_strassen<float>(m, n, k));
+	tensormul(a, B.as_tspan<2>(), C.as_tspan<2>());
+	gemm_strassen_min() = saved;
+	OUR_ASSERT(close_enough(&C, &expected, 1e-4));
+}
+
+void gemm_autotune_cache() {
+	static uint32_t seed = 3344;
+	char path[] = "/tmp/gemm_tune_XXXXXX";
+	int fd = mkstemp(path);
+	OUR_ASSERT(fd >= 0);
+	close(fd);
+
+	gemm_autotune_enable(path);
+	int m = 50 + rand() % 50, n = 50 + rand() % 50, k = 50 + rand() % 50;
+	Tensor<float> A = make_random_tensor<float>({m, k}, seed++);
+	Tensor<float> B = make_random_tensor<float>({k, n}, seed++);
+	Tensor<float> C({m, n}), expected({m, n});
+	tensormul(A.as_tspan<2>(), B.as_tspan<2>(), C.as_tspan<2>());
+	gemm_autotune_disable();
+	naive_matmul(&A, &B, &expected);
+	OUR_ASSERT(close_enough(&C, &expected, 1e-4));
+
+	gemm_tuner& t = gemm_tuner_instance();
+	auto table = t.current();
+	auto it = table->find(gemm_tuner::key_for(m, n, k, tensor_num_threads()));
+	OUR_ASSERT(it != table->end() && it->second.valid());
+
+	//Inside a pool worker an untuned class gets the defaults and isn't
+	//tuned or recorded
+	thread_pool::in_worker() = true;
+	gemm_blocking nested = t.lookup(2000, 2000, 2000);
+	thread_pool::in_worker() = false;
+	OUR_ASSERT(nested.mc == GEMM_MC && nested.kc == GEMM_KC && nested.nc == GEMM_NC);
+	OUR_ASSERT(t.current()->size() == table->size());
+
+	//A fresh tuner picks the winner back up, and skips junk lines
+	{
+		std::ofstream out(path, std::ios::app);
+		out << "garbage\n5 5 5 1 7 256 4096\n";
+	}
+	gemm_tuner fresh;
+	fresh.path = path;
+	OUR_ASSERT(fresh.load());
+	OUR_ASSERT(fresh.current()->size() == 1);
+	gemm_blocking b = fresh.current()->begin()->second;
+	OUR_ASSERT(b.mc == it->second.mc && b.kc == it->second.kc && b.nc == it->second.nc);
+
+	unlink(path);
+}
+
+#ifdef TENSOR_ALLOC_STATS
+void alloc_stats_counts() {
+	tensor_alloc_stats& s = tensor_alloc_stats_instance();
+	tensor_alloc_begin_step();
+	size_t live = s.live;
+	{
+		TENSOR_ALLOC_TAG("outer");
+		TENSOR_ALLOC_TAG("t");
+		Tensor<float> a({4, 8});
+		OUR_ASSERT(s.live >= live + 4*8*sizeof(float));
+	}
+	OUR_ASSERT(s.live == live);
+	OUR_ASSERT(tensor_alloc_current_tag().empty());
+	tensor_alloc_counters const& t = s.by_tag["outer/t"];
+	OUR_ASSERT(t.allocs >= 3); //Storage, dims and strides
+	OUR_ASSERT(t.bytes >= 4*8*sizeof(float));
+	OUR_ASSERT(s.step_peak >= live + t.bytes);
+
+	//Arena allocations stay live until the reset
+	tensor_arena arena;
+	{
+		tensor_arena_scope scope(arena);
+		Tensor<float> b({16});
+	}
+	OUR_ASSERT(s.live > live);
+	arena.reset();
+	OUR_ASSERT(s.live == live);
+	OUR_ASSERT(s.step.frees == s.step.allocs);
+}
+#endif
+
 #define EMPTY()
 #define DEFER(x) x EMPTY()
 #define EXPAND(...) __VA_ARGS__
@@ -94,5 +1148,55 @@ int main() {
 
 	mktest(test_transpose_index, 50);
 
+	mktest(gemm_matches_naive, 5);
+
+	mktest(simd_eltwise_matches_scalar, 1);
+
+	mktest(layout_collapse, 1);
+
+	mktest(deep_copy_direction, 1);
+
+	mktest(views_across_threads, 1);
+
+	mktest(storage_is_aligned, 1);
+
+	mktest(arena_reuses_memory, 1);
+
+	mktest(expr_matches_loops, 20);
+
+	mktest(parallel_gemm_matches_naive, 2);
+
+	mktest(reduce_matches_loops, 20);
+
+	mktest(bmm_matches_naive, 5);
+
+	mktest(gemm_trans_alpha_beta, 5);
+
+	mktest(tensor_from_view, 10);
+
+	mktest(half_types, 5);
+
+	mktest(quantized_fc_matches, 10);
+
+	mktest(sparse_fc_matches, 10);
+
+	mktest(permute_matches_index, 10);
+
+	mktest(concat_matches_index, 20);
+
+	mktest(broadcast_matches_loops, 20);
+
+	mktest(mapped_tensor_roundtrip, 5);
+
+	mktest(static_tensor_matches, 10);
+
+	mktest(strassen_matches_naive, 10);
+
+	mktest(gemm_autotune_cache, 1);
+
+#ifdef TENSOR_ALLOC_STATS
+	mktest(alloc_stats_counts, 1);
+#endif
+
     cout << "Test world" << el;
 }
\ No newline at end of file
@@ -0,0 +1,164 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H 1
+
+//One persistent pool of worker threads shared by everything that wants to
+//go parallel (right now that's the GEMM in gemm.h). Starting threads per
+//call would cost more than most of our matrix multiplies, so the workers
+//are started once and sleep on a condition variable between jobs.
+//
+//The only interface is parallel_for(begin, end, f), which calls f(i) for
+//every i in [begin, end) spread across the pool. The calling thread pitches
+//in too, so a pool of N threads has N-1 workers. Indices are handed out one
+//at a time from an atomic counter, so uneven tasks balance themselves.
+//
+//Number of threads:
+//  - TENSORCOPTER_THREADS in the environment, otherwise
+//  - std::thread::hardware_concurrency()
+//  - set_tensor_num_threads(n) changes it at runtime (not while a
+//    parallel_for is running!). n = 1 means everything runs serially.
+//
+//A parallel_for called from inside a worker, or while another thread's
+//parallel_for already has the pool, just runs serially on the caller.
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct thread_pool {
+	std::vector<std::thread> workers;
+
+	std::mutex mtx;
+	std::condition_variable wake, done;
+	std::mutex busy; //Held by whoever currently owns the pool
+
+	//The current job. Type-erased with a plain function pointer so nothing
+	//gets allocated per call.
+	void (*job_fn)(void*, int) = nullptr;
+	void *job_ctx = nullptr;
+	int job_end = 0;
+	std::atomic<int> next{0};
+	int active = 0;      //Workers still inside the current job
+	unsigned epoch = 0;  //Bumped for every new job
+	bool quit = false;
+
+	explicit thread_pool(int nthreads) {
+		for (int i = 0; i < nthreads - 1; i++) {
+			workers.emplace_back([this] { worker_loop(); });
+		}
+	}
+
+	~thread_pool() {
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			quit = true;
+		}
+		wake.notify_all();
+		for (auto& t : workers) t.join();
+	}
+
+	int size() const { return static_cast<int>(workers.size()) + 1; }
+
+	static bool& in_worker() {
+		static thread_local bool ret = false;
+		return ret;
+	}
+
+	void drain() {
+		int i;
+		while ((i = next.fetch_add(1, std::memory_order_relaxed)) < job_end) {
+			job_fn(job_ctx, i);
+		}
+	}
+
+	void worker_loop() {
+		in_worker() = true;
+		unsigned seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lk(mtx);
+				wake.wait(lk, [&] { return quit || epoch != seen; });
+				if (quit) return;
+				seen = epoch;
+			}
+
+			drain();
+
+			std::lock_guard<std::mutex> lk(mtx);
+			if (--active == 0) done.notify_one();
+		}
+	}
+
+	//Returns false if the pool was busy, in which case the caller should
+	//just do the work itself
+	bool run(int begin, int end, void (*fn)(void*, int), void *ctx) {
+		if (workers.empty() || in_worker()) return false;
+		std::unique_lock<std::mutex> owner(busy, std::try_to_lock);
+		if (!owner.owns_lock()) return false;
+
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			job_fn = fn;
+			job_ctx = ctx;
+			job_end = end;
+			next.store(begin, std::memory_order_relaxed);
+			active = static_cast<int>(workers.size());
+			epoch++;
+		}
+		wake.notify_all();
+
+		//Help out, then wait for the stragglers so ctx stays alive long
+		//enough
+		in_worker() = true;
+		drain();
+		in_worker() = false;
+
+		std::unique_lock<std::mutex> lk(mtx);
+		done.wait(lk, [&] { return active == 0; });
+		return true;
+	}
+};
+
+inline int tensor_default_num_threads() {
+	if (char const *env = std::getenv("TENSORCOPTER_THREADS")) {
+		int n = std::atoi(env);
+		if (n > 0) return n;
+	}
+	int hw = static_cast<int>(std::thread::hardware_concurrency());
+	return hw > 0 ? hw : 1;
+}
+
+inline std::unique_ptr<thread_pool>& tensor_pool_ref() {
+	static std::unique_ptr<thread_pool> pool(new thread_pool(tensor_default_num_threads()));
+	return pool;
+}
+
+inline thread_pool& tensor_pool() {
+	return *tensor_pool_ref();
+}
+
+inline int tensor_num_threads() {
+	return tensor_pool().size();
+}
+
+//Not thread-safe: call it while nothing else is using the pool
+inline void set_tensor_num_threads(int n) {
+	if (n < 1) n = 1;
+	if (n == tensor_num_threads()) return;
+	tensor_pool_ref().reset(new thread_pool(n));
+}
+
+template <typename fn>
+void parallel_for(int begin, int end, fn F) {
+	if (end <= begin) return;
+
+	auto call = [](void *ctx, int i) { (*static_cast<fn*>(ctx))(i); };
+	if (end - begin > 1 && tensor_pool().run(begin, end, call, &F)) return;
+
+	for (int i = begin; i < end; i++) F(i);
+}
+
+#endif
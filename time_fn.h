@@ -1,8 +1,9 @@
 #include <chrono>
 #include <iostream>
 
+//Returns the elapsed time in ms, in case the caller wants to compute a rate
 template <typename fn, typename... T>
-void time_fn(int iterations, fn F, T... args) {
+long time_fn(int iterations, fn F, T... args) {
     auto tic = std::chrono::high_resolution_clock::now();
     for (int i = 0; i < iterations; i++) F(args...);
     auto toc = std::chrono::high_resolution_clock::now();
@@ -10,4 +11,5 @@ void time_fn(int iterations, fn F, T... args) {
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(toc-tic).count();
 
     std::cout << iterations << " iterations in " << duration << " ms" << std::endl;
+    return duration;
 }
\ No newline at end of file